@@ -42,6 +42,9 @@ extern "C" {
    *  NOP_DURATION: the duration in cycles of a noop instruction (generally 1 cycle on most small machines)
    *  the_cores - a mapping from the core ids as configured in the OS to physical cores (the OS might not alwas be configured corrrectly)
    *  get_cluster - a function that given a core id returns the socket number ot belongs to
+   *
+   * Note that raplread itself discovers the sockets and the core-to-socket mapping at
+   * runtime; these definitions are only used by the applications.
    */
 
 
@@ -0,0 +1,189 @@
+/*   
+ *   File: rapl_bench.c
+ *   Author: Vasileios Trigonakis <vasileios.trigonakis@epfl.ch>
+ *   Description: 
+ *   rapl_bench.c is part of ASCYLIB
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Vasileios Trigonakis <vasileios.trigonakis@epfl.ch>
+ *	      	      Distributed Programming Lab (LPD), EPFL
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <getopt.h>
+
+#include "rapl_read.h"
+
+/* energy-per-operation sweep over thread counts, with a few built-in workloads */
+
+typedef struct bench_workload
+{
+  const char* name;
+  const char* description;
+  rapl_bench_fn fn;
+} bench_workload_t;
+
+static volatile uint64_t shared_counter __attribute__ ((aligned(CACHE_LINE_SIZE)));
+
+static uint64_t
+bench_spin(int thread, int num_threads, volatile int* stop, void* arg)
+{
+  uint64_t ops = 0;
+  volatile uint64_t x = 0;
+  while (!*stop)
+    {
+      int i;
+      for (i = 0; i < 1024; i++)
+	{
+	  x += i;
+	}
+      ops += 1024;
+    }
+  return ops;
+}
+
+static uint64_t
+bench_atomic(int thread, int num_threads, volatile int* stop, void* arg)
+{
+  uint64_t ops = 0;
+  while (!*stop)
+    {
+      __sync_fetch_and_add(&shared_counter, 1);
+      ops++;
+    }
+  return ops;
+}
+
+static uint64_t
+bench_malloc(int thread, int num_threads, volatile int* stop, void* arg)
+{
+  uint64_t ops = 0;
+  while (!*stop)
+    {
+      void* p = malloc(64 + (ops & 255));
+      *(volatile char*) p = 0;
+      free(p);
+      ops++;
+    }
+  return ops;
+}
+
+static const bench_workload_t workloads[] =
+  {
+    { "spin", "thread-local arithmetic (core-bound)", bench_spin },
+    { "atomic", "increments of a shared counter (contended)", bench_atomic },
+    { "malloc", "malloc/free of small blocks (allocator-bound)", bench_malloc },
+  };
+
+#define NUM_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+static void
+usage(const char* prog)
+{
+  printf("usage: %s [options]\n"
+	 "  -w <workload>  the workload (default: spin)\n"
+	 "  -n <threads>   the maximum number of threads (default: %d)\n"
+	 "  -s <step>      run 1, step, 2 * step, ... threads (default: 1)\n"
+	 "  -d <ms>        the duration of each run (default: 1000)\n"
+	 "workloads:\n", prog, CORES_PER_SOCKET);
+  size_t w;
+  for (w = 0; w < NUM_WORKLOADS; w++)
+    {
+      printf("  %-8s %s\n", workloads[w].name, workloads[w].description);
+    }
+}
+
+int
+main(int argc, char** argv)
+{
+  const bench_workload_t* workload = workloads;
+  int max_threads = CORES_PER_SOCKET, step = 1;
+  uint32_t duration_ms = 1000;
+
+  int c;
+  while ((c = getopt(argc, argv, "w:n:s:d:h")) != -1)
+    {
+      switch (c)
+	{
+	case 'w':
+	  {
+	    size_t w;
+	    for (w = 0; w < NUM_WORKLOADS && strcmp(workloads[w].name, optarg); w++)
+	      ;
+	    if (w == NUM_WORKLOADS)
+	      {
+		usage(argv[0]);
+		return 1;
+	      }
+	    workload = workloads + w;
+	  }
+	  break;
+	case 'n':
+	  max_threads = atoi(optarg);
+	  break;
+	case 's':
+	  step = atoi(optarg);
+	  break;
+	case 'd':
+	  duration_ms = atoi(optarg);
+	  break;
+	default:
+	  usage(argv[0]);
+	  return (c == 'h') ? 0 : 1;
+	}
+    }
+
+  if (rapl_read_init_all() < 0)
+    {
+      printf("[RAPL] Could not initialize\n");
+      return 1;
+    }
+
+  int num_runs = rapl_read_bench_num_runs(max_threads, step);
+  rapl_bench_result_t* results = (rapl_bench_result_t*) calloc(num_runs, sizeof(rapl_bench_result_t));
+  if (results == NULL)
+    {
+      return 1;
+    }
+
+  printf("[RAPL] Workload %s: %s, %u ms per run\n", workload->name, workload->description, duration_ms);
+  int n = rapl_read_bench(workload->fn, NULL, max_threads, step, duration_ms, results);
+  rapl_read_bench_print(results, n);
+
+  int best = 0, i;
+  for (i = 1; i < n; i++)
+    {
+      if (results[i].ops_per_joule > results[best].ops_per_joule)
+	{
+	  best = i;
+	}
+    }
+  if (n > 0)
+    {
+      printf("[RAPL] Most efficient                      : %d threads (%.1f ops/J)\n", 
+	     results[best].num_threads, results[best].ops_per_joule);
+    }
+
+  rapl_read_bench_free(results, n);
+  free(results);
+  rapl_read_term();
+  return (n == num_runs) ? 0 : 1;
+}
@@ -0,0 +1,285 @@
+/*   
+ *   File: rapl_overhead.c
+ *   Author: Vasileios Trigonakis <vasileios.trigonakis@epfl.ch>
+ *   Description: 
+ *   rapl_overhead.c is part of ASCYLIB
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Vasileios Trigonakis <vasileios.trigonakis@epfl.ch>
+ *	      	      Distributed Programming Lab (LPD), EPFL
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <getopt.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "rapl_read.h"
+
+/* the cost of the start/stop edges of each variant, per backend */
+
+typedef struct overhead_variant
+{
+  const char* name;
+  void (*start)();
+  void (*stop)();
+} overhead_variant_t;
+
+static const overhead_variant_t variants[] =
+  {
+    { "start", rapl_read_start, rapl_read_stop },
+    { "pack_pp0", rapl_read_start_pack_pp0, rapl_read_stop_pack_pp0 },
+    { "unprotected", rapl_read_start_pack_pp0_unprotected, rapl_read_stop_pack_pp0_unprotected },
+    { "unprotected_all", rapl_read_start_pack_pp0_unprotected_all, rapl_read_stop_pack_pp0_unprotected_all },
+  };
+
+#define NUM_VARIANTS (sizeof(variants) / sizeof(variants[0]))
+#define WARMUP       100
+
+static int
+cmp_ticks(const void* a, const void* b)
+{
+  rapl_read_ticks x = *(const rapl_read_ticks*) a, y = *(const rapl_read_ticks*) b;
+  return (x > y) - (x < y);
+}
+
+static double
+ticks_ns(rapl_read_ticks t)
+{
+  return rapl_read_ticks_to_seconds(t) * 1e9;
+}
+
+static void
+print_edge(const char* variant, const char* edge, rapl_read_ticks* t, int n, double reads)
+{
+  double sum = 0;
+  int i;
+  for (i = 0; i < n; i++)
+    {
+      sum += t[i];
+    }
+  qsort(t, n, sizeof(rapl_read_ticks), cmp_ticks);
+  printf("[RAPL] %-16s %-5s %10.0f %10.0f %10.0f %10.0f %10.0f %10.0f %8.2f\n", variant, edge, 
+	 ticks_ns(sum / n), ticks_ns(t[n / 2]), ticks_ns(t[(int) (n * 0.9)]), ticks_ns(t[(int) (n * 0.99)]), 
+	 ticks_ns(t[n - 1]), (double) t[n / 2], reads);
+}
+
+/* the cost of the n start/stop pairs of each variant */
+static void
+measure(int n)
+{
+  rapl_read_ticks* start = (rapl_read_ticks*) malloc(n * sizeof(rapl_read_ticks));
+  rapl_read_ticks* stop = (rapl_read_ticks*) malloc(n * sizeof(rapl_read_ticks));
+  if (start == NULL || stop == NULL)
+    {
+      return;
+    }
+
+  printf("[RAPL] Backend %s, %s time base, %d iterations\n", rapl_read_backend_name(), 
+	 rapl_read_clock_name(rapl_read_clock()), n);
+  printf("[RAPL] %-16s %-5s %10s %10s %10s %10s %10s %10s %8s\n", "Variant", "Edge", "Mean (ns)", 
+	 "p50 (ns)", "p90 (ns)", "p99 (ns)", "Max (ns)", "p50 (tck)", "Reads");
+
+  size_t v;
+  for (v = 0; v < NUM_VARIANTS; v++)
+    {
+      int i;
+      for (i = 0; i < WARMUP; i++)
+	{
+	  variants[v].start();
+	  variants[v].stop();
+	}
+
+      rapl_read_counters_t c0, c1;
+      rapl_read_get_counters(&c0);
+      for (i = 0; i < n; i++)
+	{
+	  rapl_read_ticks t0 = rapl_read_timestamp();
+	  variants[v].start();
+	  rapl_read_ticks t1 = rapl_read_timestamp();
+	  variants[v].stop();
+	  rapl_read_ticks t2 = rapl_read_timestamp();
+	  start[i] = t1 - t0;
+	  stop[i] = t2 - t1;
+	}
+      rapl_read_get_counters(&c1);
+
+      /* the reads of a start and a stop edge */
+      double reads = (double) (c1.reads + c1.reg_reads - c0.reads - c0.reg_reads) / (2 * n);
+      print_edge(variants[v].name, "start", start, n, reads);
+      print_edge(variants[v].name, "stop", stop, n, reads);
+    }
+
+  rapl_read_counters_t c;
+  rapl_read_get_counters(&c);
+  printf("[RAPL] Reads                               : %" PRIu64 " counters in %" PRIu64 " batches, %" PRIu64 
+	 " registers\n", c.reads, c.batches, c.reg_reads);
+
+  /* the time in the reads, in a pass of its own: timing the reads adds timestamps to 
+     the edges */
+  rapl_read_time_counters(1);
+  for (v = 0; v < NUM_VARIANTS; v++)
+    {
+      rapl_read_counters_t c0, c1;
+      int i;
+      rapl_read_get_counters(&c0);
+      for (i = 0; i < n; i++)
+	{
+	  variants[v].start();
+	  variants[v].stop();
+	}
+      rapl_read_get_counters(&c1);
+      printf("[RAPL] %-16s time in reads per edge (ns) : %10.1f\n", variants[v].name, 
+	     (double) (c1.read_ns - c0.read_ns) / (2 * n));
+    }
+  rapl_read_time_counters(0);
+  free(start);
+  free(stop);
+}
+
+static void*
+init_socket(void* arg)
+{
+  rapl_read_init((int) (intptr_t) arg);
+  return NULL;
+}
+
+/* initialize all the sockets, with the calling thread responsible for the socket 
+   of cpu 0, so that every variant reads */
+static int
+init(const char* backend)
+{
+  if (backend != NULL && rapl_read_select_backend(backend) < 0)
+    {
+      printf("[RAPL] Unknown backend %s\n", backend);
+      return -1;
+    }
+
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  CPU_SET(0, &cpuset);
+  sched_setaffinity(0, sizeof(cpu_set_t), &cpuset);
+  if (rapl_read_init(0) != 1)
+    {
+      printf("[RAPL] Could not initialize\n");
+      return -1;
+    }
+
+  int num_sockets = rapl_read_num_sockets();
+  int seen[num_sockets];
+  memset(seen, 0, sizeof(seen));
+  seen[rapl_read_cpu_socket(0)] = 1;
+
+  int cpu, s;
+  for (cpu = 1; cpu < CPU_SETSIZE; cpu++)
+    {
+      s = rapl_read_cpu_socket(cpu);
+      if (s < 0 || seen[s])
+	{
+	  continue;
+	}
+      pthread_t t;
+      if (pthread_create(&t, NULL, init_socket, (void*) (intptr_t) cpu) == 0)
+	{
+	  pthread_join(t, NULL);
+	}
+      seen[s] = 1;
+    }
+  return 0;
+}
+
+static void
+usage(const char* prog)
+{
+  printf("usage: %s [options]\n"
+	 "  -n <iterations>  the start/stop pairs per variant (default: 10000)\n"
+	 "  -b <backends>    comma-separated backends, each run in its own process\n"
+	 "                   (default: the default backend)\n", prog);
+}
+
+int
+main(int argc, char** argv)
+{
+  int n = 10000;
+  char* backends = NULL;
+
+  int c;
+  while ((c = getopt(argc, argv, "n:b:h")) != -1)
+    {
+      switch (c)
+	{
+	case 'n':
+	  n = atoi(optarg);
+	  break;
+	case 'b':
+	  backends = optarg;
+	  break;
+	default:
+	  usage(argv[0]);
+	  return (c == 'h') ? 0 : 1;
+	}
+    }
+  if (n < 1)
+    {
+      usage(argv[0]);
+      return 1;
+    }
+
+  if (backends == NULL)
+    {
+      if (init(NULL) < 0)
+	{
+	  return 1;
+	}
+      measure(n);
+      rapl_read_term();
+      return 0;
+    }
+
+  /* the backend is selected once per process */
+  int ret = 0;
+  char* saveptr;
+  char* backend;
+  for (backend = strtok_r(backends, ",", &saveptr); backend != NULL; backend = strtok_r(NULL, ",", &saveptr))
+    {
+      fflush(stdout);
+      pid_t pid = fork();
+      if (pid == 0)
+	{
+	  if (init(backend) < 0)
+	    {
+	      exit(1);
+	    }
+	  measure(n);
+	  rapl_read_term();
+	  exit(0);
+	}
+
+      int status;
+      if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	{
+	  printf("[RAPL] Backend %s failed\n", backend);
+	  ret = 1;
+	}
+    }
+  return ret;
+}
@@ -30,46 +30,217 @@
 
 #include "rapl_read.h"
 
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <numa.h>
+#if defined(__x86_64__) || defined(__i386__)
+#  include <cpuid.h>
+#endif
+#if defined(__linux__) && defined(__has_include)
+#  if __has_include(<linux/io_uring.h>)
+#    include <linux/io_uring.h>
+#    define RAPL_HAVE_IO_URING 1
+#  endif
+#  if __has_include(<linux/perf_event.h>)
+#    include <linux/perf_event.h>
+#    define RAPL_HAVE_PERF_EVENT 1
+#  endif
+#endif
+
 int rapl_cpu_model;
-int rapl_msr_fd[NUMBER_OF_SOCKETS];
+
+/* topology, discovered at runtime from /sys/devices/system/cpu */
+int rapl_num_sockets = 0;
+int rapl_num_cpus = 0;
+int* rapl_cpu_socket;		/* cpu -> socket index (-1 if offline) */
+int* rapl_socket_cpu;		/* socket index -> representative (lowest) cpu */
+int* rapl_socket_pkg_id;	/* socket index -> physical_package_id */
+static pthread_once_t rapl_topology_once = PTHREAD_ONCE_INIT;
+static int rapl_topology_ok = 0;
 
 #define RAPL_INIT_OFFS 17
-int rapl_initialized[NUMBER_OF_SOCKETS] = {};
-int rapl_resp_core[NUMBER_OF_SOCKETS] = {};
-int rapl_dram_counter = 0;
+
+/* the 64-bit accumulators of the counters of a socket */
+typedef struct rapl_acc
+{
+  volatile uint32_t lock;
+  uint64_t last[RAPL_DOMAIN_NUM];
+  uint64_t total[RAPL_DOMAIN_NUM];
+} __attribute__ ((aligned(CACHE_LINE_SIZE))) rapl_acc_t;
+
+/* the state of a socket, allocated on the NUMA node of the socket and in cache 
+   lines of its own, so that the cores of different sockets never share a line */
+typedef struct rapl_socket_state
+{
+  int msr_fd;
+  int msr_core;			/* the cpu that reads the counters */
+  int initialized;
+  int resp_core;		/* the responsible core, offset by RAPL_INIT_OFFS */
+  int tjmax;			/* C, from MSR_TEMPERATURE_TARGET */
+  /* what the reads of the socket cost (relaxed atomic adds: the sampler, the poller,
+     the parallel helpers, and the callers may read the socket concurrently) */
+  uint64_t reads;
+  uint64_t batches;
+  uint64_t reg_reads;
+  uint64_t read_ticks;
+  rapl_acc_t acc;
+} __attribute__ ((aligned(CACHE_LINE_SIZE))) rapl_socket_state_t;
+
+rapl_socket_state_t** rapl_sockets;	/* socket -> its state */
+static int rapl_numa = 0;	/* allocate with libnuma */
 uint32_t rapl_num_active_sockets = 0;
 double rapl_power_units, rapl_energy_units, rapl_time_units;
 __thread int rapl_core;
 __thread int rapl_socket;
-double rapl_package_before[NUMBER_OF_SOCKETS], rapl_package_after[NUMBER_OF_SOCKETS], rapl_pp0_before[NUMBER_OF_SOCKETS], 
-  rapl_pp0_after[NUMBER_OF_SOCKETS], rapl_pp1_before[NUMBER_OF_SOCKETS], rapl_pp1_after[NUMBER_OF_SOCKETS], 
-  rapl_dram_before[NUMBER_OF_SOCKETS], rapl_dram_after[NUMBER_OF_SOCKETS];
 double rapl_thermal_spec_power, rapl_minimum_power, rapl_maximum_power, rapl_time_window;
 double rapl_pkg_power_limit_1, rapl_pkg_time_window_1, rapl_pkg_power_limit_2, rapl_pkg_time_window_2;
-double rapl_acc_pkg_throttled_time, rapl_acc_rapl_pp0_throttled_time;
 long long int rapl_msr_pkg_settings;
-int rapl_pp0_policy, rapl_pp1_policy;
 
-uint64_t rapl_start_ts[NUMBER_OF_SOCKETS], rapl_stop_ts[NUMBER_OF_SOCKETS];
+/* the throttled-time counters (MSR_*_PERF_STATUS), 32 bits in time units */
+#define RAPL_THROTTLE_PKG  0
+#define RAPL_THROTTLE_PP0  1
+#define RAPL_THROTTLE_DRAM 2
+#define RAPL_THROTTLE_NUM  3
+
+static const uint32_t rapl_throttle_reg[RAPL_THROTTLE_NUM] =
+  {
+    MSR_PKG_PERF_STATUS, MSR_PP0_PERF_STATUS, MSR_DRAM_PERF_STATUS
+  };
+static int rapl_throttle_available[RAPL_THROTTLE_NUM];
+
+/* the activity counters of the cpu that reads a socket: the TSC, APERF, MPERF, and
+   the C-state residencies (RAPL_CSTATE_*, counting at the TSC rate), 64 bits */
+#define RAPL_ACT_TSC    0
+#define RAPL_ACT_APERF  1
+#define RAPL_ACT_MPERF  2
+#define RAPL_ACT_CSTATE 3	/* + RAPL_CSTATE_* */
+#define RAPL_ACT_NUM    (RAPL_ACT_CSTATE + RAPL_CSTATE_NUM)
+
+static const uint32_t rapl_act_reg[RAPL_ACT_NUM] =
+  {
+    MSR_IA32_TSC, MSR_IA32_APERF, MSR_IA32_MPERF,
+    MSR_PKG_C2_RESIDENCY, MSR_PKG_C3_RESIDENCY, MSR_PKG_C6_RESIDENCY, MSR_PKG_C7_RESIDENCY,
+    MSR_CORE_C3_RESIDENCY, MSR_CORE_C6_RESIDENCY, MSR_CORE_C7_RESIDENCY
+  };
+static int rapl_act_available[RAPL_ACT_NUM];
+static int rapl_thermal_available = 0;
+/* the RAPL_EDGE_* registers that the edges read besides the throttled time */
+static int rapl_edge_flags = 0;
+
+/* the RAPL_THERM_* bits that are recorded */
+#define RAPL_THERM_STATUS_BITS (RAPL_THERM_THROTTLE | RAPL_THERM_PROCHOT | RAPL_THERM_CRITICAL \
+				| RAPL_THERM_POWER_LIMIT)
+#define RAPL_THERM_BITS (RAPL_THERM_STATUS_BITS | (RAPL_THERM_STATUS_BITS << 1))
+
+/* the edges of a measurement on a socket, written by the reader of the socket only */
+typedef struct rapl_session_socket
+{
+  uint64_t before[RAPL_DOMAIN_NUM];	/* raw counter values at the start */
+  uint64_t after[RAPL_DOMAIN_NUM];	/* raw counter values at the stop */
+  uint32_t acc_epoch[2];	/* rapl_acc_epoch before the start and after the stop */
+  uint32_t throttled_before[RAPL_THROTTLE_NUM];	/* raw throttled-time counters */
+  uint32_t throttled_after[RAPL_THROTTLE_NUM];
+  int act_on;			/* the activity counters were read at the start */
+  uint64_t act_before[RAPL_ACT_NUM];	/* raw activity counters */
+  uint64_t act_after[RAPL_ACT_NUM];
+  /* the temperatures (C) of the window, from its edges and from the sampler, which
+     folds its samples into the open windows (under the lock) */
+  volatile uint32_t therm_lock;
+  int therm_open;
+  uint32_t temp_samples;
+  double temp_pkg_sum, temp_core_sum;
+  double temp_pkg_peak, temp_core_peak;
+  uint32_t therm_start[2];	/* the thermal status bits of the package and the core */
+  uint32_t therm_stop[2];
+  uint32_t therm_seen[2];	/* the status bits seen during the window */
+  rapl_read_ticks start_ts;
+  rapl_read_ticks stop_ts;
+} __attribute__ ((aligned(CACHE_LINE_SIZE))) rapl_session_socket_t;
+
+/* the state of a measurement; the RR_* macros use the default session */
+struct rapl_session
+{
+  rapl_session_socket_t** sk;	/* socket -> its edges, on the node of the socket */
+  double* core_before;		/* core -> energy (J), with per-core counters */
+  double* core_after;
+  rapl_read_ticks core_start_ts, core_stop_ts;
+  struct rapl_session* next;	/* the list of the sessions, for the sampler */
+  int pp0_policy, pp1_policy;
+};
+
+static rapl_session_t* rapl_session_default;
+static rapl_session_t* rapl_sessions = NULL;
+static pthread_rwlock_t rapl_sessions_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* the counter backend and the domains that it provides */
+const rapl_backend_t* rapl_backend = NULL;
+int rapl_domain_available[RAPL_DOMAIN_NUM];
+double rapl_domain_units[RAPL_DOMAIN_NUM];
+uint64_t rapl_domain_range[RAPL_DOMAIN_NUM];
+static pthread_once_t rapl_backend_once = PTHREAD_ONCE_INIT;
+static int rapl_backend_ok = 0;
+
+/* read plans, compiled once the domains are known: the domains of an edge, in the 
+   order of the raw values of the backend read. The edges store the raw values in 
+   their slots; the units are applied when the energy is computed. */
+typedef struct rapl_plan
+{
+  int n;
+  int domains[RAPL_DOMAIN_NUM];
+} rapl_plan_t;
+
+static rapl_plan_t rapl_plan_all;	/* all the available domains */
+static rapl_plan_t rapl_plan_pack_pp0;	/* dram (if available), package, pp0 */
+
+/* the per-core counters of the backend, if any */
+int rapl_num_cores = 0;
+int* rapl_core_cpu;		/* core -> the cpu that reads it */
+static double rapl_core_units;
+static uint64_t rapl_core_range;
 
 #define FOR_ALL_SOCKETS(s)			\
-  for (s = 0; s < NUMBER_OF_SOCKETS; s++)
+  for (s = 0; s < rapl_num_sockets; s++)
 
 #define FOR_ALL_SELECTED_SOCKETS(socket, s)	\
-  for (s = 0; s < NUMBER_OF_SOCKETS; s++)	\
+  for (s = 0; s < rapl_num_sockets; s++)	\
     if (socket == RR_NODE_ALL || s == socket)
 
 #define NON_SELECTED_SOCKETS			\
   else
 
 
+/* the pattern is not used as a format (the path is also opened for writes, as root):
+   its only conversion must be one %d, which is replaced with the cpu */
+static void
+rapl_msr_path(int core, char* path, size_t len)
+{
+  const char* msr_dev = getenv("RAPL_MSR_DEV");
+  const char* d = (msr_dev != NULL) ? strstr(msr_dev, "%d") : NULL;
+  if (d == NULL || strchr(msr_dev, '%') != d || strchr(d + 2, '%') != NULL)
+    {
+      msr_dev = RAPL_MSR_DEV_DEFAULT;
+      d = strstr(msr_dev, "%d");
+    }
+  snprintf(path, len, "%.*s%d%s", (int) (d - msr_dev), msr_dev, core, d + 2);
+}
+
 int
 open_msr(int core) 
 {
   char msr_filename[BUFSIZ];
   int fd;
 
-  sprintf(msr_filename, "/dev/cpu/%d/msr", core);
+  rapl_msr_path(core, msr_filename, sizeof(msr_filename));
   fd = open(msr_filename, O_RDONLY);
   if (fd < 0) 
     {
@@ -94,11 +265,13 @@ open_msr(int core)
 }
 
 long long int
-read_msr(int fd, int which) 
+read_msr(int fd, uint32_t which) 
 {
   uint64_t data;
 
-  if (pread(fd, &data, sizeof(data), which) != sizeof(data)) 
+  /* the register is the offset: unsigned, as the AMD registers (0xC00xxxxx) do not 
+     fit in an int */
+  if (pread(fd, &data, sizeof(data), (off_t) which) != sizeof(data)) 
     {
       perror("rdmsr:pread");
       exit(127);
@@ -107,6 +280,339 @@ read_msr(int fd, int which)
   return (long long) data;
 }
 
+/*********************************************************************************/
+/* batched MSR reads: one io_uring submission for a whole edge instead of one 
+   pread per counter. Each thread uses its own ring. */
+/*********************************************************************************/
+
+#if RAPL_HAVE_IO_URING == 1
+
+typedef struct rapl_uring
+{
+  int fd;
+  unsigned entries;
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe* sqes;
+  struct io_uring_cqe* cqes;
+  void* sq_ptr;
+  size_t sq_len;
+  void* cq_ptr;
+  size_t cq_len;
+  size_t sqes_len;
+  struct iovec* iov;
+} rapl_uring_t;
+
+static volatile int rapl_uring_enabled = 0;
+static unsigned rapl_uring_entries = 8;
+static pthread_key_t rapl_uring_key;
+static pthread_once_t rapl_uring_key_once = PTHREAD_ONCE_INIT;
+static __thread rapl_uring_t* rapl_uring_self = NULL;
+static __thread int rapl_uring_failed = 0;
+
+static void
+rapl_uring_destroy(void* arg)
+{
+  rapl_uring_t* u = (rapl_uring_t*) arg;
+  if (u == NULL)
+    {
+      return;
+    }
+  if (u->sqes != NULL && u->sqes != MAP_FAILED)
+    {
+      munmap(u->sqes, u->sqes_len);
+    }
+  if (u->cq_ptr != NULL && u->cq_ptr != MAP_FAILED && u->cq_ptr != u->sq_ptr)
+    {
+      munmap(u->cq_ptr, u->cq_len);
+    }
+  if (u->sq_ptr != NULL && u->sq_ptr != MAP_FAILED)
+    {
+      munmap(u->sq_ptr, u->sq_len);
+    }
+  if (u->fd >= 0)
+    {
+      close(u->fd);
+    }
+  free(u->iov);
+  free(u);
+}
+
+static void
+rapl_uring_key_create()
+{
+  pthread_key_create(&rapl_uring_key, rapl_uring_destroy);
+}
+
+static rapl_uring_t*
+rapl_uring_create(unsigned entries)
+{
+  rapl_uring_t* u = (rapl_uring_t*) calloc(1, sizeof(rapl_uring_t));
+  if (u == NULL)
+    {
+      return NULL;
+    }
+
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  u->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (u->fd < 0)
+    {
+      free(u);
+      return NULL;
+    }
+  u->entries = p.sq_entries;
+
+  u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      if (u->cq_len > u->sq_len)
+	{
+	  u->sq_len = u->cq_len;
+	}
+      u->cq_len = u->sq_len;
+    }
+
+  u->sq_ptr = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  if (u->sq_ptr == MAP_FAILED)
+    {
+      rapl_uring_destroy(u);
+      return NULL;
+    }
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      u->cq_ptr = u->sq_ptr;
+    }
+  else
+    {
+      u->cq_ptr = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+      if (u->cq_ptr == MAP_FAILED)
+	{
+	  rapl_uring_destroy(u);
+	  return NULL;
+	}
+    }
+  u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = (struct io_uring_sqe*) mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+					u->fd, IORING_OFF_SQES);
+  u->iov = (struct iovec*) calloc(p.sq_entries, sizeof(struct iovec));
+  if (u->sqes == MAP_FAILED || u->iov == NULL)
+    {
+      rapl_uring_destroy(u);
+      return NULL;
+    }
+
+  u->sq_tail = (unsigned*) ((char*) u->sq_ptr + p.sq_off.tail);
+  u->sq_mask = (unsigned*) ((char*) u->sq_ptr + p.sq_off.ring_mask);
+  u->sq_array = (unsigned*) ((char*) u->sq_ptr + p.sq_off.array);
+  u->cq_head = (unsigned*) ((char*) u->cq_ptr + p.cq_off.head);
+  u->cq_tail = (unsigned*) ((char*) u->cq_ptr + p.cq_off.tail);
+  u->cq_mask = (unsigned*) ((char*) u->cq_ptr + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe*) ((char*) u->cq_ptr + p.cq_off.cqes);
+  return u;
+}
+
+/* the ring of the calling thread, created on first use */
+static inline rapl_uring_t*
+rapl_uring_get()
+{
+  if (rapl_uring_self == NULL && !rapl_uring_failed)
+    {
+      rapl_uring_self = rapl_uring_create(rapl_uring_entries);
+      if (rapl_uring_self == NULL)
+	{
+	  rapl_uring_failed = 1;
+	  perror("[RAPL] io_uring_setup, falling back to pread");
+	  return NULL;
+	}
+      pthread_once(&rapl_uring_key_once, rapl_uring_key_create);
+      pthread_setspecific(rapl_uring_key, rapl_uring_self);
+    }
+  return rapl_uring_self;
+}
+
+/* submit n (<= entries) reads and wait for all of them */
+static void
+rapl_uring_read(rapl_uring_t* u, int n, int* fds, uint32_t* msrs, uint64_t* vals)
+{
+  unsigned tail = *u->sq_tail;
+  unsigned mask = *u->sq_mask;
+  int i;
+  for (i = 0; i < n; i++)
+    {
+      unsigned idx = (tail + i) & mask;
+      struct io_uring_sqe* sqe = u->sqes + idx;
+      memset(sqe, 0, sizeof(*sqe));
+      u->iov[i].iov_base = vals + i;
+      u->iov[i].iov_len = sizeof(uint64_t);
+      sqe->opcode = IORING_OP_READV;
+      sqe->fd = fds[i];
+      sqe->addr = (uint64_t) (uintptr_t) (u->iov + i);
+      sqe->len = 1;
+      sqe->off = (uint64_t) msrs[i];
+      sqe->user_data = i;
+      u->sq_array[idx] = idx;
+    }
+  __atomic_store_n(u->sq_tail, tail + n, __ATOMIC_RELEASE);
+
+  int submitted = 0, completed = 0;
+  while (completed < n)
+    {
+      int ret = syscall(__NR_io_uring_enter, u->fd, n - submitted, n - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+      if (ret < 0)
+	{
+	  if (errno == EINTR)
+	    {
+	      continue;
+	    }
+	  perror("rdmsr:io_uring_enter");
+	  exit(127);
+	}
+      submitted += ret;
+
+      unsigned head = *u->cq_head;
+      unsigned cq_tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+      for (; head != cq_tail; head++)
+	{
+	  struct io_uring_cqe* cqe = u->cqes + (head & *u->cq_mask);
+	  if (cqe->res != sizeof(uint64_t))
+	    {
+	      errno = (cqe->res < 0) ? -cqe->res : EIO;
+	      perror("rdmsr:io_uring");
+	      exit(127);
+	    }
+	  completed++;
+	}
+      __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+#endif	/* RAPL_HAVE_IO_URING */
+
+/* read msrs[i] from fds[i] into vals[i] for i < n */
+static void
+rapl_msr_read_batch(int n, int* fds, uint32_t* msrs, uint64_t* vals)
+{
+#if RAPL_HAVE_IO_URING == 1
+  rapl_uring_t* u;
+  if (rapl_uring_enabled && (u = rapl_uring_get()) != NULL)
+    {
+      int i;
+      for (i = 0; i < n; i += u->entries)
+	{
+	  int chunk = (n - i < (int) u->entries) ? (n - i) : (int) u->entries;
+	  rapl_uring_read(u, chunk, fds + i, msrs + i, vals + i);
+	}
+      return;
+    }
+#endif
+  int i;
+  for (i = 0; i < n; i++)
+    {
+      vals[i] = (uint64_t) read_msr(fds[i], msrs[i]);
+    }
+}
+
+int
+rapl_read_uring_init()
+{
+#if RAPL_HAVE_IO_URING == 1
+  unsigned entries = 8;
+  while (entries < (unsigned) (rapl_num_sockets * 4))
+    {
+      entries <<= 1;
+    }
+  rapl_uring_entries = entries;
+
+  /* fail early if io_uring is not available to this process */
+  if (rapl_uring_get() == NULL)
+    {
+      return -1;
+    }
+  rapl_uring_enabled = 1;
+  return 0;
+#else
+  printf("[RAPL] Compiled without io_uring support\n");
+  return -1;
+#endif
+}
+
+void
+rapl_read_uring_term()
+{
+#if RAPL_HAVE_IO_URING == 1
+  rapl_uring_enabled = 0;
+#endif
+}
+
+/*********************************************************************************/
+/* processor models */
+/*********************************************************************************/
+
+#define RAPL_D(d) (1 << RAPL_DOMAIN_##d)
+#define RAPL_CLIENT (RAPL_D(PKG) | RAPL_D(PP0) | RAPL_D(PP1))
+#define RAPL_SERVER (RAPL_D(PKG) | RAPL_D(DRAM))
+/* the DRAM energy units of the servers since Haswell-EP do not follow MSR_RAPL_POWER_UNIT */
+#define RAPL_DRAM_UNITS_SERVER { 0, 0, 0, 15.3e-6, 0 }
+/* and the platform counts in J on Sapphire Rapids */
+#define RAPL_UNITS_SPR { 0, 0, 0, 15.3e-6, 1.0 }
+/* the residency counters: all of them on the clients up to Kaby Lake, no C7 on the 
+   servers up to Broadwell, and only the common ones on the later models */
+#define RAPL_C(c) (1 << RAPL_CSTATE_##c)
+#define RAPL_CSTATES_MIN (RAPL_C(PKG_C2) | RAPL_C(PKG_C6) | RAPL_C(CORE_C6))
+#define RAPL_CSTATES_EP (RAPL_CSTATES_MIN | RAPL_C(PKG_C3) | RAPL_C(CORE_C3))
+#define RAPL_CSTATES_CLIENT (RAPL_CSTATES_EP | RAPL_C(PKG_C7) | RAPL_C(CORE_C7))
+
+static const rapl_cpu_info_t rapl_cpu_table[] =
+  {
+    { CPU_SANDYBRIDGE, "Sandy Bridge", RAPL_CLIENT, { 0 }, 0, 0, 0, RAPL_CSTATES_CLIENT },
+    { CPU_SANDYBRIDGE_EP, "Sandy Bridge-EP", RAPL_SERVER | RAPL_D(PP0), { 0 }, 1, 1, 1, RAPL_CSTATES_EP },
+    { CPU_IVYBRIDGE, "Ivy Bridge", RAPL_CLIENT, { 0 }, 0, 0, 0, RAPL_CSTATES_CLIENT },
+    { CPU_IVYBRIDGE_EP, "Ivy Bridge-EP", RAPL_SERVER | RAPL_D(PP0), { 0 }, 1, 1, 1, RAPL_CSTATES_EP },
+    { CPU_HASWELL, "Haswell", RAPL_CLIENT, { 0 }, 0, 0, 0, RAPL_CSTATES_CLIENT },
+    { CPU_HASWELL_ULT, "Haswell-ULT", RAPL_CLIENT, { 0 }, 0, 0, 0, RAPL_CSTATES_CLIENT },
+    { CPU_HASWELL_GT3E, "Haswell-GT3e", RAPL_CLIENT, { 0 }, 0, 0, 0, RAPL_CSTATES_CLIENT },
+    { CPU_HASWELL_EP, "Haswell-EP", RAPL_SERVER, RAPL_DRAM_UNITS_SERVER, 1, 0, 1, RAPL_CSTATES_EP },
+    { CPU_BROADWELL, "Broadwell", RAPL_CLIENT, { 0 }, 0, 0, 0, RAPL_CSTATES_CLIENT },
+    { CPU_BROADWELL_GT3E, "Broadwell-GT3e", RAPL_CLIENT, { 0 }, 0, 0, 0, RAPL_CSTATES_CLIENT },
+    { CPU_BROADWELL_EP, "Broadwell-EP", RAPL_SERVER, RAPL_DRAM_UNITS_SERVER, 1, 0, 1, RAPL_CSTATES_EP },
+    { CPU_BROADWELL_DE, "Broadwell-DE", RAPL_SERVER, RAPL_DRAM_UNITS_SERVER, 1, 0, 1, RAPL_CSTATES_EP },
+    { CPU_SKYLAKE_MOBILE, "Skylake", RAPL_CLIENT | RAPL_D(DRAM) | RAPL_D(PSYS), { 0 }, 1, 0, 0, RAPL_CSTATES_CLIENT },
+    { CPU_SKYLAKE, "Skylake", RAPL_CLIENT | RAPL_D(DRAM) | RAPL_D(PSYS), { 0 }, 1, 0, 0, RAPL_CSTATES_CLIENT },
+    { CPU_SKYLAKE_X, "Skylake-X", RAPL_SERVER, RAPL_DRAM_UNITS_SERVER, 1, 0, 1, RAPL_CSTATES_MIN },
+    { CPU_KABYLAKE_MOBILE, "Kaby Lake", RAPL_CLIENT | RAPL_D(DRAM) | RAPL_D(PSYS), { 0 }, 1, 0, 0, RAPL_CSTATES_CLIENT },
+    { CPU_KABYLAKE, "Kaby Lake", RAPL_CLIENT | RAPL_D(DRAM) | RAPL_D(PSYS), { 0 }, 1, 0, 0, RAPL_CSTATES_CLIENT },
+    { CPU_ICELAKE_MOBILE, "Ice Lake", RAPL_CLIENT | RAPL_D(PSYS), { 0 }, 0, 0, 0, RAPL_CSTATES_MIN },
+    { CPU_ICELAKE_X, "Ice Lake-X", RAPL_SERVER, RAPL_DRAM_UNITS_SERVER, 1, 0, 1, RAPL_CSTATES_MIN },
+    { CPU_ICELAKE_D, "Ice Lake-D", RAPL_SERVER, RAPL_DRAM_UNITS_SERVER, 1, 0, 1, RAPL_CSTATES_MIN },
+    { CPU_ALDERLAKE, "Alder Lake", RAPL_CLIENT | RAPL_D(PSYS), { 0 }, 0, 0, 0, RAPL_CSTATES_MIN },
+    { CPU_ALDERLAKE_MOBILE, "Alder Lake", RAPL_CLIENT | RAPL_D(PSYS), { 0 }, 0, 0, 0, RAPL_CSTATES_MIN },
+    { CPU_RAPTORLAKE, "Raptor Lake", RAPL_CLIENT | RAPL_D(PSYS), { 0 }, 0, 0, 0, RAPL_CSTATES_MIN },
+    { CPU_RAPTORLAKE_P, "Raptor Lake", RAPL_CLIENT | RAPL_D(PSYS), { 0 }, 0, 0, 0, RAPL_CSTATES_MIN },
+    { CPU_RAPTORLAKE_S, "Raptor Lake", RAPL_CLIENT | RAPL_D(PSYS), { 0 }, 0, 0, 0, RAPL_CSTATES_MIN },
+    { CPU_SAPPHIRERAPIDS_X, "Sapphire Rapids", RAPL_SERVER | RAPL_D(PSYS), RAPL_UNITS_SPR, 1, 0, 1, RAPL_CSTATES_MIN },
+    { CPU_EMERALDRAPIDS_X, "Emerald Rapids", RAPL_SERVER | RAPL_D(PSYS), RAPL_UNITS_SPR, 1, 0, 1, RAPL_CSTATES_MIN },
+  };
+
+/* the capabilities of the detected model; none for the backends without a model */
+static const rapl_cpu_info_t rapl_cpu_none = { -1, "unknown", 0, { 0 }, 0, 0, 0, 0 };
+static const rapl_cpu_info_t* rapl_cpu = &rapl_cpu_none;
+
+const rapl_cpu_info_t*
+rapl_read_cpu_info(int model)
+{
+  size_t i;
+  for (i = 0; i < sizeof(rapl_cpu_table) / sizeof(rapl_cpu_table[0]); i++)
+    {
+      if (rapl_cpu_table[i].model == model)
+	{
+	  return rapl_cpu_table + i;
+	}
+    }
+  return NULL;
+}
+
 int
 detect_cpu(void) 
 {
@@ -159,27 +665,10 @@ detect_cpu(void)
 
   fclose(fff);
 
-  switch(model) 
-    {
-    case CPU_SANDYBRIDGE:
-      // printf("[RAPL] Found Sandybridge CPU\n");
-      break;
-    case CPU_SANDYBRIDGE_EP:
-      // printf("[RAPL] Found Sandybridge-EP CPU\n");
-      break;
-    case CPU_IVYBRIDGE:
-      // printf("[RAPL] Found Ivybridge CPU\n");
-      break;
-    case CPU_IVYBRIDGE_EP:
-      // printf("[RAPL] Found Ivybridge-EP CPU\n");
-      break;
-    case CPU_HASWELL:
-      // printf("[RAPL] Found Haswell CPU\n");
-      break;
-    default:	
+  if (rapl_read_cpu_info(model) == NULL)
+    {
       printf("[RAPL] Unsupported model %d\n", model);
       model=-1;
-      break;
     }
 
   return model;
@@ -194,7 +683,7 @@ rapl_get_core_with_offs()
 static inline int
 rapl_allowed()
 {
-  if (!rapl_initialized[rapl_socket] || rapl_resp_core[rapl_socket] != rapl_get_core_with_offs())
+  if (!rapl_sockets[rapl_socket]->initialized || rapl_sockets[rapl_socket]->resp_core != rapl_get_core_with_offs())
     {
       return 0;
     }
@@ -204,833 +693,6011 @@ rapl_allowed()
 static inline int
 rapl_allowed_once()
 {
-  if (!rapl_initialized[rapl_socket] || rapl_resp_core[rapl_socket] != rapl_get_core_with_offs())
+  if (!rapl_sockets[rapl_socket]->initialized || rapl_sockets[rapl_socket]->resp_core != rapl_get_core_with_offs())
     {
       return 0;
     }
 
   int min_socket = 0;
-  while (min_socket < NUMBER_OF_SOCKETS && !rapl_initialized[min_socket])
+  while (min_socket < rapl_num_sockets && !rapl_sockets[min_socket]->initialized)
     {
       min_socket++;
     }
   return (rapl_socket == min_socket);
 }
 
+/*********************************************************************************/
+/* self-instrumentation: what the reads of the library cost, counted in the state of
+   each socket and summed on request. The time of the reads costs two timestamps per
+   read, so it is only taken if enabled. */
+/*********************************************************************************/
 
+static int rapl_counters_time = 0;
 
+/* relaxed: only the sums matter, and an add is nothing next to the read it counts */
+#define RAPL_COUNT(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
 
-int
-rapl_read_init(int core)
-{
-  rapl_core = core; 
-  rapl_socket = get_cluster(core);
+static inline rapl_read_ticks rapl_read_now();
+static inline double rapl_ticks_to_s(rapl_read_ticks ticks);
 
-  if (rapl_core >= (NUMBER_OF_SOCKETS * CORES_PER_SOCKET))
-    {
-      return 2;
-    }
-  
-  /* try to be the "guy" for this socket */
-  if (__sync_bool_compare_and_swap(rapl_resp_core + rapl_socket, 0, rapl_get_core_with_offs()) == 0)
+/* rapl_backend->read, counted on the sockets that are read */
+static inline void
+rapl_backend_read(int s0, int s1, const int* domains, int n, uint64_t* out)
+{
+  rapl_read_ticks t0 = 0;
+  if (rapl_counters_time)
     {
-      return 2;
+      t0 = rapl_read_now();
     }
-
-
-  __sync_fetch_and_add(&rapl_num_active_sockets, 1);
-
-  rapl_cpu_model = detect_cpu();
-  if (rapl_cpu_model < 0)
+  rapl_backend->read(s0, s1, domains, n, out);
+  if (rapl_counters_time)
     {
-      printf("[RAPL] Unsupported processor\n");
-      return -1;
+      RAPL_COUNT(rapl_sockets[s0]->read_ticks, rapl_read_now() - t0);
     }
-
-  if (!((rapl_cpu_model == CPU_SANDYBRIDGE) || (rapl_cpu_model == CPU_IVYBRIDGE) || (rapl_cpu_model == CPU_HASWELL)))
+  RAPL_COUNT(rapl_sockets[s0]->batches, 1);
+  int s;
+  for (s = s0; s < s1; s++)
     {
-      rapl_dram_counter = 1;
+      RAPL_COUNT(rapl_sockets[s]->reads, n);
     }
+}
 
+void
+rapl_read_time_counters(int enable)
+{
+  rapl_counters_time = enable;
+}
 
-  rapl_msr_fd[rapl_socket] = open_msr(core);
-  if (rapl_msr_fd[rapl_socket] < 0)
+void
+rapl_read_get_counters(rapl_read_counters_t* c)
+{
+  uint64_t read_ticks = 0;
+  int s;
+  memset(c, 0, sizeof(*c));
+  for (s = 0; rapl_sockets != NULL && s < rapl_num_sockets; s++)
     {
-      printf("[RAPL] Cannot read MSR\n");
-      return -1;
+      c->reads += __atomic_load_n(&rapl_sockets[s]->reads, __ATOMIC_RELAXED);
+      c->batches += __atomic_load_n(&rapl_sockets[s]->batches, __ATOMIC_RELAXED);
+      c->reg_reads += __atomic_load_n(&rapl_sockets[s]->reg_reads, __ATOMIC_RELAXED);
+      read_ticks += __atomic_load_n(&rapl_sockets[s]->read_ticks, __ATOMIC_RELAXED);
     }
+  c->read_ns = (uint64_t) (rapl_ticks_to_s(read_ticks) * 1e9);
+}
 
-  rapl_initialized[rapl_socket] = 1;
-
-
-  if (!rapl_allowed_once())
+void
+rapl_read_reset_counters()
+{
+  int s;
+  for (s = 0; rapl_sockets != NULL && s < rapl_num_sockets; s++)
     {
-      return 1;
+      __atomic_store_n(&rapl_sockets[s]->reads, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&rapl_sockets[s]->batches, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&rapl_sockets[s]->reg_reads, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&rapl_sockets[s]->read_ticks, 0, __ATOMIC_RELAXED);
     }
-  /* Calculate the units used */
-  long long int result = read_msr(rapl_msr_fd[rapl_socket], MSR_RAPL_POWER_UNIT);
-  rapl_power_units = pow(0.5, (double)(result&0xf));
-  rapl_energy_units = pow(0.5, (double)((result>>8)&0x1f));
-  rapl_time_units = pow(0.5, (double)((result>>16)&0xf));
-
-
-  /* Show package power info */
-  result = read_msr(rapl_msr_fd[rapl_socket], MSR_PKG_POWER_INFO);
-  rapl_thermal_spec_power = rapl_power_units * (double)(result&0x7fff);
-  rapl_minimum_power = rapl_power_units * (double)((result>>16)&0x7fff);
-  rapl_maximum_power = rapl_power_units * (double)((result>>32)&0x7fff);
-  rapl_time_window = rapl_time_units * (double)((result>>48)&0x7fff);
-
-
-  /* Show package power limit */
-  result = read_msr(rapl_msr_fd[rapl_socket], MSR_PKG_RAPL_POWER_LIMIT);
-  rapl_msr_pkg_settings = result;
-  rapl_pkg_power_limit_1 = rapl_power_units * (double)((result>>0)&0x7FFF);
-  rapl_pkg_time_window_1 = rapl_time_units * (double)((result>>17)&0x007F);
-  rapl_pkg_power_limit_2 = rapl_power_units * (double)((result>>32)&0x7FFF);
-  rapl_pkg_time_window_2 = rapl_time_units * (double)((result>>49)&0x007F);
-
-  return 1;
 }
 
-int
-rapl_read_init_all()
+/*********************************************************************************/
+/* 64-bit accumulation of the (wrapping) energy counters */
+/*********************************************************************************/
+
+#define RAPL_ACC_PERIOD_MIN_MS 10
+#define RAPL_ACC_PERIOD_MAX_MS 60000
+
+static volatile int rapl_accumulating = 0;
+/* bumped before and after each change of rapl_accumulating: odd while it changes, 
+   and (epoch >> 1) & 1 is the state. An edge that reads the same even epoch before
+   its start read and after its stop read was read in one representation. */
+static volatile uint32_t rapl_acc_epoch = 0;
+static pthread_t rapl_acc_thread;
+static pthread_mutex_t rapl_acc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rapl_acc_cond = PTHREAD_COND_INITIALIZER;
+static uint32_t rapl_acc_period_ms;
+
+/* counts between two raw values of domain d, across (at most) one wrap. With a 
+   range of 0 (a 64-bit counter) the unsigned arithmetic wraps at 2^64. */
+static inline uint64_t
+rapl_counter_delta(int d, uint64_t before, uint64_t after)
 {
-  __sync_fetch_and_add(&rapl_num_active_sockets, NUMBER_OF_SOCKETS);
-
-  rapl_cpu_model = detect_cpu();
-  if (rapl_cpu_model < 0)
+  if (after >= before)
     {
-      printf("[RAPL] Unsupported processor\n");
-      return -1;
+      return after - before;
     }
+  return rapl_domain_range[d] - before + after;
+}
 
-  if (!((rapl_cpu_model == CPU_SANDYBRIDGE) || (rapl_cpu_model == CPU_IVYBRIDGE) || (rapl_cpu_model == CPU_HASWELL)))
+static inline void
+rapl_spin_lock(volatile uint32_t* lock)
+{
+  while (__sync_lock_test_and_set(lock, 1))
     {
-      rapl_dram_counter = 1;
+      while (*lock)
+	{
+	  __asm__ __volatile__ ("" ::: "memory");
+	}
     }
+}
 
+static inline void
+rapl_spin_unlock(volatile uint32_t* lock)
+{
+  __sync_lock_release(lock);
+}
 
-  int s;
-  FOR_ALL_SOCKETS(s)
-  {
-    int core;
-    for (core = 0; core < NUMBER_OF_SOCKETS * CORES_PER_SOCKET; core++)
-      {
-	if (s == get_cluster(core))
-	  {
-	    rapl_msr_fd[s] = open_msr(core);
-	    break;
-	  }
-      }
-
-    if (rapl_msr_fd[s] < 0)
-      {
-	printf("[RAPL] Cannot read MSR\n");
-	return -1;
-      }
-
-    rapl_initialized[s] = 1;
-  }
- 
-  s = 0;
-  /* Calculate the units used */
-  long long int result = read_msr(rapl_msr_fd[s], MSR_RAPL_POWER_UNIT);
-  rapl_power_units = pow(0.5, (double)(result&0xf));
-  rapl_energy_units = pow(0.5, (double)((result>>8)&0x1f));
-  rapl_time_units = pow(0.5, (double)((result>>16)&0xf));
-
+static inline void
+rapl_acc_lock(int s)
+{
+  rapl_spin_lock(&rapl_sockets[s]->acc.lock);
+}
 
-  /* Show package power info */
-  result = read_msr(rapl_msr_fd[s], MSR_PKG_POWER_INFO);
-  rapl_thermal_spec_power = rapl_power_units * (double)(result&0x7fff);
-  rapl_minimum_power = rapl_power_units * (double)((result>>16)&0x7fff);
-  rapl_maximum_power = rapl_power_units * (double)((result>>32)&0x7fff);
-  rapl_time_window = rapl_time_units * (double)((result>>48)&0x7fff);
+static inline void
+rapl_acc_unlock(int s)
+{
+  rapl_spin_unlock(&rapl_sockets[s]->acc.lock);
+}
 
+/* fold a raw reading of domain `d` of socket `s` into the 64-bit accumulator. 
+   The reading must be taken while holding the lock of the socket. */
+static inline uint64_t
+rapl_acc_fold(int s, int d, uint64_t raw)
+{
+  rapl_acc_t* a = &rapl_sockets[s]->acc;
+  a->total[d] += rapl_counter_delta(d, a->last[d], raw);
+  a->last[d] = raw;
+  return a->total[d];
+}
 
-  /* Show package power limit */
-  result = read_msr(rapl_msr_fd[s], MSR_PKG_RAPL_POWER_LIMIT);
-  rapl_msr_pkg_settings = result;
-  rapl_pkg_power_limit_1 = rapl_power_units * (double)((result>>0)&0x7FFF);
-  rapl_pkg_time_window_1 = rapl_time_units * (double)((result>>17)&0x007F);
-  rapl_pkg_power_limit_2 = rapl_power_units * (double)((result>>32)&0x7FFF);
-  rapl_pkg_time_window_2 = rapl_time_units * (double)((result>>49)&0x007F);
-  
-  return 1;
+/* read domain `d` of socket `s` and fold it into the 64-bit accumulator */
+static inline uint64_t
+rapl_acc_update(int s, int d)
+{
+  uint64_t raw;
+  rapl_acc_lock(s);
+  rapl_backend_read(s, s + 1, &d, 1, &raw);
+  uint64_t total = rapl_acc_fold(s, d, raw);
+  rapl_acc_unlock(s);
+  return total;
 }
 
-void
-rapl_read_start()
+/* read domain d of socket s: the raw value, or the 64-bit accumulated one if 
+   accumulation is enabled */
+static inline uint64_t
+rapl_read_energy(int s, int d)
 {
-  if (!rapl_allowed())
+  if (rapl_accumulating)
     {
-      return;
+      return rapl_acc_update(s, d);
     }
-  long long int result; 
-
-  result = read_msr(rapl_msr_fd[rapl_socket], MSR_PKG_ENERGY_STATUS);
-  rapl_package_before[rapl_socket] = (double)result * rapl_energy_units;
+  uint64_t raw;
+  rapl_backend_read(s, s + 1, &d, 1, &raw);
+  return raw;
+}
 
-  if ((rapl_cpu_model == CPU_SANDYBRIDGE_EP) || (rapl_cpu_model == CPU_IVYBRIDGE_EP))
+/* read the domains[0..n) of sockets [s0, s1) as one batch, into 
+   out[(s - s0) * n + i] (raw or accumulated values, like rapl_read_energy) */
+static void
+rapl_read_energy_batch(int s0, int s1, const int* domains, int n, uint64_t* out)
+{
+  if (!rapl_accumulating)
     {
-      result = read_msr(rapl_msr_fd[rapl_socket], MSR_PKG_PERF_STATUS);
-      rapl_acc_pkg_throttled_time = (double)result * rapl_time_units;
+      rapl_backend_read(s0, s1, domains, n, out);
+      return;
     }
 
-  result = read_msr(rapl_msr_fd[rapl_socket], MSR_PP0_ENERGY_STATUS);
-  rapl_pp0_before[rapl_socket] = (double)result * rapl_energy_units;
-
-  result = read_msr(rapl_msr_fd[rapl_socket], MSR_PP0_POLICY);
-  rapl_pp0_policy = (int)result&0x001f;
-
-  /* only available on *Bridge-EP */
-  if ((rapl_cpu_model == CPU_SANDYBRIDGE_EP) || (rapl_cpu_model == CPU_IVYBRIDGE_EP))
+  int s, i, j;
+  for (s = s0; s < s1; s++)
     {
-      result = read_msr(rapl_msr_fd[rapl_socket],MSR_PP0_PERF_STATUS);
-      rapl_acc_rapl_pp0_throttled_time = (double)result * rapl_time_units;
+      rapl_acc_lock(s);
     }
-
-  /* not available on *Bridge-EP */
-  if ((rapl_cpu_model == CPU_SANDYBRIDGE) || (rapl_cpu_model == CPU_IVYBRIDGE) || (rapl_cpu_model == CPU_HASWELL)) 
+  rapl_backend_read(s0, s1, domains, n, out);
+  for (s = s0, j = 0; s < s1; s++)
     {
-      result = read_msr(rapl_msr_fd[rapl_socket], MSR_PP1_ENERGY_STATUS);
-      rapl_pp1_before[rapl_socket] = (double)result * rapl_energy_units;
-      result = read_msr(rapl_msr_fd[rapl_socket], MSR_PP1_POLICY);
-      rapl_pp1_policy = (int)result&0x001f;
+      for (i = 0; i < n; i++, j++)
+	{
+	  out[j] = rapl_acc_fold(s, domains[i], out[j]);
+	}
     }
-  else 
+  for (s = s0; s < s1; s++)
     {
-      result = read_msr(rapl_msr_fd[rapl_socket], MSR_DRAM_ENERGY_STATUS);
-      rapl_dram_before[rapl_socket] = (double)result * rapl_energy_units;
+      rapl_acc_unlock(s);
     }
-  rapl_start_ts[rapl_socket] = rapl_read_getticks();
 }
 
+/* the energy (in J) that corresponds to a full turn of the counter of domain d */
+static inline double
+rapl_energy_wrap(int d)
+{
+  double range = rapl_domain_range[d] ? (double) rapl_domain_range[d] : 18446744073709551616.0;
+  return range * rapl_domain_units[d];
+}
 
-
-void
-rapl_read_stop()
+/* the energy in J of a raw (or accumulated) value of domain d */
+static inline double
+rapl_raw_energy(int d, uint64_t raw)
 {
-   if (!rapl_allowed())
-    {
-      return;
-    }
+  return (double) raw * rapl_domain_units[d];
+}
 
-  rapl_stop_ts[rapl_socket] = rapl_read_getticks();
-  long long int result; 
+/* energy difference in J between two raw (or accumulated) values of domain d. 
+   W/o accumulation a single wrap of the counter is corrected */
+static inline double
+rapl_energy_delta(int d, uint64_t before, uint64_t after)
+{
+  return (double) rapl_counter_delta(d, before, after) * rapl_domain_units[d];
+}
 
-  result = read_msr(rapl_msr_fd[rapl_socket], MSR_PKG_ENERGY_STATUS);  
-  rapl_package_after[rapl_socket] = (double)result * rapl_energy_units;
-  result = read_msr(rapl_msr_fd[rapl_socket], MSR_PP0_ENERGY_STATUS);
-  rapl_pp0_after[rapl_socket] = (double)result * rapl_energy_units;
+static void*
+rapl_acc_poller(void* arg)
+{
+  struct timespec next;
+  clock_gettime(CLOCK_REALTIME, &next);
 
-  if ((rapl_cpu_model == CPU_SANDYBRIDGE) || (rapl_cpu_model == CPU_IVYBRIDGE) || (rapl_cpu_model == CPU_HASWELL)) 
+  pthread_mutex_lock(&rapl_acc_mutex);
+  while (rapl_accumulating)
     {
-      result = read_msr(rapl_msr_fd[rapl_socket], MSR_PP1_ENERGY_STATUS);
-      rapl_pp1_after[rapl_socket] = (double)result * rapl_energy_units;
-    }
-  else 
-    {
-      result = read_msr(rapl_msr_fd[rapl_socket], MSR_DRAM_ENERGY_STATUS);
-      rapl_dram_after[rapl_socket] = (double)result * rapl_energy_units;
+      int s, d;
+      FOR_ALL_SOCKETS(s)
+      {
+	if (!rapl_sockets[s]->initialized)
+	  {
+	    continue;
+	  }
+	for (d = 0; d < RAPL_DOMAIN_NUM; d++)
+	  {
+	    if (rapl_domain_available[d])
+	      {
+		rapl_acc_update(s, d);
+	      }
+	  }
+      }
+
+      next.tv_sec += rapl_acc_period_ms / 1000;
+      next.tv_nsec += (rapl_acc_period_ms % 1000) * 1000000L;
+      if (next.tv_nsec >= 1000000000L)
+	{
+	  next.tv_nsec -= 1000000000L;
+	  next.tv_sec++;
+	}
+      /* returns early when rapl_read_accumulate_stop() signals */
+      pthread_cond_timedwait(&rapl_acc_cond, &rapl_acc_mutex, &next);
     }
+  pthread_mutex_unlock(&rapl_acc_mutex);
+  return NULL;
 }
 
+static void
+rapl_acc_set(int on)
+{
+  __atomic_fetch_add(&rapl_acc_epoch, 1, __ATOMIC_SEQ_CST);
+  rapl_accumulating = on;
+  __atomic_fetch_add(&rapl_acc_epoch, 1, __ATOMIC_SEQ_CST);
+}
 
-void
-rapl_read_start_pack_pp0()
+int
+rapl_read_accumulate_start(uint32_t period_ms)
 {
-  if (!rapl_allowed())
+  if (rapl_accumulating)
     {
-      return;
+      return -1;
     }
 
-  rapl_start_ts[rapl_socket] = rapl_read_getticks();
-  long long int result; 
-  if (rapl_dram_counter)
+  if (period_ms == 0)
     {
-      result = read_msr(rapl_msr_fd[rapl_socket], MSR_DRAM_ENERGY_STATUS);
-      rapl_dram_before[rapl_socket] = (double)result;
+      /* poll ~8 times per wrap at the maximum power of the package */
+      double max_power = rapl_maximum_power;
+      if (max_power < 2 * rapl_thermal_spec_power)
+	{
+	  max_power = 2 * rapl_thermal_spec_power;
+	}
+      if (max_power <= 0)
+	{
+	  max_power = 500;
+	}
+      period_ms = (uint32_t) (1000 * rapl_energy_wrap(RAPL_DOMAIN_PKG) / max_power / 8);
     }
-  result = read_msr(rapl_msr_fd[rapl_socket], MSR_PKG_ENERGY_STATUS);
-  rapl_package_before[rapl_socket] = (double)result;
-  result = read_msr(rapl_msr_fd[rapl_socket], MSR_PP0_ENERGY_STATUS);
-  rapl_pp0_before[rapl_socket] = (double)result;
-}
-
-void
-rapl_read_stop_pack_pp0()
-{
-  if (!rapl_allowed())
+  if (period_ms < RAPL_ACC_PERIOD_MIN_MS)
     {
-      return;
+      period_ms = RAPL_ACC_PERIOD_MIN_MS;
     }
-
-  long long int result; 
-  result = read_msr(rapl_msr_fd[rapl_socket], MSR_PP0_ENERGY_STATUS);
-  rapl_pp0_after[rapl_socket] = (double)result;
-  result = read_msr(rapl_msr_fd[rapl_socket], MSR_PKG_ENERGY_STATUS);  
-  rapl_package_after[rapl_socket] = (double)result;
-  if (rapl_dram_counter)
+  if (period_ms > RAPL_ACC_PERIOD_MAX_MS)
     {
-      result = read_msr(rapl_msr_fd[rapl_socket], MSR_DRAM_ENERGY_STATUS);
-      rapl_dram_after[rapl_socket] = (double)result;
+      period_ms = RAPL_ACC_PERIOD_MAX_MS;
     }
-  rapl_stop_ts[rapl_socket] = rapl_read_getticks();
+  rapl_acc_period_ms = period_ms;
+
+  int s, d;
+  FOR_ALL_SOCKETS(s)
+  {
+    if (!rapl_sockets[s]->initialized)
+      {
+	continue;
+      }
+    for (d = 0; d < RAPL_DOMAIN_NUM; d++)
+      {
+	if (rapl_domain_available[d])
+	  {
+	    rapl_backend_read(s, s + 1, &d, 1, &rapl_sockets[s]->acc.last[d]);
+	    rapl_sockets[s]->acc.total[d] = rapl_sockets[s]->acc.last[d];
+	  }
+      }
+  }
 
-  rapl_package_before[rapl_socket] *= rapl_energy_units;
-  rapl_package_after[rapl_socket] *= rapl_energy_units;
-  rapl_pp0_before[rapl_socket] *= rapl_energy_units;
-  rapl_pp0_after[rapl_socket] *= rapl_energy_units;
-  if(rapl_dram_counter)
+  rapl_acc_set(1);
+  if (pthread_create(&rapl_acc_thread, NULL, rapl_acc_poller, NULL) != 0)
     {
-      rapl_dram_before[rapl_socket] *= rapl_energy_units;
-      rapl_dram_after[rapl_socket] *= rapl_energy_units;
+      rapl_acc_set(0);
+      return -1;
     }
+  return (int) period_ms;
 }
 
 void
-rapl_read_start_pack_pp0_unprotected()
+rapl_read_accumulate_stop()
 {
-  rapl_start_ts[rapl_socket] = rapl_read_getticks();
-  long long int result; 
-  if (rapl_dram_counter)
+  if (!rapl_accumulating)
     {
-      result = read_msr(rapl_msr_fd[rapl_socket], MSR_DRAM_ENERGY_STATUS);
-      rapl_dram_before[rapl_socket] = (double)result;
+      return;
     }
-  result = read_msr(rapl_msr_fd[rapl_socket], MSR_PKG_ENERGY_STATUS);
-  rapl_package_before[rapl_socket] = (double)result;
-  result = read_msr(rapl_msr_fd[rapl_socket], MSR_PP0_ENERGY_STATUS);
-  rapl_pp0_before[rapl_socket] = (double)result;
+  pthread_mutex_lock(&rapl_acc_mutex);
+  rapl_acc_set(0);
+  pthread_cond_signal(&rapl_acc_cond);
+  pthread_mutex_unlock(&rapl_acc_mutex);
+  pthread_join(rapl_acc_thread, NULL);
 }
 
-void
-rapl_read_stop_pack_pp0_unprotected()
+
+
+
+/*********************************************************************************/
+/* time base */
+/*********************************************************************************/
+
+#define RAPL_TIMEBASE_CALIBRATION_NS 20000000L /* 20 ms */
+#define RAPL_TIMEBASE_CALIBRATION_TRIES 5
+
+int rapl_clock = RAPL_CLOCK_MONOTONIC_RAW;
+double rapl_ticks_per_s = 1e9;
+static pthread_once_t rapl_timebase_once = PTHREAD_ONCE_INIT;
+
+static inline uint64_t
+rapl_monotonic_raw_ns()
 {
-  long long int result; 
-  result = read_msr(rapl_msr_fd[rapl_socket], MSR_PP0_ENERGY_STATUS);
-  rapl_pp0_after[rapl_socket] = (double)result;
-  result = read_msr(rapl_msr_fd[rapl_socket], MSR_PKG_ENERGY_STATUS);  
-  rapl_package_after[rapl_socket] = (double)result;
-  if (rapl_dram_counter)
-    {
-      result = read_msr(rapl_msr_fd[rapl_socket], MSR_DRAM_ENERGY_STATUS);
-      rapl_dram_after[rapl_socket] = (double)result;
-    }
-  rapl_stop_ts[rapl_socket] = rapl_read_getticks();
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-  rapl_package_before[rapl_socket] *= rapl_energy_units;
-  rapl_package_after[rapl_socket] *= rapl_energy_units;
-  rapl_pp0_before[rapl_socket] *= rapl_energy_units;
-  rapl_pp0_after[rapl_socket] *= rapl_energy_units;
-  if(rapl_dram_counter)
+/* the timestamp of the start/stop edges, in the calibrated time base */
+static inline rapl_read_ticks
+rapl_read_now()
+{
+  if (rapl_clock == RAPL_CLOCK_TSC)
     {
-      rapl_dram_before[rapl_socket] *= rapl_energy_units;
-      rapl_dram_after[rapl_socket] *= rapl_energy_units;
+      return rapl_read_getticks();
     }
+  return rapl_monotonic_raw_ns();
 }
 
+static inline double
+rapl_ticks_to_s(rapl_read_ticks ticks)
+{
+  return (double) ticks / rapl_ticks_per_s;
+}
 
-void
-rapl_read_start_pack_pp0_unprotected_all()
+static int
+rapl_tsc_invariant()
 {
-  rapl_start_ts[0] = rapl_read_getticks();
-  int i;
-  for (i = 1; i < NUMBER_OF_SOCKETS; i++)
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int eax, ebx, ecx, edx;
+  if (__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) == 0 || eax < 0x80000007)
     {
-      rapl_start_ts[i] = rapl_start_ts[0];
+      return 0;
     }
-
-  FOR_ALL_SOCKETS(i)
-  {
-    long long int result; 
-    if (rapl_dram_counter)
-      {
-	result = read_msr(rapl_msr_fd[i], MSR_DRAM_ENERGY_STATUS);
-	rapl_dram_before[i] = (double)result;
-      }
-    result = read_msr(rapl_msr_fd[i], MSR_PKG_ENERGY_STATUS);
-    rapl_package_before[i] = (double)result;
-    result = read_msr(rapl_msr_fd[i], MSR_PP0_ENERGY_STATUS);
-    rapl_pp0_before[i] = (double)result;
-  }
+  __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+  return (edx >> 8) & 1;	/* Invariant TSC */
+#else
+  return 0;
+#endif
 }
 
-void
-rapl_read_stop_pack_pp0_unprotected_all()
+/* the (clock, tsc) pair with the tightest bracketing of the tsc read */
+static void
+rapl_timebase_sample(uint64_t* ns, rapl_read_ticks* tsc)
 {
+  uint64_t best = UINT64_MAX;
   int i;
-  FOR_ALL_SOCKETS(i)
-  {
-    long long int result; 
-    result = read_msr(rapl_msr_fd[i], MSR_PP0_ENERGY_STATUS);
-    rapl_pp0_after[i] = (double)result;
-    result = read_msr(rapl_msr_fd[i], MSR_PKG_ENERGY_STATUS);  
-    rapl_package_after[i] = (double)result;
-    if (rapl_dram_counter)
-      {
-	result = read_msr(rapl_msr_fd[i], MSR_DRAM_ENERGY_STATUS);
-	rapl_dram_after[i] = (double)result;
-      }
-  }
-
-  rapl_stop_ts[0] = rapl_read_getticks();
-  for (i = 1; i < NUMBER_OF_SOCKETS; i++)
+  for (i = 0; i < 16; i++)
     {
-      rapl_stop_ts[i] = rapl_stop_ts[0];
+      uint64_t t0 = rapl_monotonic_raw_ns();
+      rapl_read_ticks c = rapl_read_getticks();
+      uint64_t t1 = rapl_monotonic_raw_ns();
+      if (t1 - t0 < best)
+	{
+	  best = t1 - t0;
+	  *ns = t0 + (t1 - t0) / 2;
+	  *tsc = c;
+	}
     }
-
-  FOR_ALL_SOCKETS(i)
-  {
-    rapl_package_before[i] *= rapl_energy_units;
-    rapl_package_after[i] *= rapl_energy_units;
-    rapl_pp0_before[i] *= rapl_energy_units;
-    rapl_pp0_after[i] *= rapl_energy_units;
-    if(rapl_dram_counter)
-      {
-	rapl_dram_before[i] *= rapl_energy_units;
-	rapl_dram_after[i] *= rapl_energy_units;
-      }
-  }
 }
 
-void
-rapl_read_print(int detailed)
+static void
+rapl_timebase_calibrate()
 {
-  if (!rapl_allowed())
+  if (!rapl_tsc_invariant())
     {
+      printf("[RAPL] The TSC is not invariant, using clock_gettime(CLOCK_MONOTONIC_RAW)\n");
       return;
     }
 
-  if (rapl_package_after[rapl_socket] < rapl_package_before[rapl_socket])
+  /* the median of a few calibrations filters out preemptions */
+  double hz[RAPL_TIMEBASE_CALIBRATION_TRIES];
+  int i, j;
+  for (i = 0; i < RAPL_TIMEBASE_CALIBRATION_TRIES; i++)
     {
-      printf("[RAPL] WARNING: the measurements might have overflown!\n");
-    }
-
-  if (detailed > RAPL_PRINT_NOT)
-    {
-      if (detailed >= RAPL_PRINT_ALL)
+      uint64_t ns0 = 0, ns1 = 0;
+      rapl_read_ticks tsc0 = 0, tsc1 = 0;
+      struct timespec wait = { 0, RAPL_TIMEBASE_CALIBRATION_NS / RAPL_TIMEBASE_CALIBRATION_TRIES };
+      rapl_timebase_sample(&ns0, &tsc0);
+      nanosleep(&wait, NULL);
+      rapl_timebase_sample(&ns1, &tsc1);
+      hz[i] = (double) (tsc1 - tsc0) * 1e9 / (double) (ns1 - ns0);
+      for (j = i; j > 0 && hz[j - 1] > hz[j]; j--)
 	{
-	  printf("[RAPL] Power units                         : %.3f W\n", rapl_power_units);
-	  printf("[RAPL] Energy units                        : %.8f J\n", rapl_energy_units);
-	  printf("[RAPL] Time units                          : %.8f s\n", rapl_time_units);
-	  printf("[RAPL] PowerPlane0 core %2d policy          : %d\n", rapl_core, rapl_pp0_policy);
+	  double tmp = hz[j];
+	  hz[j] = hz[j - 1];
+	  hz[j - 1] = tmp;
 	}
+    }
 
-      if (detailed >= RAPL_PRINT_ALL)
-	{
-	  printf("[RAPL] Package thermal spec                : %.3f W\n", rapl_thermal_spec_power);
-	  printf("[RAPL] Package minimum power               : %.3f W\n", rapl_minimum_power);
-	  printf("[RAPL] Package maximum power               : %.3f W\n", rapl_maximum_power);
-	  printf("[RAPL] Package maximum time window         : %.6f s\n", rapl_time_window);
-	  long long int result = rapl_msr_pkg_settings;
-	  printf("[RAPL] Package power limits are            : %s\n",  (result >> 63) ? "locked" : "unlocked");
-	  printf("[RAPL] Package power limit #1              : %.3f W for %.6f s (%s, %s)\n", 
-		 rapl_pkg_power_limit_1, rapl_pkg_time_window_1,
-		 (result & (1LL<<15)) ? "enabled" : "disabled",
-		 (result & (1LL<<16)) ? "clamped" : "not_clamped");
-	  printf("[RAPL] Package power limit #2              : %.3f W for %.6fs (%s, %s)\n", 
-		 rapl_pkg_power_limit_2, rapl_pkg_time_window_2,
-		 (result & (1LL<<47)) ? "enabled" : "disabled",
-		 (result & (1LL<<48)) ? "clamped" : "not_clamped");
+  rapl_ticks_per_s = hz[RAPL_TIMEBASE_CALIBRATION_TRIES / 2];
+  rapl_clock = RAPL_CLOCK_TSC;
+}
 
-	  if ((rapl_cpu_model == CPU_SANDYBRIDGE_EP) || (rapl_cpu_model == CPU_IVYBRIDGE_EP))
-	    {
-	      printf("[RAPL] Accumulated Package Throttled Time  : %.6fs\n", rapl_acc_pkg_throttled_time);
-	      printf("[RAPL] PowerPlane0 (core) Accumulated Throttled Time : %.6fs\n", rapl_acc_rapl_pp0_throttled_time);
-	    }
-	}
-  
-      if (detailed >= RAPL_PRINT_BEF_AFT)
-	{
-	  printf("[RAPL] BEFORE Package energy               : %.6f J\n", rapl_package_before[rapl_socket]);
-	  printf("[RAPL] BEFORE] PowerPlane0 core %2d energy   : %.6f J\n", rapl_core, rapl_pp0_before[rapl_socket]);
-	}
+static void
+rapl_timebase_init()
+{
+  pthread_once(&rapl_timebase_once, rapl_timebase_calibrate);
+}
 
+double
+rapl_read_ticks_to_seconds(rapl_read_ticks ticks)
+{
+  rapl_timebase_init();
+  return rapl_ticks_to_s(ticks);
+}
 
-      if (detailed >= RAPL_PRINT_BEF_AFT)
-	{
-	  /* not available on *Bridge-EP */
-	  if ((rapl_cpu_model == CPU_SANDYBRIDGE) || (rapl_cpu_model == CPU_IVYBRIDGE) || (rapl_cpu_model == CPU_HASWELL)) 
-	    {
-	      if (rapl_pp1_before[rapl_socket] > 0)
-		{
-		  printf("[RAPL] PowerPlane1 (on-core GPU) before[rapl_socket]: %.6fJ\n", rapl_pp1_before[rapl_socket]);
-		  printf("[RAPL] PowerPlane1 (on-core GPU) %d policy: %d\n", rapl_core, rapl_pp1_policy);
-		}
-	    }
-	  else 
-	    {
-	      printf("[RAPL] DRAM energy before[rapl_socket]: %.6fJ\n", rapl_dram_before[rapl_socket]);
-	    }
-	}
+rapl_read_ticks
+rapl_read_timestamp()
+{
+  rapl_timebase_init();
+  return rapl_read_now();
+}
 
-      rapl_read_ticks duration = rapl_stop_ts[rapl_socket] - rapl_start_ts[rapl_socket];
-      double duration_s = (double) duration / ((CORE_SPEED_GHZ) * 1e9);
-      if (detailed >= RAPL_PRINT_ENE)
-	{
-	  printf("[RAPL] Duration                            : %f s\n", duration_s);
-	}
+int
+rapl_read_clock()
+{
+  rapl_timebase_init();
+  return rapl_clock;
+}
 
-      if (detailed >= RAPL_PRINT_BEF_AFT)
+const char*
+rapl_read_clock_name(int clock)
+{
+  return (clock == RAPL_CLOCK_TSC) ? "TSC" : "CLOCK_MONOTONIC_RAW";
+}
+
+/*********************************************************************************/
+/* topology */
+/*********************************************************************************/
+
+#define RAPL_SYSFS_CPU "/sys/devices/system/cpu"
+
+static int
+rapl_sysfs_read_int(const char* path, int* val)
+{
+  FILE* f = fopen(path, "r");
+  if (f == NULL)
+    {
+      return -1;
+    }
+  int ok = (fscanf(f, "%d", val) == 1);
+  fclose(f);
+  return ok ? 0 : -1;
+}
+
+/* a zeroed, cache-line-aligned block on the NUMA node of socket s (the local node 
+   for the sockets that do not map to a node, e.g., when replaying a trace) */
+static void*
+rapl_socket_alloc(int s, size_t size)
+{
+  void* p;
+  if (rapl_numa)
+    {
+      int node = numa_node_of_cpu(rapl_socket_cpu[s]);
+      p = (node >= 0) ? numa_alloc_onnode(size, node) : numa_alloc_local(size);
+      if (p == NULL)
 	{
-	  printf("[RAPL] AFTER Package energy                : %.6f J\n", rapl_package_after[rapl_socket]);
-	  printf("[RAPL] AFTER PowerPlane0 core %2d energy    : %.6f J\n", rapl_core, rapl_pp0_after[rapl_socket]);
+	  return NULL;
 	}
+    }
+  else if (posix_memalign(&p, CACHE_LINE_SIZE, size) != 0)
+    {
+      return NULL;
+    }
+  /* touch the pages here, on the node that they are bound to */
+  memset(p, 0, size);
+  return p;
+}
 
-      double rapl_package = rapl_package_after[rapl_socket] - rapl_package_before[rapl_socket];
-      double rapl_pp0 = rapl_pp0_after[rapl_socket] - rapl_pp0_before[rapl_socket];
-      double rapl_dram = rapl_dram_after[rapl_socket] - rapl_dram_before[rapl_socket];
-      double rapl_rest = rapl_package - rapl_pp0;
-      if (detailed >= RAPL_PRINT_ENE)
+static void
+rapl_socket_free(void* p, size_t size)
+{
+  if (p == NULL)
+    {
+      return;
+    }
+  if (rapl_numa)
+    {
+      numa_free(p, size);
+    }
+  else
+    {
+      free(p);
+    }
+}
+
+/* the package id of each cpu (-1 if offline), from sysfs */
+static int
+rapl_topology_sysfs(int* num_cpus_out, int** pkg_of_cpu_out)
+{
+  int num_cpus = 0;
+  DIR* dir = opendir(RAPL_SYSFS_CPU);
+  if (dir != NULL)
+    {
+      struct dirent* de;
+      while ((de = readdir(dir)) != NULL)
 	{
-	  printf("[RAPL] CONSUMED Total energy               : %9.6f J\n", rapl_package + rapl_dram);
-	  printf("[RAPL] CONSUMED Package energy             : %9.6f J\n", rapl_package);
-	  printf("[RAPL] CONSUMED PowerPlane0 core %2d energy : %9.6f J\n", rapl_core, rapl_pp0);
-	  if (rapl_dram_counter)
+	  int cpu;
+	  char c;
+	  if (sscanf(de->d_name, "cpu%d%c", &cpu, &c) == 1 && cpu >= num_cpus)
 	    {
-	      printf("[RAPL] CONSUMED DRAM energy                : %9.6f J\n", rapl_dram);
+	      num_cpus = cpu + 1;
 	    }
-	  printf("[RAPL] CONSUMED Rest energy                : %9.6f J\n", rapl_rest);
 	}
+      closedir(dir);
+    }
+  if (num_cpus == 0)
+    {
+      num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    }
 
-      printf("[RAPL] Total power                         : %9.6f W\n", (rapl_package + rapl_dram) / duration_s);
-      printf("[RAPL] Package power                       : %9.6f W\n", rapl_package / duration_s);
-      printf("[RAPL] PowerPlane0 core %2d power           : %9.6f W\n", rapl_core, rapl_pp0 / duration_s);
-      printf("[RAPL] DRAM power                          : %9.6f W\n", rapl_dram / duration_s);
-      printf("[RAPL] Rest power                          : %9.6f W\n", rapl_rest / duration_s);
+  int* pkg_of_cpu = (int*) malloc(num_cpus * sizeof(int));
+  if (pkg_of_cpu == NULL)
+    {
+      return -1;
+    }
 
-      if (detailed >= RAPL_PRINT_BEF_AFT)
+  int cpu;
+  for (cpu = 0; cpu < num_cpus; cpu++)
+    {
+      char path[BUFSIZ];
+      snprintf(path, sizeof(path), RAPL_SYSFS_CPU "/cpu%d/topology/physical_package_id", cpu);
+      if (rapl_sysfs_read_int(path, pkg_of_cpu + cpu) < 0)
 	{
-	  /* not available on SandyBridge-EP */
-	  if ((rapl_cpu_model == CPU_SANDYBRIDGE) || (rapl_cpu_model == CPU_IVYBRIDGE) || (rapl_cpu_model == CPU_HASWELL)) 
-	    {
-	      if (rapl_pp1_after[rapl_socket] > 0)
-		{
-		  printf("[RAPL] PowerPlane1 (on-core GPU) after[rapl_socket]: %.6f  (%.6fJ consumed)\n", 
-			 rapl_pp1_after[rapl_socket], rapl_pp1_after[rapl_socket] - rapl_pp1_before[rapl_socket]);
-		}
-	    }
-	  else 
-	    {
-	      printf("[RAPL] DRAM energy after[rapl_socket]: %.6f  (%.6fJ consumed)\n", rapl_dram_after[rapl_socket], rapl_dram_after[rapl_socket]-rapl_dram_before[rapl_socket]);
-	    }
+	  pkg_of_cpu[cpu] = -1;
 	}
     }
+  *num_cpus_out = num_cpus;
+  *pkg_of_cpu_out = pkg_of_cpu;
+  return 0;
 }
 
+static void
+rapl_session_free(rapl_session_t* ss)
+{
+  rapl_session_t** p;
+  pthread_rwlock_wrlock(&rapl_sessions_lock);
+  for (p = &rapl_sessions; *p != NULL && *p != ss; p = &(*p)->next)
+    ;
+  if (*p != NULL)
+    {
+      *p = ss->next;
+    }
+  pthread_rwlock_unlock(&rapl_sessions_lock);
 
-#define FOR_ALL_SOCKETS_PRINT(pattern, var, div_sum, fin)	\
-  {								\
-    double ___sum = 0;						\
-    int ___s;							\
-    for (___s = 0; ___s < NUMBER_OF_SOCKETS; ___s++)		\
-      {								\
-	if (rapl_initialized[___s])				\
-	  {							\
-	    ___sum += var[___s];				\
-	  }							\
-      }								\
-    printf(pattern, ___sum / div_sum);				\
-    for (___s = 0; ___s < NUMBER_OF_SOCKETS; ___s++)		\
-      {								\
-	if (rapl_initialized[___s])				\
-	  {							\
-	    printf(pattern, var[___s]);				\
-	  }							\
-	else							\
-	  {							\
-	    printf(pattern, 0.0);				\
-	  }							\
-      }								\
-    printf(fin);						\
+  int s;
+  FOR_ALL_SOCKETS(s)
+  {
+    rapl_socket_free(ss->sk[s], sizeof(rapl_session_socket_t));
   }
+  free(ss->sk);
+  free(ss->core_before);
+  free(ss);
+}
 
-
-void
-rapl_read_print_all_sockets(int detailed, int protected)
+/* the per-core arrays of a session, once the backend is known to have per-core counters */
+static int
+rapl_session_cores_alloc(rapl_session_t* ss)
 {
-  rapl_read_print_sockets(RR_NODE_ALL, detailed, protected);
+  if (rapl_num_cores == 0 || ss->core_before != NULL)
+    {
+      return 0;
+    }
+  ss->core_before = (double*) calloc(2 * rapl_num_cores, sizeof(double));
+  if (ss->core_before == NULL)
+    {
+      return -1;
+    }
+  ss->core_after = ss->core_before + rapl_num_cores;
+  return 0;
 }
 
-void
-rapl_read_print_sockets(int socket, int detailed, int protected)
+/* a session with its per-socket edges on the nodes of the sockets, zeroed */
+static rapl_session_t*
+rapl_session_alloc()
 {
-  if (protected && !rapl_allowed_once())
+  rapl_session_t* ss = (rapl_session_t*) calloc(1, sizeof(rapl_session_t));
+  if (ss == NULL)
     {
-      return;
+      return NULL;
     }
-  int s;
-
-  FOR_ALL_SELECTED_SOCKETS(socket, s)
+  ss->sk = (rapl_session_socket_t**) calloc(rapl_num_sockets, sizeof(rapl_session_socket_t*));
+  if (ss->sk == NULL)
     {
-      if (rapl_initialized[s] && rapl_package_after[s] < rapl_package_before[s])
-	{
-	  printf("[RAPL][%d] WARNING: the measurements might have overflown!\n", s);
-	}
+      free(ss);
+      return NULL;
     }
 
-  printf("[RAPL]                                     : ");
-  printf("%-12s", "Total");
+  int s;
   FOR_ALL_SOCKETS(s)
   {
-    printf("Socket %-4d ", s);
+    ss->sk[s] = (rapl_session_socket_t*) rapl_socket_alloc(s, sizeof(rapl_session_socket_t));
+    if (ss->sk[s] == NULL)
+      {
+	rapl_session_free(ss);
+	return NULL;
+      }
   }
-  printf("\n");
+  if (rapl_session_cores_alloc(ss) < 0)
+    {
+      rapl_session_free(ss);
+      return NULL;
+    }
 
-  if (detailed > RAPL_PRINT_NOT)
+  pthread_rwlock_wrlock(&rapl_sessions_lock);
+  ss->next = rapl_sessions;
+  rapl_sessions = ss;
+  pthread_rwlock_unlock(&rapl_sessions_lock);
+  return ss;
+}
+
+static void rapl_backend_select();
+
+static void
+rapl_topology_discover()
+{
+  int num_cpus;
+  int* pkg_of_cpu;
+
+  /* a backend can stand in for the machine (e.g., a replayed one) */
+  rapl_backend_select();
+  if (rapl_backend->topology == NULL || rapl_backend->topology(&num_cpus, &pkg_of_cpu) < 0)
     {
-      if (detailed >= RAPL_PRINT_ALL)
+      if (rapl_topology_sysfs(&num_cpus, &pkg_of_cpu) < 0)
 	{
-	  printf("[RAPL] Power units                         : %.3f W\n", rapl_power_units);
-	  printf("[RAPL] Energy units                        : %.8f J\n", rapl_energy_units);
-	  printf("[RAPL] Time units                          : %.8f s\n", rapl_time_units);
-	  printf("[RAPL] PowerPlane0 core %2d policy          : %d\n", rapl_core, rapl_pp0_policy);
+	  return;
 	}
+    }
 
-      if (detailed >= RAPL_PRINT_ALL)
+  int* pkg_ids = (int*) malloc(num_cpus * sizeof(int));
+  rapl_cpu_socket = (int*) malloc(num_cpus * sizeof(int));
+  if (pkg_ids == NULL || rapl_cpu_socket == NULL)
+    {
+      free(pkg_of_cpu);
+      free(pkg_ids);
+      return;
+    }
+
+  /* collect the (sorted) distinct package ids of the online cpus */
+  int cpu, num_pkgs = 0;
+  for (cpu = 0; cpu < num_cpus; cpu++)
+    {
+      if (pkg_of_cpu[cpu] < 0)
 	{
-	  printf("[RAPL] Package thermal spec                : %.3f W\n", rapl_thermal_spec_power);
-	  printf("[RAPL] Package minimum power               : %.3f W\n", rapl_minimum_power);
-	  printf("[RAPL] Package maximum power               : %.3f W\n", rapl_maximum_power);
-	  printf("[RAPL] Package maximum time window         : %.6f s\n", rapl_time_window);
-	  long long int result = rapl_msr_pkg_settings;
-	  printf("[RAPL] Package power limits are            : %s\n",  (result >> 63) ? "locked" : "unlocked");
-	  printf("[RAPL] Package power limit #1              : %.3f W for %.6f s (%s, %s)\n", 
-		 rapl_pkg_power_limit_1, rapl_pkg_time_window_1,
-		 (result & (1LL<<15)) ? "enabled" : "disabled",
-		 (result & (1LL<<16)) ? "clamped" : "not_clamped");
-	  printf("[RAPL] Package power limit #2              : %.3f W for %.6fs (%s, %s)\n", 
-		 rapl_pkg_power_limit_2, rapl_pkg_time_window_2,
-		 (result & (1LL<<47)) ? "enabled" : "disabled",
-		 (result & (1LL<<48)) ? "clamped" : "not_clamped");
+	  continue;
+	}
 
-	  if ((rapl_cpu_model == CPU_SANDYBRIDGE_EP) || (rapl_cpu_model == CPU_IVYBRIDGE_EP))
-	    {
-	      printf("[RAPL] Accumulated Package Throttled Time  : %.6fs\n", rapl_acc_pkg_throttled_time);
-	      printf("[RAPL] PowerPlane0 (core) Accumulated Throttled Time : %.6fs\n", rapl_acc_rapl_pp0_throttled_time);
-	    }
+      int i = 0;
+      while (i < num_pkgs && pkg_ids[i] < pkg_of_cpu[cpu])
+	{
+	  i++;
 	}
-  
-      if (detailed >= RAPL_PRINT_BEF_AFT)
+      if (i == num_pkgs || pkg_ids[i] != pkg_of_cpu[cpu])
 	{
-	  printf("[RAPL] BEFORE Package energy               : %.6f J\n", rapl_package_before[rapl_socket]);
-	  printf("[RAPL] BEFORE PowerPlane0 core %2d energy   : %.6f J\n", rapl_core, rapl_pp0_before[rapl_socket]);
+	  memmove(pkg_ids + i + 1, pkg_ids + i, (num_pkgs - i) * sizeof(int));
+	  pkg_ids[i] = pkg_of_cpu[cpu];
+	  num_pkgs++;
 	}
+    }
 
-
-      if (detailed >= RAPL_PRINT_BEF_AFT)
+  if (num_pkgs == 0)
+    {
+      printf("[RAPL] Cannot read the topology from " RAPL_SYSFS_CPU ", assuming 1 socket\n");
+      for (cpu = 0; cpu < num_cpus; cpu++)
 	{
-	  /* not available on *Bridge-EP */
-	  if ((rapl_cpu_model == CPU_SANDYBRIDGE) || (rapl_cpu_model == CPU_IVYBRIDGE) || (rapl_cpu_model == CPU_HASWELL)) 
-	    {
-	      if (rapl_pp1_before[rapl_socket] > 0)
-		{
-		  printf("[RAPL] PowerPlane1 (on-core GPU) before[rapl_socket]: %.6fJ\n", rapl_pp1_before[rapl_socket]);
-		  printf("[RAPL] PowerPlane1 (on-core GPU) %d policy: %d\n", rapl_core, rapl_pp1_policy);
-		}
-	    }
-	  else 
-	    {
-	      printf("[RAPL] DRAM energy before[rapl_socket]: %.6fJ\n", rapl_dram_before[rapl_socket]);
-	    }
+	  pkg_of_cpu[cpu] = 0;
 	}
+      pkg_ids[0] = 0;
+      num_pkgs = 1;
+    }
 
-      rapl_read_ticks duration[NUMBER_OF_SOCKETS]; 
-      double duration_s[NUMBER_OF_SOCKETS];
+  rapl_num_cpus = num_cpus;
+  rapl_num_sockets = num_pkgs;
+  rapl_socket_cpu = (int*) malloc(num_pkgs * sizeof(int));
+  rapl_socket_pkg_id = (int*) malloc(num_pkgs * sizeof(int));
+  if (rapl_socket_cpu == NULL || rapl_socket_pkg_id == NULL)
+    {
+      free(pkg_of_cpu);
+      free(pkg_ids);
+      return;
+    }
+
+  int s;
+  FOR_ALL_SOCKETS(s)
+  {
+    rapl_socket_cpu[s] = -1;
+    rapl_socket_pkg_id[s] = pkg_ids[s];
+  }
+  for (cpu = 0; cpu < num_cpus; cpu++)
+    {
+      rapl_cpu_socket[cpu] = -1;
       FOR_ALL_SOCKETS(s)
       {
-	duration[s] = rapl_stop_ts[s] - rapl_start_ts[s];
-	duration_s[s] = (double) duration[s] / ((CORE_SPEED_GHZ) * 1e9);
+	if (pkg_of_cpu[cpu] == pkg_ids[s])
+	  {
+	    rapl_cpu_socket[cpu] = s;
+	    if (rapl_socket_cpu[s] < 0)
+	      {
+		rapl_socket_cpu[s] = cpu;
+	      }
+	    break;
+	  }
       }
+    }
+  free(pkg_of_cpu);
+  free(pkg_ids);
 
-      if (detailed >= RAPL_PRINT_POW)
-	{
-	  printf("[RAPL] Duration                            : ");
-	  FOR_ALL_SOCKETS_PRINT("%11.6f ", duration_s, rapl_num_active_sockets, " s\n");
-	}
+  /* per-socket state, each socket on its own node */
+  rapl_numa = (numa_available() >= 0);
+  rapl_sockets = (rapl_socket_state_t**) calloc(num_pkgs, sizeof(rapl_socket_state_t*));
+  if (rapl_sockets == NULL)
+    {
+      return;
+    }
+  FOR_ALL_SOCKETS(s)
+  {
+    rapl_sockets[s] = (rapl_socket_state_t*) rapl_socket_alloc(s, sizeof(rapl_socket_state_t));
+    if (rapl_sockets[s] == NULL)
+      {
+	return;
+      }
+  }
 
-      if (detailed >= RAPL_PRINT_BEF_AFT)
-	{
-	  printf("[RAPL] AFTER Package energy                : %.6f J\n", rapl_package_after[rapl_socket]);
-	  printf("[RAPL] AFTER PowerPlane0 core %2d energy    : %.6f J\n", rapl_core, rapl_pp0_after[rapl_socket]);
-	}
+  /* the state of the RR_* macros */
+  rapl_session_default = rapl_session_alloc();
+  if (rapl_session_default == NULL)
+    {
+      return;
+    }
 
-      double rapl_total[NUMBER_OF_SOCKETS];
-      double rapl_package[NUMBER_OF_SOCKETS];
-      double rapl_pp0[NUMBER_OF_SOCKETS]; 
-      double rapl_dram[NUMBER_OF_SOCKETS]; 
-      double rapl_rest[NUMBER_OF_SOCKETS]; 
+  rapl_topology_ok = 1;
+}
 
-      FOR_ALL_SELECTED_SOCKETS(socket, s)
-	{
-	  rapl_package[s] = rapl_package_after[s] - rapl_package_before[s];
-	  rapl_pp0[s] = rapl_pp0_after[s] - rapl_pp0_before[s];
-	  rapl_dram[s] = rapl_dram_after[s] - rapl_dram_before[s];
-	  rapl_rest[s] = rapl_package[s] - rapl_pp0[s];
-	  rapl_total[s] = rapl_package[s] + rapl_dram[s];
-	}
-      NON_SELECTED_SOCKETS
-	{
-	  rapl_package[s] = 0;
-	  rapl_pp0[s] = 0;
-	  rapl_dram[s] = 0;
-	  rapl_rest[s] = 0;
-	  rapl_total[s] = 0;
-	}
+/* discover the topology once, whichever thread gets here first */
+static int
+rapl_topology_init()
+{
+  pthread_once(&rapl_topology_once, rapl_topology_discover);
+  return rapl_topology_ok ? 0 : -1;
+}
 
-      if (detailed >= RAPL_PRINT_ENE)
+int
+rapl_read_num_sockets()
+{
+  if (rapl_topology_init() < 0)
+    {
+      return -1;
+    }
+  return rapl_num_sockets;
+}
+
+int
+rapl_read_cpu_socket(int cpu)
+{
+  if (rapl_topology_init() < 0 || cpu < 0 || cpu >= rapl_num_cpus)
+    {
+      return -1;
+    }
+  return rapl_cpu_socket[cpu];
+}
+
+/*********************************************************************************/
+/* counter backends */
+/*********************************************************************************/
+
+/* msr: the energy status MSRs through the msr device. 32-bit counters, wrapping. */
+
+static const uint32_t rapl_domain_msr[RAPL_DOMAIN_NUM] =
+  {
+    MSR_PKG_ENERGY_STATUS, MSR_PP0_ENERGY_STATUS, MSR_PP1_ENERGY_STATUS, MSR_DRAM_ENERGY_STATUS,
+    MSR_PLATFORM_ENERGY_STATUS
+  };
+
+static int
+rapl_msr_backend_init(int* available, double* units, uint64_t* range)
+{
+  rapl_cpu_model = detect_cpu();
+  if (rapl_cpu_model < 0)
+    {
+      printf("[RAPL] Unsupported processor\n");
+      return -1;
+    }
+  rapl_cpu = rapl_read_cpu_info(rapl_cpu_model);
+
+  /* the units are the same on all sockets */
+  int fd = open_msr(rapl_socket_cpu[0]);
+  long long int result = read_msr(fd, MSR_RAPL_POWER_UNIT);
+  close(fd);
+
+  int d;
+  for (d = 0; d < RAPL_DOMAIN_NUM; d++)
+    {
+      available[d] = (rapl_cpu->domains >> d) & 1;
+      units[d] = (rapl_cpu->units[d] > 0) ? rapl_cpu->units[d] : pow(0.5, (double)((result>>8)&0x1f));
+      range[d] = 1ULL << 32;
+    }
+  return 0;
+}
+
+static int
+rapl_msr_backend_open(int s, int cpu)
+{
+  rapl_sockets[s]->msr_fd = open_msr(cpu);
+  return (rapl_sockets[s]->msr_fd < 0) ? -1 : 0;
+}
+
+static void
+rapl_msr_backend_close(int s)
+{
+  close(rapl_sockets[s]->msr_fd);
+}
+
+static void
+rapl_msr_backend_read(int s0, int s1, const int* domains, int n, uint64_t* out)
+{
+  const int total = (s1 - s0) * n;
+  int fds[total], idx[total];
+  uint32_t offs[total];
+  uint64_t vals[total];
+  int j, m = 0;
+  for (j = 0; j < total; j++)
+    {
+      /* the register of a missing domain (e.g., PP0 on the servers) cannot be read */
+      if (!rapl_domain_available[domains[j % n]])
 	{
-	  printf("[RAPL] CONSUMED Total energy               : ");
-	  FOR_ALL_SOCKETS_PRINT("%11.6f ", rapl_total, 1, " J\n");
-	  printf("[RAPL] CONSUMED Package energy             : ");
-	  FOR_ALL_SOCKETS_PRINT("%11.6f ", rapl_package, 1, " J\n");
-	  printf("[RAPL] CONSUMED PowerPlane0 energy         : ");
-	  FOR_ALL_SOCKETS_PRINT("%11.6f ", rapl_pp0, 1, " J\n");
-	  if (rapl_dram_counter)
-	    {
-	      printf("[RAPL] CONSUMED DRAM energy                : ");
-	      FOR_ALL_SOCKETS_PRINT("%11.6f ", rapl_dram, 1, " J\n");
-	    }
-	  printf("[RAPL] CONSUMED Rest energy                : " );
-	  FOR_ALL_SOCKETS_PRINT("%11.6f ", rapl_rest, 1, " J\n");
+	  out[j] = 0;
+	  continue;
 	}
+      fds[m] = rapl_sockets[s0 + j / n]->msr_fd;
+      offs[m] = rapl_domain_msr[domains[j % n]];
+      idx[m++] = j;
+    }
+  rapl_msr_read_batch(m, fds, offs, vals);
+  for (j = 0; j < m; j++)
+    {
+      out[idx[j]] = vals[j] & 0xffffffffULL;	/* the upper half is reserved */
+    }
+}
 
-      double rapl_total_pow[NUMBER_OF_SOCKETS];
-      double rapl_package_pow[NUMBER_OF_SOCKETS];
-      double rapl_pp0_pow[NUMBER_OF_SOCKETS]; 
-      double rapl_dram_pow[NUMBER_OF_SOCKETS]; 
-      double rapl_rest_pow[NUMBER_OF_SOCKETS]; 
+static int
+rapl_msr_backend_read_reg(int s, uint32_t reg, uint64_t* val)
+{
+  /* not read_msr(), which exits: a register that the model lacks is an error */
+  return (pread(rapl_sockets[s]->msr_fd, val, sizeof(*val), (off_t) reg) == sizeof(*val)) ? 0 : -1;
+}
 
-      FOR_ALL_SELECTED_SOCKETS(socket, s)
+/* the counters are opened read-only: writes (rare) open the device on their own */
+static int
+rapl_msr_backend_write_reg(int s, uint32_t reg, uint64_t val)
+{
+  char path[BUFSIZ];
+  rapl_msr_path(rapl_sockets[s]->msr_core, path, sizeof(path));
+  int fd = open(path, O_WRONLY);
+  if (fd < 0)
+    {
+      return -1;
+    }
+  ssize_t ret = pwrite(fd, &val, sizeof(val), reg);
+  close(fd);
+  return (ret == sizeof(val)) ? 0 : -1;
+}
+
+const rapl_backend_t rapl_backend_msr =
+  {
+    "msr", rapl_msr_backend_init, rapl_msr_backend_open, rapl_msr_backend_close,
+    rapl_msr_backend_read, rapl_msr_backend_read_reg, NULL, rapl_msr_backend_write_reg,
+    NULL, NULL
+  };
+
+/* amd: the package and per-core energy MSRs of AMD Zen (family 17h and later) through 
+   the msr device. 32-bit counters, wrapping. */
+
+static int* rapl_amd_core_fd = NULL;
+static int* rapl_amd_core_cpu = NULL;
+static int rapl_amd_num_cores = 0;
+
+/* the family of an AMD (or Hygon) processor, or -1 */
+static int
+rapl_amd_family()
+{
+  FILE* f = fopen("/proc/cpuinfo", "r");
+  if (f == NULL)
+    {
+      return -1;
+    }
+  char line[BUFSIZ], vendor[BUFSIZ] = "";
+  int family = -1;
+  while (fgets(line, sizeof(line), f) != NULL && family < 0)
+    {
+      if (!strncmp(line, "vendor_id", 9))
 	{
-	  rapl_package_pow[s] = rapl_package[s] / duration_s[s];
-	  rapl_pp0_pow[s] = rapl_pp0[s] / duration_s[s];
-	  rapl_dram_pow[s] = rapl_dram[s] / duration_s[s];		
-	  rapl_rest_pow[s] = rapl_rest[s] / duration_s[s];		
-	  rapl_total_pow[s] = rapl_total[s] / duration_s[s];
+	  sscanf(line, "%*s%*s%s", vendor);
 	}
-      NON_SELECTED_SOCKETS
+      else if (!strncmp(line, "cpu family", 10))
 	{
-	  rapl_package_pow[s] = 0;
-	  rapl_pp0_pow[s] = 0;
-	  rapl_dram_pow[s] = 0;
-	  rapl_rest_pow[s] = 0;
-	  rapl_total_pow[s] = 0;
+	  sscanf(line, "%*s%*s%*s%d", &family);
 	}
+    }
+  fclose(f);
+  return (!strcmp(vendor, "AuthenticAMD") || !strcmp(vendor, "HygonGenuine")) ? family : -1;
+}
 
-      printf("[RAPL] CONSUMED Total power                : ");
-      FOR_ALL_SOCKETS_PRINT("%11.6f ", rapl_total_pow, 1, " W\n");
-      printf("[RAPL] CONSUMED Package power              : ");
-      FOR_ALL_SOCKETS_PRINT("%11.6f ", rapl_package_pow, 1, " W\n");
-      printf("[RAPL] CONSUMED PowerPlane0 power          : ");
-      FOR_ALL_SOCKETS_PRINT("%11.6f ", rapl_pp0_pow, 1, " W\n");
-      if (rapl_dram_counter)
+static int
+rapl_amd_backend_init(int* available, double* units, uint64_t* range)
+{
+  if (rapl_amd_family() < 0x17)
+    {
+      printf("[RAPL] Not an AMD Zen processor\n");
+      return -1;
+    }
+
+  int fd = open_msr(rapl_socket_cpu[0]);
+  long long int result = read_msr(fd, MSR_AMD_RAPL_POWER_UNIT);
+  close(fd);
+
+  /* only the package: there are no PP0, PP1, or DRAM counters */
+  int d;
+  for (d = 0; d < RAPL_DOMAIN_NUM; d++)
+    {
+      available[d] = (d == RAPL_DOMAIN_PKG);
+      units[d] = pow(0.5, (double)((result>>8)&0x1f));
+      range[d] = 1ULL << 32;
+    }
+  return 0;
+}
+
+static void
+rapl_amd_backend_read(int s0, int s1, const int* domains, int n, uint64_t* out)
+{
+  const int total = (s1 - s0) * n;
+  int fds[total], idx[total];
+  uint32_t offs[total];
+  uint64_t vals[total];
+  int j, m = 0;
+  for (j = 0; j < total; j++)
+    {
+      if (domains[j % n] != RAPL_DOMAIN_PKG)
 	{
-	  printf("[RAPL] CONSUMED DRAM power                 : ");
-	  FOR_ALL_SOCKETS_PRINT("%11.6f ", rapl_dram_pow, 1, " W\n");
+	  out[j] = 0;
+	  continue;
 	}
-      printf("[RAPL] CONSUMED Rest power                 : " );
-      FOR_ALL_SOCKETS_PRINT("%11.6f ", rapl_rest_pow, 1, " W\n");
+      fds[m] = rapl_sockets[s0 + j / n]->msr_fd;
+      offs[m] = MSR_AMD_PKG_ENERGY_STATUS;
+      idx[m++] = j;
+    }
+  rapl_msr_read_batch(m, fds, offs, vals);
+  for (j = 0; j < m; j++)
+    {
+      out[idx[j]] = vals[j] & 0xffffffffULL;
+    }
+}
 
+/* one counter per physical core: read from the first online cpu of each (package, 
+   core_id) of the sysfs topology */
+static int
+rapl_amd_backend_cores(int* num_cores, int** core_cpu, double* units, uint64_t* range)
+{
+  int* cpus = (int*) malloc(rapl_num_cpus * sizeof(int));
+  int* ids = (int*) malloc(rapl_num_cpus * sizeof(int));
+  rapl_amd_core_fd = (int*) malloc(rapl_num_cpus * sizeof(int));
+  if (cpus == NULL || ids == NULL || rapl_amd_core_fd == NULL)
+    {
+      free(cpus);
+      free(ids);
+      free(rapl_amd_core_fd);
+      rapl_amd_core_fd = NULL;
+      return -1;
+    }
 
-      if (detailed >= RAPL_PRINT_BEF_AFT)
+  int cpu, n = 0;
+  for (cpu = 0; cpu < rapl_num_cpus; cpu++)
+    {
+      char path[BUFSIZ];
+      int core_id, i;
+      snprintf(path, sizeof(path), RAPL_SYSFS_CPU "/cpu%d/topology/core_id", cpu);
+      if (rapl_cpu_socket[cpu] < 0 || rapl_sysfs_read_int(path, &core_id) < 0)
+	{
+	  continue;
+	}
+      for (i = 0; i < n && (rapl_cpu_socket[cpus[i]] != rapl_cpu_socket[cpu] || ids[i] != core_id); i++)
+	;
+      if (i == n)
 	{
-	  /* not available on SandyBridge-EP */
-	  if ((rapl_cpu_model == CPU_SANDYBRIDGE) || (rapl_cpu_model == CPU_IVYBRIDGE) || (rapl_cpu_model == CPU_HASWELL)) 
+	  /* not open_msr(), which exits: without the per-core counters, the package 
+	     counters still work */
+	  char msr_filename[BUFSIZ];
+	  rapl_msr_path(cpu, msr_filename, sizeof(msr_filename));
+	  int fd = open(msr_filename, O_RDONLY);
+	  if (fd < 0)
 	    {
-	      if (rapl_pp1_after[rapl_socket] > 0)
+	      fprintf(stderr, "[RAPL] Cannot open %s, no per-core counters\n", msr_filename);
+	      while (n > 0)
 		{
-		  printf("[RAPL] PowerPlane1 (on-core GPU) after[rapl_socket]: %.6f  (%.6fJ consumed)\n", 
-			 rapl_pp1_after[rapl_socket], rapl_pp1_after[rapl_socket] - rapl_pp1_before[rapl_socket]);
+		  close(rapl_amd_core_fd[--n]);
 		}
+	      free(cpus);
+	      free(ids);
+	      free(rapl_amd_core_fd);
+	      rapl_amd_core_fd = NULL;
+	      return -1;
 	    }
-	  else 
-	    {
-	      printf("[RAPL] DRAM energy after[rapl_socket]: %.6f  (%.6fJ consumed)\n", rapl_dram_after[rapl_socket], rapl_dram_after[rapl_socket]-rapl_dram_before[rapl_socket]);
-	    }
+	  cpus[n] = cpu;
+	  ids[n] = core_id;
+	  rapl_amd_core_fd[n++] = fd;
 	}
     }
+  free(ids);
+
+  rapl_amd_num_cores = n;
+  rapl_amd_core_cpu = cpus;
+  *num_cores = n;
+  *core_cpu = cpus;
+  *units = rapl_domain_units[RAPL_DOMAIN_PKG];
+  *range = 1ULL << 32;
+  return 0;
 }
 
-void
-rapl_read_term()
+static void
+rapl_amd_backend_read_cores(uint64_t* out)
 {
-  if (!rapl_allowed())
+  uint32_t offs[rapl_amd_num_cores];
+  int c;
+  for (c = 0; c < rapl_amd_num_cores; c++)
     {
-      return;
+      offs[c] = MSR_AMD_CORE_ENERGY_STATUS;
+    }
+  rapl_msr_read_batch(rapl_amd_num_cores, rapl_amd_core_fd, offs, out);
+  for (c = 0; c < rapl_amd_num_cores; c++)
+    {
+      out[c] &= 0xffffffffULL;
     }
+}
 
-  close(rapl_msr_fd[rapl_socket]);
+/* the package counters of socket s and the per-core counters of its cores */
+static void
+rapl_amd_backend_close(int s)
+{
+  rapl_msr_backend_close(s);
+  int c;
+  for (c = 0; c < rapl_amd_num_cores; c++)
+    {
+      if (rapl_amd_core_fd[c] >= 0 && rapl_cpu_socket[rapl_amd_core_cpu[c]] == s)
+	{
+	  close(rapl_amd_core_fd[c]);
+	  rapl_amd_core_fd[c] = -1;
+	}
+    }
 }
 
+/* the registers of the Intel paths (policies, limits, ...) do not exist: no read_reg */
+const rapl_backend_t rapl_backend_amd =
+  {
+    "amd", rapl_amd_backend_init, rapl_msr_backend_open, rapl_amd_backend_close,
+    rapl_amd_backend_read, NULL, NULL, NULL, rapl_amd_backend_cores, rapl_amd_backend_read_cores
+  };
 
-#define FOR_ALL_SOCKETS_SUM(p_in, p_out)		\
-  {							\
-    double ___sum = 0;					\
-    int ___s;						\
-    for (___s = 0; ___s < NUMBER_OF_SOCKETS; ___s++)	\
-      {							\
-	___sum += p_in[___s];				\
-	p_out[___s] = p_in[___s];			\
-      }							\
-    p_out[___s] = ___sum;				\
-  }						
+/* powercap: the energy_uj files of the intel-rapl zones, kept open and re-read with 
+   pread. Counts in uJ, wrapping at the max_energy_range_uj of the zone. */
 
-#define FOR_ALL_SOCKETS_PLUS1(s)		\
-    for (s = 0; s < NUMBER_OF_SOCKETS + 1; s++)
+static char** rapl_powercap_zone;	/* socket * RAPL_DOMAIN_NUM + d -> zone directory */
+static int* rapl_powercap_fd;		/* socket * RAPL_DOMAIN_NUM + d -> energy_uj fd */
 
-void
-rapl_read_stats(rapl_stats_t* s)
+static int
+rapl_powercap_read_line(const char* path, char* buf, size_t len)
+{
+  FILE* f = fopen(path, "r");
+  if (f == NULL)
+    {
+      return -1;
+    }
+  int ok = (fgets(buf, len, f) != NULL);
+  fclose(f);
+  if (!ok)
+    {
+      return -1;
+    }
+  buf[strcspn(buf, "\n")] = '\0';
+  return 0;
+}
+
+/* the powercap subzone name of a domain */
+static int
+rapl_powercap_domain(const char* name)
+{
+  if (!strcmp(name, "core"))
+    {
+      return RAPL_DOMAIN_PP0;
+    }
+  if (!strcmp(name, "uncore"))
+    {
+      return RAPL_DOMAIN_PP1;
+    }
+  if (!strcmp(name, "dram"))
+    {
+      return RAPL_DOMAIN_DRAM;
+    }
+  return -1;
+}
+
+/* use the zone in dir for domain d of socket s */
+static void
+rapl_powercap_add(int s, int d, const char* dir, int* available, double* units, uint64_t* range)
+{
+  char path[2 * BUFSIZ], line[64];
+  int i = s * RAPL_DOMAIN_NUM + d;
+  if (rapl_powercap_zone[i] != NULL)
+    {
+      return;			/* e.g., a second die of the package */
+    }
+
+  snprintf(path, sizeof(path), "%s/max_energy_range_uj", dir);
+  if (rapl_powercap_read_line(path, line, sizeof(line)) < 0)
+    {
+      return;
+    }
+  rapl_powercap_zone[i] = strdup(dir);
+  available[d] = 1;
+  units[d] = 1e-6;
+  range[d] = strtoull(line, NULL, 10);
+}
+
+static int
+rapl_powercap_backend_init(int* available, double* units, uint64_t* range)
+{
+  const char* root = getenv("RAPL_POWERCAP_ROOT");
+  if (root == NULL)
+    {
+      root = RAPL_POWERCAP_ROOT_DEFAULT;
+    }
+
+  rapl_powercap_zone = (char**) calloc(rapl_num_sockets * RAPL_DOMAIN_NUM, sizeof(char*));
+  rapl_powercap_fd = (int*) malloc(rapl_num_sockets * RAPL_DOMAIN_NUM * sizeof(int));
+  DIR* dir = opendir(root);
+  if (rapl_powercap_zone == NULL || rapl_powercap_fd == NULL || dir == NULL)
+    {
+      printf("[RAPL] Cannot read the powercap zones of %s\n", root);
+      if (dir != NULL)
+	{
+	  closedir(dir);
+	}
+      return -1;
+    }
+  int i;
+  for (i = 0; i < rapl_num_sockets * RAPL_DOMAIN_NUM; i++)
+    {
+      rapl_powercap_fd[i] = -1;
+    }
+
+  /* the package zones are intel-rapl:N (named package-<id>), their subzones 
+     intel-rapl:N:M (named core, uncore, or dram). The platform zone is named psys. */
+  struct dirent* de;
+  while ((de = readdir(dir)) != NULL)
+    {
+      char zone[BUFSIZ], path[2 * BUFSIZ], name[64];
+      int n, pkg, sub, s;
+      char c;
+      if (sscanf(de->d_name, "intel-rapl:%d%c", &n, &c) != 1)
+	{
+	  continue;
+	}
+      snprintf(zone, sizeof(zone), "%s/%s", root, de->d_name);
+      snprintf(path, sizeof(path), "%s/name", zone);
+      if (rapl_powercap_read_line(path, name, sizeof(name)) < 0)
+	{
+	  continue;
+	}
+      if (!strcmp(name, "psys"))
+	{
+	  rapl_powercap_add(0, RAPL_DOMAIN_PSYS, zone, available, units, range);
+	  continue;
+	}
+      if (sscanf(name, "package-%d", &pkg) != 1)
+	{
+	  continue;
+	}
+      for (s = 0; s < rapl_num_sockets && rapl_socket_pkg_id[s] != pkg; s++)
+	;
+      if (s == rapl_num_sockets)
+	{
+	  continue;
+	}
+
+      rapl_powercap_add(s, RAPL_DOMAIN_PKG, zone, available, units, range);
+      for (sub = 0; ; sub++)
+	{
+	  snprintf(path, sizeof(path), "%s/intel-rapl:%d:%d/name", zone, n, sub);
+	  if (rapl_powercap_read_line(path, name, sizeof(name)) < 0)
+	    {
+	      break;
+	    }
+	  int d = rapl_powercap_domain(name);
+	  if (d >= 0)
+	    {
+	      snprintf(path, sizeof(path), "%s/intel-rapl:%d:%d", zone, n, sub);
+	      rapl_powercap_add(s, d, path, available, units, range);
+	    }
+	}
+    }
+  closedir(dir);
+
+  if (!available[RAPL_DOMAIN_PKG])
+    {
+      printf("[RAPL] No package zones in %s\n", root);
+      return -1;
+    }
+  return 0;
+}
+
+static int
+rapl_powercap_backend_open(int s, int cpu)
+{
+  int d;
+  for (d = 0; d < RAPL_DOMAIN_NUM; d++)
+    {
+      const char* zone = rapl_powercap_zone[s * RAPL_DOMAIN_NUM + d];
+      if (zone == NULL)
+	{
+	  continue;
+	}
+      char path[BUFSIZ];
+      snprintf(path, sizeof(path), "%s/energy_uj", zone);
+      int fd = open(path, O_RDONLY);
+      if (fd < 0)
+	{
+	  perror("powercap:open");
+	  fprintf(stderr, "Trying to open %s\n", path);
+	  return -1;
+	}
+      rapl_powercap_fd[s * RAPL_DOMAIN_NUM + d] = fd;
+    }
+  return (rapl_powercap_fd[s * RAPL_DOMAIN_NUM + RAPL_DOMAIN_PKG] < 0) ? -1 : 0;
+}
+
+static void
+rapl_powercap_backend_close(int s)
+{
+  int d;
+  for (d = 0; d < RAPL_DOMAIN_NUM; d++)
+    {
+      int* fd = rapl_powercap_fd + s * RAPL_DOMAIN_NUM + d;
+      if (*fd >= 0)
+	{
+	  close(*fd);
+	  *fd = -1;
+	}
+    }
+}
+
+static void
+rapl_powercap_backend_read(int s0, int s1, const int* domains, int n, uint64_t* out)
+{
+  int s, i, j = 0;
+  for (s = s0; s < s1; s++)
+    {
+      for (i = 0; i < n; i++, j++)
+	{
+	  const int fd = rapl_powercap_fd[s * RAPL_DOMAIN_NUM + domains[i]];
+	  char buf[32];
+	  ssize_t len;
+	  if (fd < 0)
+	    {
+	      out[j] = 0;
+	      continue;
+	    }
+	  if ((len = pread(fd, buf, sizeof(buf) - 1, 0)) <= 0)
+	    {
+	      perror("powercap:pread");
+	      exit(127);
+	    }
+	  buf[len] = '\0';
+	  out[j] = strtoull(buf, NULL, 10);
+	}
+    }
+}
+
+const rapl_backend_t rapl_backend_powercap =
+  {
+    "powercap", rapl_powercap_backend_init, rapl_powercap_backend_open, rapl_powercap_backend_close,
+    rapl_powercap_backend_read, NULL, NULL, NULL, NULL, NULL
+  };
+
+/* perf: the energy-* events of the power PMU, one group per socket, so that an edge 
+   is a single read() per socket. 64-bit counts, scaled with the .scale of the event. */
+
+#if RAPL_HAVE_PERF_EVENT == 1
+
+static const char* rapl_perf_event[RAPL_DOMAIN_NUM] =
+  {
+    "energy-pkg", "energy-cores", "energy-gpu", "energy-ram", "energy-psys"
+  };
+
+static uint32_t rapl_perf_type;
+static uint64_t rapl_perf_config[RAPL_DOMAIN_NUM];
+static int* rapl_perf_fd;		/* socket * RAPL_DOMAIN_NUM + d -> event fd */
+static int* rapl_perf_slot;		/* socket * RAPL_DOMAIN_NUM + d -> index in the group read */
+static int* rapl_perf_leader;		/* socket -> fd of the group leader */
+
+static int
+rapl_perf_backend_init(int* available, double* units, uint64_t* range)
+{
+  char path[BUFSIZ], line[64];
+  snprintf(path, sizeof(path), RAPL_PERF_PMU "/type");
+  if (rapl_powercap_read_line(path, line, sizeof(line)) < 0)
+    {
+      printf("[RAPL] No power PMU in " RAPL_PERF_PMU "\n");
+      return -1;
+    }
+  rapl_perf_type = strtoul(line, NULL, 10);
+
+  rapl_perf_fd = (int*) malloc(rapl_num_sockets * RAPL_DOMAIN_NUM * sizeof(int));
+  rapl_perf_slot = (int*) malloc(rapl_num_sockets * RAPL_DOMAIN_NUM * sizeof(int));
+  rapl_perf_leader = (int*) malloc(rapl_num_sockets * sizeof(int));
+  if (rapl_perf_fd == NULL || rapl_perf_slot == NULL || rapl_perf_leader == NULL)
+    {
+      return -1;
+    }
+  int i, d, found = 0;
+  for (i = 0; i < rapl_num_sockets * RAPL_DOMAIN_NUM; i++)
+    {
+      rapl_perf_fd[i] = -1;
+    }
+
+  for (d = 0; d < RAPL_DOMAIN_NUM; d++)
+    {
+      snprintf(path, sizeof(path), RAPL_PERF_PMU "/events/%s", rapl_perf_event[d]);
+      if (rapl_powercap_read_line(path, line, sizeof(line)) < 0 
+	  || sscanf(line, "event=%" SCNx64, rapl_perf_config + d) != 1)
+	{
+	  continue;
+	}
+
+      /* the counts are in units of .scale (in .unit, Joules) */
+      snprintf(path, sizeof(path), RAPL_PERF_PMU "/events/%s.unit", rapl_perf_event[d]);
+      if (rapl_powercap_read_line(path, line, sizeof(line)) == 0 && strcmp(line, "Joules"))
+	{
+	  printf("[RAPL] Unexpected unit %s of %s\n", line, rapl_perf_event[d]);
+	  continue;
+	}
+      snprintf(path, sizeof(path), RAPL_PERF_PMU "/events/%s.scale", rapl_perf_event[d]);
+      if (rapl_powercap_read_line(path, line, sizeof(line)) < 0)
+	{
+	  continue;
+	}
+      units[d] = strtod(line, NULL);
+      range[d] = 0;
+      available[d] = 1;
+      found++;
+    }
+
+  if (found == 0)
+    {
+      printf("[RAPL] No energy events in " RAPL_PERF_PMU "\n");
+      return -1;
+    }
+  return 0;
+}
+
+static int
+rapl_perf_backend_open(int s, int cpu)
+{
+  int d, nr = 0;
+  rapl_perf_leader[s] = -1;
+  for (d = 0; d < RAPL_DOMAIN_NUM; d++)
+    {
+      if (!rapl_domain_available[d] || (d == RAPL_DOMAIN_PSYS && s != 0))
+	{
+	  continue;
+	}
+
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = rapl_perf_type;
+      attr.config = rapl_perf_config[d];
+      attr.read_format = PERF_FORMAT_GROUP;
+      int fd = syscall(__NR_perf_event_open, &attr, -1, cpu, rapl_perf_leader[s], 0);
+      if (fd < 0)
+	{
+	  perror("perf:perf_event_open");
+	  fprintf(stderr, "Trying to open %s on cpu %d\n", rapl_perf_event[d], cpu);
+	  return -1;
+	}
+      if (rapl_perf_leader[s] < 0)
+	{
+	  rapl_perf_leader[s] = fd;
+	}
+      rapl_perf_fd[s * RAPL_DOMAIN_NUM + d] = fd;
+      rapl_perf_slot[s * RAPL_DOMAIN_NUM + d] = nr++;
+    }
+  return (rapl_perf_leader[s] < 0) ? -1 : 0;
+}
+
+static void
+rapl_perf_backend_close(int s)
+{
+  int d;
+  /* the leader last */
+  for (d = RAPL_DOMAIN_NUM - 1; d >= 0; d--)
+    {
+      int* fd = rapl_perf_fd + s * RAPL_DOMAIN_NUM + d;
+      if (*fd >= 0)
+	{
+	  close(*fd);
+	  *fd = -1;
+	}
+    }
+}
+
+static void
+rapl_perf_backend_read(int s0, int s1, const int* domains, int n, uint64_t* out)
+{
+  uint64_t group[1 + RAPL_DOMAIN_NUM];	/* nr, values[nr] */
+  int s, i, j = 0;
+  for (s = s0; s < s1; s++)
+    {
+      if (read(rapl_perf_leader[s], group, sizeof(group)) < (ssize_t) sizeof(uint64_t))
+	{
+	  perror("perf:read");
+	  exit(127);
+	}
+      for (i = 0; i < n; i++, j++)
+	{
+	  const int k = s * RAPL_DOMAIN_NUM + domains[i];
+	  out[j] = (rapl_perf_fd[k] >= 0) ? group[1 + rapl_perf_slot[k]] : 0;
+	}
+    }
+}
+
+const rapl_backend_t rapl_backend_perf =
+  {
+    "perf", rapl_perf_backend_init, rapl_perf_backend_open, rapl_perf_backend_close,
+    rapl_perf_backend_read, NULL, NULL, NULL, NULL, NULL
+  };
+
+#else
+
+static int
+rapl_perf_backend_init(int* available, double* units, uint64_t* range)
+{
+  printf("[RAPL] Compiled without perf_event support\n");
+  return -1;
+}
+
+const rapl_backend_t rapl_backend_perf =
+  {
+    "perf", rapl_perf_backend_init, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL
+  };
+
+#endif	/* RAPL_HAVE_PERF_EVENT */
+
+/* replay: recorded or synthetic counter streams from a trace file (RAPL_REPLAY), in 
+   place of /proc/cpuinfo, the topology, and the counters of the machine. Each read of
+   a socket consumes the next recorded row of the socket (the last row repeats), or 
+   computes the synthetic counters from the time since the initialization. */
+
+#define RAPL_REPLAY_MAX_REGS 64
+
+typedef struct rapl_replay_stream
+{
+  uint64_t* rows;			/* rows of RAPL_DOMAIN_NUM raw values */
+  size_t num_rows, size;
+  volatile size_t next;
+  int synthetic;
+  double watts[RAPL_DOMAIN_NUM];
+  uint64_t start[RAPL_DOMAIN_NUM];
+} rapl_replay_stream_t;
+
+static const char* rapl_domain_name[RAPL_DOMAIN_NUM] =
+  {
+    "pkg", "pp0", "pp1", "dram", "psys"
+  };
+
+static int rapl_replay_loaded = 0;
+static int rapl_replay_model = -1;
+static int rapl_replay_sockets = 1;
+static int rapl_replay_cpus = 1;	/* per socket */
+static double rapl_replay_units = 0;
+static uint64_t rapl_replay_range = 1ULL << 32;
+static int rapl_replay_column[RAPL_DOMAIN_NUM] = { RAPL_DOMAIN_PKG, RAPL_DOMAIN_PP0 };
+static int rapl_replay_num_columns = 2;
+static double rapl_replay_core_watts = -1;	/* per core (cpu); < 0 for no per-core counters */
+static double rapl_replay_throttled[RAPL_THROTTLE_NUM];	/* % of the time, synthetic */
+static double rapl_replay_activity[3];	/* TSC GHz, effective GHz, busy %; synthetic */
+static int rapl_replay_num_regs = 0;
+static uint32_t rapl_replay_reg[RAPL_REPLAY_MAX_REGS];
+static uint64_t rapl_replay_reg_val[RAPL_REPLAY_MAX_REGS];
+static rapl_replay_stream_t* rapl_replay_streams = NULL;
+static uint64_t rapl_replay_t0;
+
+/* the stream of socket s of the trace, or NULL */
+static rapl_replay_stream_t*
+rapl_replay_stream(int s)
+{
+  if (s < 0 || s >= rapl_replay_sockets)
+    {
+      return NULL;
+    }
+  if (rapl_replay_streams == NULL)
+    {
+      /* the number of sockets is fixed from now on */
+      rapl_replay_streams = (rapl_replay_stream_t*) calloc(rapl_replay_sockets, sizeof(rapl_replay_stream_t));
+      if (rapl_replay_streams == NULL)
+	{
+	  return NULL;
+	}
+    }
+  return rapl_replay_streams + s;
+}
+
+/* the raw values of the columns, from the rest of the line, into vals[RAPL_DOMAIN_*] */
+static int
+rapl_replay_values(char** save, uint64_t* vals, double* watts)
+{
+  int c;
+  for (c = 0; c < rapl_replay_num_columns; c++)
+    {
+      char* tok = strtok_r(NULL, " \t\n", save);
+      if (tok == NULL)
+	{
+	  return -1;
+	}
+      if (vals != NULL)
+	{
+	  vals[rapl_replay_column[c]] = strtoull(tok, NULL, 0);
+	}
+      else
+	{
+	  watts[rapl_replay_column[c]] = strtod(tok, NULL);
+	}
+    }
+  return 0;
+}
+
+static int
+rapl_replay_parse(const char* file)
+{
+  FILE* f = fopen(file, "r");
+  if (f == NULL)
+    {
+      perror("replay:fopen");
+      fprintf(stderr, "Trying to open %s\n", file);
+      return -1;
+    }
+
+  char line[BUFSIZ];
+  int num = 0, ok = 1;
+  while (ok && fgets(line, sizeof(line), f) != NULL)
+    {
+      num++;
+      line[strcspn(line, "#")] = '\0';
+      char* save;
+      char* key = strtok_r(line, " \t\n", &save);
+      if (key == NULL)
+	{
+	  continue;
+	}
+      char* arg = strtok_r(NULL, " \t\n", &save);
+
+      if (!strcmp(key, "model") && arg != NULL)
+	{
+	  rapl_replay_model = atoi(arg);
+	}
+      else if (!strcmp(key, "sockets") && arg != NULL && rapl_replay_streams == NULL)
+	{
+	  rapl_replay_sockets = atoi(arg);
+	  ok = (rapl_replay_sockets > 0);
+	}
+      else if (!strcmp(key, "cpus") && arg != NULL)
+	{
+	  rapl_replay_cpus = atoi(arg);
+	  ok = (rapl_replay_cpus > 0);
+	}
+      else if (!strcmp(key, "units") && arg != NULL)
+	{
+	  rapl_replay_units = strtod(arg, NULL);
+	}
+      else if (!strcmp(key, "cores") && arg != NULL)
+	{
+	  rapl_replay_core_watts = strtod(arg, NULL);
+	}
+      else if (!strcmp(key, "throttled"))
+	{
+	  int t;
+	  for (t = 0; t < RAPL_THROTTLE_NUM && arg != NULL; t++, arg = strtok_r(NULL, " \t\n", &save))
+	    {
+	      rapl_replay_throttled[t] = strtod(arg, NULL);
+	    }
+	}
+      else if (!strcmp(key, "activity"))
+	{
+	  int a;
+	  for (a = 0; a < 3 && arg != NULL; a++, arg = strtok_r(NULL, " \t\n", &save))
+	    {
+	      rapl_replay_activity[a] = strtod(arg, NULL);
+	    }
+	}
+      else if (!strcmp(key, "range") && arg != NULL)
+	{
+	  rapl_replay_range = strtoull(arg, NULL, 0);
+	}
+      else if (!strcmp(key, "reg") && arg != NULL && rapl_replay_num_regs < RAPL_REPLAY_MAX_REGS)
+	{
+	  char* val = strtok_r(NULL, " \t\n", &save);
+	  ok = (val != NULL);
+	  if (ok)
+	    {
+	      rapl_replay_reg[rapl_replay_num_regs] = strtoul(arg, NULL, 0);
+	      rapl_replay_reg_val[rapl_replay_num_regs++] = strtoull(val, NULL, 0);
+	    }
+	}
+      else if (!strcmp(key, "domains") && rapl_replay_streams == NULL)
+	{
+	  rapl_replay_num_columns = 0;
+	  for (; arg != NULL && ok; arg = strtok_r(NULL, " \t\n", &save))
+	    {
+	      int d;
+	      for (d = 0; d < RAPL_DOMAIN_NUM && strcmp(arg, rapl_domain_name[d]); d++)
+		;
+	      ok = (d < RAPL_DOMAIN_NUM && rapl_replay_num_columns < RAPL_DOMAIN_NUM);
+	      if (ok)
+		{
+		  rapl_replay_column[rapl_replay_num_columns++] = d;
+		}
+	    }
+	}
+      else if (!strcmp(key, "synthetic") || !strcmp(key, "start"))
+	{
+	  rapl_replay_stream_t* st = rapl_replay_stream((arg != NULL) ? atoi(arg) : -1);
+	  ok = (st != NULL);
+	  if (ok && !strcmp(key, "synthetic"))
+	    {
+	      st->synthetic = 1;
+	      ok = (rapl_replay_values(&save, NULL, st->watts) == 0);
+	    }
+	  else if (ok)
+	    {
+	      ok = (rapl_replay_values(&save, st->start, NULL) == 0);
+	    }
+	}
+      else if (key[0] >= '0' && key[0] <= '9')
+	{
+	  /* a recorded row: socket v1 .. vn */
+	  rapl_replay_stream_t* st = rapl_replay_stream(atoi(key));
+	  ok = (st != NULL);
+	  if (ok && st->num_rows == st->size)
+	    {
+	      st->size = (st->size == 0) ? 64 : 2 * st->size;
+	      uint64_t* rows = (uint64_t*) realloc(st->rows, st->size * RAPL_DOMAIN_NUM * sizeof(uint64_t));
+	      ok = (rows != NULL);
+	      st->rows = ok ? rows : st->rows;
+	    }
+	  if (ok)
+	    {
+	      uint64_t* row = st->rows + st->num_rows * RAPL_DOMAIN_NUM;
+	      memset(row, 0, RAPL_DOMAIN_NUM * sizeof(uint64_t));
+	      int c;
+	      for (c = 0; ok && c < rapl_replay_num_columns; c++)
+		{
+		  char* tok = (c == 0) ? arg : strtok_r(NULL, " \t\n", &save);
+		  ok = (tok != NULL);
+		  if (ok)
+		    {
+		      row[rapl_replay_column[c]] = strtoull(tok, NULL, 0);
+		    }
+		}
+	      st->num_rows += ok;
+	    }
+	}
+      else
+	{
+	  ok = 0;
+	}
+    }
+  fclose(f);
+
+  if (!ok)
+    {
+      printf("[RAPL] Cannot parse line %d of %s\n", num, file);
+      return -1;
+    }
+  return (rapl_replay_stream(0) != NULL) ? 0 : -1;
+}
+
+static int
+rapl_replay_load()
+{
+  if (rapl_replay_loaded == 0)
+    {
+      const char* file = getenv("RAPL_REPLAY");
+      if (file == NULL)
+	{
+	  printf("[RAPL] The replay backend needs a trace file in RAPL_REPLAY\n");
+	  rapl_replay_loaded = -1;
+	}
+      else
+	{
+	  rapl_replay_loaded = (rapl_replay_parse(file) == 0) ? 1 : -1;
+	}
+    }
+  return (rapl_replay_loaded > 0) ? 0 : -1;
+}
+
+static int
+rapl_replay_backend_topology(int* num_cpus, int** pkg_of_cpu)
+{
+  if (rapl_replay_load() < 0)
+    {
+      return -1;
+    }
+  *num_cpus = rapl_replay_sockets * rapl_replay_cpus;
+  *pkg_of_cpu = (int*) malloc(*num_cpus * sizeof(int));
+  if (*pkg_of_cpu == NULL)
+    {
+      return -1;
+    }
+  int cpu;
+  for (cpu = 0; cpu < *num_cpus; cpu++)
+    {
+      (*pkg_of_cpu)[cpu] = cpu / rapl_replay_cpus;
+    }
+  return 0;
+}
+
+static int
+rapl_replay_backend_read_reg(int s, uint32_t reg, uint64_t* val)
+{
+  int i;
+  for (i = 0; i < RAPL_THROTTLE_NUM; i++)
+    {
+      if (reg == rapl_throttle_reg[i] && rapl_replay_throttled[i] > 0 && rapl_time_units > 0)
+	{
+	  const double t = (double) (rapl_monotonic_raw_ns() - rapl_replay_t0) / 1e9;
+	  *val = (uint32_t) (t * rapl_replay_throttled[i] / 100 / rapl_time_units);
+	  return 0;
+	}
+    }
+  if (rapl_replay_activity[0] > 0)
+    {
+      /* the cpu is busy (in C0) for a fraction of the time, and in core C6 otherwise */
+      const double t = (double) (rapl_monotonic_raw_ns() - rapl_replay_t0) / 1e9;
+      const double tsc = t * rapl_replay_activity[0] * 1e9;
+      const double busy = rapl_replay_activity[2] / 100;
+      switch (reg)
+	{
+	case MSR_IA32_TSC:
+	  *val = (uint64_t) tsc;
+	  return 0;
+	case MSR_IA32_MPERF:
+	  *val = (uint64_t) (tsc * busy);
+	  return 0;
+	case MSR_IA32_APERF:
+	  *val = (uint64_t) (tsc * busy * rapl_replay_activity[1] / rapl_replay_activity[0]);
+	  return 0;
+	case MSR_CORE_C6_RESIDENCY:
+	  *val = (uint64_t) (tsc * (1 - busy));
+	  return 0;
+	}
+    }
+  for (i = 0; i < rapl_replay_num_regs; i++)
+    {
+      if (rapl_replay_reg[i] == reg)
+	{
+	  *val = rapl_replay_reg_val[i];
+	  return 0;
+	}
+    }
+  return -1;
+}
+
+/* the registers are shared by all the simulated sockets */
+static int
+rapl_replay_backend_write_reg(int s, uint32_t reg, uint64_t val)
+{
+  int i;
+  for (i = 0; i < rapl_replay_num_regs && rapl_replay_reg[i] != reg; i++)
+    ;
+  if (i == RAPL_REPLAY_MAX_REGS)
+    {
+      return -1;
+    }
+  rapl_replay_reg[i] = reg;
+  rapl_replay_reg_val[i] = val;
+  if (i == rapl_replay_num_regs)
+    {
+      rapl_replay_num_regs++;
+    }
+  return 0;
+}
+
+static int
+rapl_replay_backend_init(int* available, double* units, uint64_t* range)
+{
+  if (rapl_replay_load() < 0 || rapl_num_sockets != rapl_replay_sockets)
+    {
+      return -1;
+    }
+  rapl_cpu_model = rapl_replay_model;
+  if (rapl_read_cpu_info(rapl_cpu_model) != NULL)
+    {
+      rapl_cpu = rapl_read_cpu_info(rapl_cpu_model);
+    }
+
+  /* the energy units of the trace, or of its MSR_RAPL_POWER_UNIT, or 2^-16 J */
+  double energy_units = rapl_replay_units;
+  uint64_t unit_reg;
+  if (energy_units <= 0)
+    {
+      energy_units = (rapl_replay_backend_read_reg(0, MSR_RAPL_POWER_UNIT, &unit_reg) == 0) 
+	? pow(0.5, (double)((unit_reg>>8)&0x1f)) : pow(0.5, 16);
+    }
+
+  int c;
+  for (c = 0; c < rapl_replay_num_columns; c++)
+    {
+      int d = rapl_replay_column[c];
+      available[d] = 1;
+      units[d] = energy_units;
+      range[d] = rapl_replay_range;
+    }
+  rapl_replay_t0 = rapl_monotonic_raw_ns();
+  return 0;
+}
+
+static int
+rapl_replay_backend_open(int s, int cpu)
+{
+  return (s < rapl_replay_sockets) ? 0 : -1;
+}
+
+static void
+rapl_replay_backend_close(int s)
+{
+}
+
+static void
+rapl_replay_backend_read(int s0, int s1, const int* domains, int n, uint64_t* out)
+{
+  const double t = (double) (rapl_monotonic_raw_ns() - rapl_replay_t0) / 1e9;
+  int s, i, j = 0;
+  for (s = s0; s < s1; s++)
+    {
+      rapl_replay_stream_t* st = rapl_replay_streams + s;
+      const uint64_t* row = NULL;
+      if (st->num_rows > 0)
+	{
+	  size_t r = __sync_fetch_and_add(&st->next, 1);
+	  row = st->rows + ((r < st->num_rows) ? r : st->num_rows - 1) * RAPL_DOMAIN_NUM;
+	}
+
+      for (i = 0; i < n; i++, j++)
+	{
+	  const int d = domains[i];
+	  if (row != NULL)
+	    {
+	      out[j] = row[d];
+	    }
+	  else if (st->synthetic)
+	    {
+	      out[j] = st->start[d] + (uint64_t) (st->watts[d] * t / rapl_domain_units[d]);
+	      if (rapl_domain_range[d] != 0)
+		{
+		  out[j] %= rapl_domain_range[d];
+		}
+	    }
+	  else
+	    {
+	      out[j] = 0;
+	    }
+	}
+    }
+}
+
+/* each cpu is a core, with a synthetic counter at the watts of the cores directive */
+static int
+rapl_replay_backend_cores(int* num_cores, int** core_cpu, double* units, uint64_t* range)
+{
+  if (rapl_replay_core_watts < 0)
+    {
+      return -1;
+    }
+  *core_cpu = (int*) malloc(rapl_num_cpus * sizeof(int));
+  if (*core_cpu == NULL)
+    {
+      return -1;
+    }
+  int c;
+  for (c = 0; c < rapl_num_cpus; c++)
+    {
+      (*core_cpu)[c] = c;
+    }
+  *num_cores = rapl_num_cpus;
+  *units = rapl_domain_units[RAPL_DOMAIN_PKG];
+  *range = rapl_replay_range;
+  return 0;
+}
+
+static void
+rapl_replay_backend_read_cores(uint64_t* out)
+{
+  const double t = (double) (rapl_monotonic_raw_ns() - rapl_replay_t0) / 1e9;
+  int c;
+  for (c = 0; c < rapl_num_cores; c++)
+    {
+      out[c] = (uint64_t) (rapl_replay_core_watts * t / rapl_core_units);
+      if (rapl_core_range != 0)
+	{
+	  out[c] %= rapl_core_range;
+	}
+    }
+}
+
+const rapl_backend_t rapl_backend_replay =
+  {
+    "replay", rapl_replay_backend_init, rapl_replay_backend_open, rapl_replay_backend_close,
+    rapl_replay_backend_read, rapl_replay_backend_read_reg, rapl_replay_backend_topology,
+    rapl_replay_backend_write_reg, rapl_replay_backend_cores, rapl_replay_backend_read_cores
+  };
+
+static const rapl_backend_t* rapl_backends[] =
+  {
+    &rapl_backend_msr, &rapl_backend_powercap, &rapl_backend_perf, &rapl_backend_replay, 
+    &rapl_backend_amd, NULL
+  };
+
+int
+rapl_read_set_backend(const rapl_backend_t* backend)
+{
+  if (backend == NULL || rapl_backend_ok)
+    {
+      return -1;
+    }
+  rapl_backend = backend;
+  return 0;
+}
+
+int
+rapl_read_select_backend(const char* name)
+{
+  int i;
+  for (i = 0; rapl_backends[i] != NULL; i++)
+    {
+      if (!strcmp(rapl_backends[i]->name, name))
+	{
+	  return rapl_read_set_backend(rapl_backends[i]);
+	}
+    }
+  printf("[RAPL] Unknown backend %s\n", name);
+  return -1;
+}
+
+const char*
+rapl_read_backend_name()
+{
+  return (rapl_backend != NULL) ? rapl_backend->name : "none";
+}
+
+int
+rapl_read_domain_available(int domain)
+{
+  return (domain >= 0 && domain < RAPL_DOMAIN_NUM && rapl_backend_ok) ? rapl_domain_available[domain] : 0;
+}
+
+/* choose the backend, if the application has not: RAPL_BACKEND, else msr (amd on 
+   AMD Zen) if the device can be read, else powercap. Called once, with the topology discovery. */
+static void
+rapl_backend_select()
+{
+  const char* name = getenv("RAPL_BACKEND");
+  if (rapl_backend == NULL && name != NULL)
+    {
+      rapl_read_select_backend(name);
+    }
+  if (rapl_backend == NULL)
+    {
+      char path[BUFSIZ];
+      int cpu = sched_getcpu();
+      rapl_msr_path((cpu < 0) ? 0 : cpu, path, sizeof(path));
+      rapl_backend = (access(path, R_OK) != 0) ? &rapl_backend_powercap
+	: (rapl_amd_family() >= 0x17) ? &rapl_backend_amd : &rapl_backend_msr;
+    }
+}
+
+static void
+rapl_plan_compile()
+{
+  static const int pack_pp0[3] = { RAPL_DOMAIN_DRAM, RAPL_DOMAIN_PKG, RAPL_DOMAIN_PP0 };
+  int i, d;
+
+  rapl_plan_all.n = 0;
+  for (d = 0; d < RAPL_DOMAIN_NUM; d++)
+    {
+      if (rapl_domain_available[d])
+	{
+	  rapl_plan_all.domains[rapl_plan_all.n++] = d;
+	}
+    }
+
+  /* the package and pp0 are read even if the backend does not provide them (0) */
+  rapl_plan_pack_pp0.n = 0;
+  for (i = rapl_domain_available[RAPL_DOMAIN_DRAM] ? 0 : 1; i < 3; i++)
+    {
+      rapl_plan_pack_pp0.domains[rapl_plan_pack_pp0.n++] = pack_pp0[i];
+    }
+
+  /* and the throttled-time counters that the model has, around the energy reads */
+  const int regs = (rapl_backend->read_reg != NULL);
+  rapl_throttle_available[RAPL_THROTTLE_PKG] = regs && rapl_cpu->pkg_perf_status;
+  rapl_throttle_available[RAPL_THROTTLE_PP0] = regs && rapl_cpu->pp0_perf_status
+    && rapl_domain_available[RAPL_DOMAIN_PP0];
+  rapl_throttle_available[RAPL_THROTTLE_DRAM] = regs && rapl_cpu->dram_perf_status
+    && rapl_domain_available[RAPL_DOMAIN_DRAM];
+
+  /* and the activity counters: the architectural ones on any known model */
+  const int known = regs && (rapl_cpu != &rapl_cpu_none);
+  rapl_act_available[RAPL_ACT_TSC] = known;
+  rapl_act_available[RAPL_ACT_APERF] = known;
+  rapl_act_available[RAPL_ACT_MPERF] = known;
+  int c;
+  for (c = 0; c < RAPL_CSTATE_NUM; c++)
+    {
+      rapl_act_available[RAPL_ACT_CSTATE + c] = known && (rapl_cpu->cstates & (1 << c));
+    }
+  rapl_thermal_available = known;
+}
+
+static void
+rapl_backend_setup()
+{
+  if (rapl_backend->init(rapl_domain_available, rapl_domain_units, rapl_domain_range) < 0)
+    {
+      return;
+    }
+  rapl_energy_units = rapl_domain_units[RAPL_DOMAIN_PKG];
+  rapl_plan_compile();
+  if (rapl_backend->cores != NULL 
+      && rapl_backend->cores(&rapl_num_cores, &rapl_core_cpu, &rapl_core_units, &rapl_core_range) == 0)
+    {
+      /* the default session was allocated with the topology */
+      if (rapl_session_cores_alloc(rapl_session_default) < 0)
+	{
+	  rapl_num_cores = 0;
+	}
+    }
+  else
+    {
+      rapl_num_cores = 0;
+    }
+  rapl_backend_ok = 1;
+}
+
+/* select and initialize the backend once, whichever thread gets here first */
+static int
+rapl_backend_init()
+{
+  pthread_once(&rapl_backend_once, rapl_backend_setup);
+  return rapl_backend_ok ? 0 : -1;
+}
+
+/* a register of socket s, or 0 if the backend has no access to registers */
+static inline long long int
+rapl_read_reg(int s, uint32_t reg)
+{
+  uint64_t val = 0;
+  if (rapl_backend->read_reg == NULL)
+    {
+      return 0;
+    }
+  rapl_read_ticks t0 = 0;
+  if (rapl_counters_time)
+    {
+      t0 = rapl_read_now();
+    }
+  int ret = rapl_backend->read_reg(s, reg, &val);
+  if (rapl_counters_time)
+    {
+      RAPL_COUNT(rapl_sockets[s]->read_ticks, rapl_read_now() - t0);
+    }
+  RAPL_COUNT(rapl_sockets[s]->reg_reads, 1);
+  return (ret < 0) ? 0 : (long long int) val;
+}
+
+typedef struct rapl_therm
+{
+  double pkg, core;		/* C */
+  uint32_t status[2];		/* the RAPL_THERM_* bits of the package and the core */
+} rapl_therm_t;
+
+/* the temperatures and the thermal status of socket s (and of the cpu that reads it) */
+static void
+rapl_read_thermal(int s, rapl_therm_t* t)
+{
+  rapl_socket_state_t* st = rapl_sockets[s];
+  if (st->tjmax == 0)
+    {
+      st->tjmax = (rapl_read_reg(s, MSR_TEMPERATURE_TARGET) >> 16) & 0xff;
+    }
+  const uint64_t pkg = rapl_read_reg(s, MSR_IA32_PACKAGE_THERM_STATUS);
+  const uint64_t core = rapl_read_reg(s, MSR_IA32_THERM_STATUS);
+  t->pkg = st->tjmax - (double) ((pkg >> 16) & 0x7f);
+  t->core = st->tjmax - (double) ((core >> 16) & 0x7f);
+  t->status[0] = pkg & RAPL_THERM_BITS;
+  t->status[1] = core & RAPL_THERM_BITS;
+}
+
+/* fold a thermal reading into the window of sk; under the lock of sk */
+static inline void
+rapl_thermal_fold(rapl_session_socket_t* sk, const rapl_therm_t* t)
+{
+  if (sk->temp_samples++ == 0 || t->pkg > sk->temp_pkg_peak)
+    {
+      sk->temp_pkg_peak = t->pkg;
+    }
+  if (sk->temp_samples == 1 || t->core > sk->temp_core_peak)
+    {
+      sk->temp_core_peak = t->core;
+    }
+  sk->temp_pkg_sum += t->pkg;
+  sk->temp_core_sum += t->core;
+  sk->therm_seen[0] |= t->status[0];
+  sk->therm_seen[1] |= t->status[1];
+}
+
+/* reset the thermal window of sk, left closed (the edges do not read the thermal
+   registers) */
+static void
+rapl_thermal_reset(rapl_session_socket_t* sk)
+{
+  rapl_spin_lock(&sk->therm_lock);
+  sk->temp_samples = 0;
+  sk->therm_open = 0;
+  rapl_spin_unlock(&sk->therm_lock);
+}
+
+/* open (or close) the thermal window of socket s in sk with a reading of the edge */
+static void
+rapl_thermal_edge(int s, rapl_session_socket_t* sk, int stop)
+{
+  rapl_therm_t t;
+  rapl_read_thermal(s, &t);
+  rapl_spin_lock(&sk->therm_lock);
+  if (stop)
+    {
+      rapl_thermal_fold(sk, &t);
+      sk->therm_stop[0] = t.status[0];
+      sk->therm_stop[1] = t.status[1];
+      sk->therm_open = 0;
+    }
+  else
+    {
+      sk->temp_samples = 0;
+      sk->temp_pkg_sum = sk->temp_core_sum = 0;
+      sk->therm_seen[0] = sk->therm_seen[1] = 0;
+      rapl_thermal_fold(sk, &t);
+      sk->therm_start[0] = t.status[0];
+      sk->therm_start[1] = t.status[1];
+      sk->therm_open = 1;
+    }
+  rapl_spin_unlock(&sk->therm_lock);
+}
+
+/* fold a reading of the sampler of socket s into the open windows of all the sessions */
+static void
+rapl_thermal_sample(int s, const rapl_therm_t* t)
+{
+  rapl_session_t* ss;
+  pthread_rwlock_rdlock(&rapl_sessions_lock);
+  for (ss = rapl_sessions; ss != NULL; ss = ss->next)
+    {
+      rapl_session_socket_t* sk = ss->sk[s];
+      rapl_spin_lock(&sk->therm_lock);
+      if (sk->therm_open)
+	{
+	  rapl_thermal_fold(sk, t);
+	}
+      rapl_spin_unlock(&sk->therm_lock);
+    }
+  pthread_rwlock_unlock(&rapl_sessions_lock);
+}
+
+/* whether the accumulation started or stopped during the window of sk: its edges 
+   are then in different representations (raw and 64-bit accumulated) */
+static inline int
+rapl_window_mixed(const rapl_session_socket_t* sk)
+{
+  return sk->acc_epoch[0] != sk->acc_epoch[1] || (sk->acc_epoch[0] & 1);
+}
+
+/* whether the window of sk was read with the 64-bit accumulation */
+static inline int
+rapl_window_accumulated(const rapl_session_socket_t* sk)
+{
+  return !rapl_window_mixed(sk) && ((sk->acc_epoch[0] >> 1) & 1);
+}
+
+/* the throttled-time counters of socket s that the model has, and the activity and
+   thermal registers if enabled (RAPL_EDGE_*), into the start (or the stop) edge of 
+   sk. They are read around the timed energy reads. The stop edge reads what the 
+   start edge read, so that a window never mixes. */
+static inline void
+rapl_read_socket_regs(int s, rapl_session_socket_t* sk, int stop)
+{
+  uint32_t* throttled = stop ? sk->throttled_after : sk->throttled_before;
+  uint64_t* act = stop ? sk->act_after : sk->act_before;
+  int i;
+  sk->acc_epoch[stop] = __atomic_load_n(&rapl_acc_epoch, __ATOMIC_SEQ_CST);
+  if (stop && rapl_window_mixed(sk))
+    {
+      /* raw at one edge and accumulated at the other: no energy rather than garbage */
+      memcpy(sk->after, sk->before, sizeof(sk->after));
+    }
+  for (i = 0; i < RAPL_THROTTLE_NUM; i++)
+    {
+      if (rapl_throttle_available[i])
+	{
+	  throttled[i] = (uint32_t) rapl_read_reg(s, rapl_throttle_reg[i]);
+	}
+    }
+  if (!stop)
+    {
+      sk->act_on = (rapl_edge_flags & RAPL_EDGE_ACTIVITY) != 0;
+    }
+  for (i = 0; sk->act_on && i < RAPL_ACT_NUM; i++)
+    {
+      if (rapl_act_available[i])
+	{
+	  act[i] = (uint64_t) rapl_read_reg(s, rapl_act_reg[i]);
+	}
+    }
+  if (rapl_thermal_available && (stop ? sk->therm_open : (rapl_edge_flags & RAPL_EDGE_THERMAL)))
+    {
+      rapl_thermal_edge(s, sk, stop);
+    }
+  else if (!stop)
+    {
+      rapl_thermal_reset(sk);
+    }
+}
+
+void
+rapl_read_edge_regs(int flags)
+{
+  rapl_edge_flags = flags & (RAPL_EDGE_ACTIVITY | RAPL_EDGE_THERMAL);
+}
+
+/* probe the throttled-time, activity, and thermal registers that the CPU table 
+   gives the model on the first opened socket s, once: a register that cannot be 
+   read (e.g., a wrong entry of the table) is not read again */
+static void
+rapl_probe_socket_regs(int s)
+{
+  static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  static int probed = 0;
+  uint64_t val;
+  int i;
+  pthread_mutex_lock(&lock);
+  if (!probed && rapl_backend->read_reg != NULL)
+    {
+      for (i = 0; i < RAPL_THROTTLE_NUM; i++)
+	{
+	  rapl_throttle_available[i] = rapl_throttle_available[i] 
+	    && rapl_backend->read_reg(s, rapl_throttle_reg[i], &val) == 0;
+	}
+      for (i = 0; i < RAPL_ACT_NUM; i++)
+	{
+	  rapl_act_available[i] = rapl_act_available[i] 
+	    && rapl_backend->read_reg(s, rapl_act_reg[i], &val) == 0;
+	}
+      rapl_thermal_available = rapl_thermal_available
+	&& rapl_backend->read_reg(s, MSR_TEMPERATURE_TARGET, &val) == 0
+	&& rapl_backend->read_reg(s, MSR_IA32_PACKAGE_THERM_STATUS, &val) == 0
+	&& rapl_backend->read_reg(s, MSR_IA32_THERM_STATUS, &val) == 0;
+    }
+  probed = 1;
+  pthread_mutex_unlock(&lock);
+}
+
+static const char* rapl_throttle_name[RAPL_THROTTLE_NUM] =
+  {
+    "Package", "PowerPlane0", "DRAM"
+  };
+
+/* the percentage of the window of socket s of ss that domain t was throttled */
+static double
+rapl_throttled_pct(rapl_session_t* ss, int s, int t)
+{
+  const rapl_session_socket_t* sk = ss->sk[s];
+  const double window = rapl_ticks_to_s(sk->stop_ts - sk->start_ts);
+  if (!rapl_throttle_available[t] || window <= 0)
+    {
+      return 0;
+    }
+  const uint32_t delta = sk->throttled_after[t] - sk->throttled_before[t];
+  return 100.0 * delta * rapl_time_units / window;
+}
+
+/* warn about each domain of socket s that was throttled during the window of ss */
+static void
+rapl_throttled_warn(rapl_session_t* ss, int s)
+{
+  int t;
+  for (t = 0; t < RAPL_THROTTLE_NUM; t++)
+    {
+      const double pct = rapl_throttled_pct(ss, s, t);
+      if (pct > 0)
+	{
+	  printf("[RAPL][%d] WARNING: %s was throttled for %.2f%% of the window\n", 
+		 s, rapl_throttle_name[t], pct);
+	}
+    }
+}
+
+static const char* rapl_cstate_name[RAPL_CSTATE_NUM] =
+  {
+    "Package C2", "Package C3", "Package C6", "Package C7", "Core C3", "Core C6", "Core C7"
+  };
+
+/* 1 if the residency counter of C-state c is of a core (of the reading cpu), and not
+   of the package */
+static inline int
+rapl_cstate_is_core(int c)
+{
+  return c >= RAPL_CSTATE_CORE_C3;
+}
+
+/* the delta of activity counter a of socket s over the window of ss, or 0 */
+static inline uint64_t
+rapl_act_delta(rapl_session_t* ss, int s, int a)
+{
+  return (rapl_act_available[a] && ss->sk[s]->act_on) ? ss->sk[s]->act_after[a] - ss->sk[s]->act_before[a] : 0;
+}
+
+/* the effective frequency (GHz) in C0 and the fraction of the window in C0 of the cpu
+   that reads socket s, over the window of ss */
+static void
+rapl_activity(rapl_session_t* ss, int s, double* freq, double* busy)
+{
+  const rapl_session_socket_t* sk = ss->sk[s];
+  const double window = rapl_ticks_to_s(sk->stop_ts - sk->start_ts);
+  const uint64_t tsc = rapl_act_delta(ss, s, RAPL_ACT_TSC);
+  const uint64_t aperf = rapl_act_delta(ss, s, RAPL_ACT_APERF);
+  const uint64_t mperf = rapl_act_delta(ss, s, RAPL_ACT_MPERF);
+  *freq = (mperf > 0 && window > 0) ? (double) tsc / window * aperf / mperf / 1e9 : 0;
+  *busy = (tsc > 0) ? (double) mperf / tsc : 0;
+}
+
+/* the RAPL_THERM_*_LOG bits of the package (15:0) and of the core (31:16) of socket s
+   raised during the window of ss: seen as a status bit, or logged at the stop edge 
+   but not at the start */
+static uint32_t
+rapl_thermal_events(rapl_session_t* ss, int s)
+{
+  const rapl_session_socket_t* sk = ss->sk[s];
+  uint32_t ev[2];
+  int r;
+  for (r = 0; r < 2; r++)
+    {
+      ev[r] = ((sk->therm_seen[r] & RAPL_THERM_STATUS_BITS) << 1) 
+	| (sk->therm_stop[r] & ~sk->therm_start[r] & (RAPL_THERM_STATUS_BITS << 1));
+    }
+  return ev[0] | (ev[1] << 16);
+}
+
+static void
+rapl_accumulate_warn(rapl_session_t* ss, int s)
+{
+  if (rapl_window_mixed(ss->sk[s]))
+    {
+      printf("[RAPL][%d] WARNING: the accumulation started or stopped during the window, whose energy"
+	     " is not reported (0 J)\n", s);
+    }
+}
+
+static void
+rapl_thermal_warn(rapl_session_t* ss, int s)
+{
+  static const char* where[2] = { "the package", "the core" };
+  const uint32_t ev = rapl_thermal_events(ss, s);
+  int r;
+  for (r = 0; r < 2; r++)
+    {
+      const uint32_t e = (ev >> (16 * r)) & 0xffff;
+      if (e & (RAPL_THERM_THROTTLE_LOG | RAPL_THERM_PROCHOT_LOG | RAPL_THERM_CRITICAL_LOG))
+	{
+	  printf("[RAPL][%d] WARNING: %s was thermally throttled during the window%s%s\n", s, where[r],
+		 (e & RAPL_THERM_PROCHOT_LOG) ? " (PROCHOT)" : "", 
+		 (e & RAPL_THERM_CRITICAL_LOG) ? " (critical temperature)" : "");
+	}
+    }
+}
+
+/* the percentage of the window of socket s of ss in C-state c */
+static double
+rapl_residency_pct(rapl_session_t* ss, int s, int c)
+{
+  const uint64_t tsc = rapl_act_delta(ss, s, RAPL_ACT_TSC);
+  return (tsc > 0) ? 100.0 * rapl_act_delta(ss, s, RAPL_ACT_CSTATE + c) / tsc : 0;
+}
+
+/* whether the window of ss read the RAPL_EDGE_* registers of flag on some socket */
+static int
+rapl_session_edge_regs(rapl_session_t* ss, int flag)
+{
+  int s;
+  FOR_ALL_SOCKETS(s)
+  {
+    if (rapl_sockets[s]->initialized 
+	&& ((flag == RAPL_EDGE_ACTIVITY) ? ss->sk[s]->act_on : ss->sk[s]->temp_samples > 0))
+      {
+	return 1;
+      }
+  }
+  return 0;
+}
+
+/* the time window (s) of the 7-bit field of a power limit: 2^Y * (1 + Z/4) time units,
+   with Y in bits 4:0 and Z in bits 6:5 */
+static double
+rapl_limit_window(uint64_t field)
+{
+  return rapl_time_units * ldexp(1.0 + ((field >> 5) & 0x3) / 4.0, field & 0x1f);
+}
+
+/* the units, power info and package power limit, from the registers of socket s */
+static void
+rapl_read_platform_info(int s)
+{
+  if (rapl_backend->read_reg == NULL)
+    {
+      return;
+    }
+
+  /* Calculate the units used */
+  long long int result = rapl_read_reg(s, MSR_RAPL_POWER_UNIT);
+  rapl_power_units = pow(0.5, (double)(result&0xf));
+  rapl_time_units = pow(0.5, (double)((result>>16)&0xf));
+
+
+  /* Show package power info */
+  result = rapl_read_reg(s, MSR_PKG_POWER_INFO);
+  rapl_thermal_spec_power = rapl_power_units * (double)(result&0x7fff);
+  rapl_minimum_power = rapl_power_units * (double)((result>>16)&0x7fff);
+  rapl_maximum_power = rapl_power_units * (double)((result>>32)&0x7fff);
+  rapl_time_window = rapl_time_units * (double)((result>>48)&0x7fff);
+
+
+  /* Show package power limit */
+  result = rapl_read_reg(s, MSR_PKG_RAPL_POWER_LIMIT);
+  rapl_msr_pkg_settings = result;
+  rapl_pkg_power_limit_1 = rapl_power_units * (double)((result>>0)&0x7FFF);
+  rapl_pkg_time_window_1 = rapl_limit_window((result>>17)&0x007F);
+  rapl_pkg_power_limit_2 = rapl_power_units * (double)((result>>32)&0x7FFF);
+  rapl_pkg_time_window_2 = rapl_limit_window((result>>49)&0x007F);
+}
+
+/*********************************************************************************/
+/* power limits */
+/*********************************************************************************/
+
+static const struct
+{
+  uint32_t reg;
+  int shift;			/* of the 24-bit limit in the register */
+  int lock_bit;
+} rapl_limit_desc[RAPL_LIMIT_NUM] =
+  {
+    { MSR_PKG_RAPL_POWER_LIMIT, 0, 63 },
+    { MSR_PKG_RAPL_POWER_LIMIT, 32, 63 },
+    { MSR_DRAM_POWER_LIMIT, 0, 31 },
+    { MSR_PP0_POWER_LIMIT, 0, 31 },
+  };
+
+#define RAPL_LIMIT_POWER_MASK   0x7FFFULL
+#define RAPL_LIMIT_ENABLE       (1ULL << 15)
+#define RAPL_LIMIT_CLAMP        (1ULL << 16)
+#define RAPL_LIMIT_WINDOW_SHIFT 17
+#define RAPL_LIMIT_WINDOW_MASK  0x7FULL
+#define RAPL_LIMIT_MASK         0xFFFFFFULL
+
+/* the original values of the written registers (socket * RAPL_LIMIT_NUM + limit) */
+static uint64_t* rapl_limit_saved = NULL;
+static uint8_t* rapl_limit_is_saved = NULL;
+static pthread_mutex_t rapl_limit_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+rapl_limit_check(int socket, int limit)
+{
+  if (limit < 0 || limit >= RAPL_LIMIT_NUM || socket < 0 || socket >= rapl_num_sockets 
+      || !rapl_sockets[socket]->initialized || rapl_backend->read_reg == NULL)
+    {
+      return -1;
+    }
+  if ((limit == RAPL_LIMIT_DRAM && !rapl_domain_available[RAPL_DOMAIN_DRAM])
+      || (limit == RAPL_LIMIT_PP0 && !rapl_domain_available[RAPL_DOMAIN_PP0]))
+    {
+      return -1;
+    }
+  return 0;
+}
+
+int
+rapl_read_get_power_limit(int socket, int limit, rapl_power_limit_t* l)
+{
+  uint64_t reg;
+  if (rapl_limit_check(socket, limit) < 0 
+      || rapl_backend->read_reg(socket, rapl_limit_desc[limit].reg, &reg) < 0)
+    {
+      return -1;
+    }
+
+  uint64_t v = (reg >> rapl_limit_desc[limit].shift) & RAPL_LIMIT_MASK;
+  l->power = rapl_power_units * (double) (v & RAPL_LIMIT_POWER_MASK);
+  l->window = rapl_limit_window((v >> RAPL_LIMIT_WINDOW_SHIFT) & RAPL_LIMIT_WINDOW_MASK);
+  l->enabled = (v & RAPL_LIMIT_ENABLE) != 0;
+  l->clamped = (v & RAPL_LIMIT_CLAMP) != 0;
+  l->locked = (reg >> rapl_limit_desc[limit].lock_bit) & 1;
+  return 0;
+}
+
+/* the 7-bit encoding (Z in 6:5, Y in 4:0) of the closest window to window_s */
+static uint64_t
+rapl_limit_window_encode(double window_s)
+{
+  uint64_t best = 0, e;
+  double best_err = HUGE_VAL;
+  for (e = 0; e <= RAPL_LIMIT_WINDOW_MASK; e++)
+    {
+      double err = fabs(rapl_limit_window(e) - window_s);
+      if (err < best_err)
+	{
+	  best_err = err;
+	  best = e;
+	}
+    }
+  return best;
+}
+
+static void
+rapl_limit_restore_at_exit()
+{
+  rapl_read_restore_power_limits();
+}
+
+int
+rapl_read_set_power_limit(int socket, int limit, const rapl_power_limit_t* l)
+{
+  if (rapl_limit_check(socket, limit) < 0 || rapl_backend->write_reg == NULL 
+      || l->power < 0 || rapl_power_units <= 0)
+    {
+      return -1;
+    }
+
+  const uint32_t msr = rapl_limit_desc[limit].reg;
+  const int shift = rapl_limit_desc[limit].shift;
+  pthread_mutex_lock(&rapl_limit_mutex);
+
+  uint64_t reg;
+  if (rapl_backend->read_reg(socket, msr, &reg) < 0)
+    {
+      pthread_mutex_unlock(&rapl_limit_mutex);
+      return -1;
+    }
+  if ((reg >> rapl_limit_desc[limit].lock_bit) & 1)
+    {
+      pthread_mutex_unlock(&rapl_limit_mutex);
+      printf("[RAPL] The power limits of register 0x%x of socket %d are locked\n", msr, socket);
+      return -1;
+    }
+
+  if (rapl_limit_saved == NULL)
+    {
+      rapl_limit_saved = (uint64_t*) calloc(rapl_num_sockets * RAPL_LIMIT_NUM, sizeof(uint64_t));
+      rapl_limit_is_saved = (uint8_t*) calloc(rapl_num_sockets * RAPL_LIMIT_NUM, sizeof(uint8_t));
+      if (rapl_limit_saved == NULL || rapl_limit_is_saved == NULL)
+	{
+	  free(rapl_limit_saved);
+	  free(rapl_limit_is_saved);
+	  rapl_limit_saved = NULL;
+	  rapl_limit_is_saved = NULL;
+	  pthread_mutex_unlock(&rapl_limit_mutex);
+	  return -1;
+	}
+      atexit(rapl_limit_restore_at_exit);
+    }
+  const int i = socket * RAPL_LIMIT_NUM + limit;
+  if (!rapl_limit_is_saved[i])
+    {
+      rapl_limit_saved[i] = reg;
+      rapl_limit_is_saved[i] = 1;
+    }
+
+  uint64_t power = (uint64_t) (l->power / rapl_power_units + 0.5);
+  if (power > RAPL_LIMIT_POWER_MASK)
+    {
+      power = RAPL_LIMIT_POWER_MASK;
+    }
+  uint64_t v = power | (rapl_limit_window_encode(l->window) << RAPL_LIMIT_WINDOW_SHIFT);
+  if (l->enabled)
+    {
+      v |= RAPL_LIMIT_ENABLE;
+    }
+  if (l->clamped)
+    {
+      v |= RAPL_LIMIT_CLAMP;
+    }
+  reg = (reg & ~(RAPL_LIMIT_MASK << shift)) | (v << shift);
+
+  /* the write can be ignored (e.g., by a hypervisor): read it back */
+  uint64_t check;
+  int ret = (rapl_backend->write_reg(socket, msr, reg) == 0 && rapl_backend->read_reg(socket, msr, &check) == 0
+	     && ((check ^ reg) & (RAPL_LIMIT_MASK << shift)) == 0) ? 0 : -1;
+  pthread_mutex_unlock(&rapl_limit_mutex);
+  if (ret < 0)
+    {
+      printf("[RAPL] Could not write register 0x%x of socket %d\n", msr, socket);
+    }
+  return ret;
+}
+
+void
+rapl_read_restore_power_limits()
+{
+  pthread_mutex_lock(&rapl_limit_mutex);
+  if (rapl_limit_saved == NULL)
+    {
+      pthread_mutex_unlock(&rapl_limit_mutex);
+      return;
+    }
+
+  int s, limit;
+  FOR_ALL_SOCKETS(s)
+  {
+    for (limit = 0; limit < RAPL_LIMIT_NUM; limit++)
+      {
+	const int i = s * RAPL_LIMIT_NUM + limit;
+	if (!rapl_limit_is_saved[i])
+	  {
+	    continue;
+	  }
+	/* restore only the bits of this limit: PL1 and PL2 share a register */
+	const uint32_t msr = rapl_limit_desc[limit].reg;
+	const uint64_t mask = RAPL_LIMIT_MASK << rapl_limit_desc[limit].shift;
+	uint64_t reg;
+	if (rapl_backend->read_reg(s, msr, &reg) < 0 
+	    || rapl_backend->write_reg(s, msr, (reg & ~mask) | (rapl_limit_saved[i] & mask)) < 0)
+	  {
+	    printf("[RAPL] Could not restore register 0x%x of socket %d\n", msr, s);
+	    continue;
+	  }
+	rapl_limit_is_saved[i] = 0;
+      }
+  }
+  pthread_mutex_unlock(&rapl_limit_mutex);
+}
+
+int
+rapl_read_init(int core)
+{
+  if (rapl_topology_init() < 0)
+    {
+      printf("[RAPL] Cannot discover the topology\n");
+      return -1;
+    }
+  rapl_timebase_init();
+
+  rapl_core = core; 
+  if (rapl_core < 0 || rapl_core >= rapl_num_cpus || rapl_cpu_socket[rapl_core] < 0)
+    {
+      return 2;
+    }
+  rapl_socket = rapl_cpu_socket[rapl_core];
+  
+  /* try to be the "guy" for this socket */
+  if (__sync_bool_compare_and_swap(&rapl_sockets[rapl_socket]->resp_core, 0, rapl_get_core_with_offs()) == 0)
+    {
+      return 2;
+    }
+
+
+  __sync_fetch_and_add(&rapl_num_active_sockets, 1);
+
+  if (rapl_backend_init() < 0)
+    {
+      printf("[RAPL] Cannot initialize the %s backend\n", rapl_read_backend_name());
+      return -1;
+    }
+
+  if (rapl_backend->open(rapl_socket, core) < 0)
+    {
+      printf("[RAPL] Cannot open the energy counters\n");
+      return -1;
+    }
+  rapl_sockets[rapl_socket]->msr_core = core;
+  rapl_probe_socket_regs(rapl_socket);
+
+  rapl_sockets[rapl_socket]->initialized = 1;
+
+
+  if (!rapl_allowed_once())
+    {
+      return 1;
+    }
+  rapl_read_platform_info(rapl_socket);
+  return 1;
+}
+
+int
+rapl_read_init_all()
+{
+  if (rapl_topology_init() < 0)
+    {
+      printf("[RAPL] Cannot discover the topology\n");
+      return -1;
+    }
+  rapl_timebase_init();
+
+  __sync_fetch_and_add(&rapl_num_active_sockets, rapl_num_sockets);
+
+  if (rapl_backend_init() < 0)
+    {
+      printf("[RAPL] Cannot initialize the %s backend\n", rapl_read_backend_name());
+      return -1;
+    }
+
+
+  int s;
+  FOR_ALL_SOCKETS(s)
+  {
+    if (rapl_backend->open(s, rapl_socket_cpu[s]) < 0)
+      {
+	printf("[RAPL] Cannot open the energy counters\n");
+	return -1;
+      }
+    rapl_sockets[s]->msr_core = rapl_socket_cpu[s];
+    rapl_probe_socket_regs(s);
+
+    rapl_sockets[s]->initialized = 1;
+  }
+ 
+  rapl_read_platform_info(0);
+  return 1;
+}
+
+/* the domains that the backend provides, in RAPL_DOMAIN_* order; returns their number */
+static int
+rapl_domains_available(int* domains)
+{
+  int d, n = 0;
+  for (d = 0; d < RAPL_DOMAIN_NUM; d++)
+    {
+      if (rapl_domain_available[d])
+	{
+	  domains[n++] = d;
+	}
+    }
+  return n;
+}
+
+/* read the domains of plan p on socket s as one batch, into raw[domain] */
+static inline void
+rapl_read_plan(const rapl_plan_t* p, int s, uint64_t* raw)
+{
+  uint64_t result[RAPL_DOMAIN_NUM];
+  int i;
+  rapl_read_energy_batch(s, s + 1, p->domains, p->n, result);
+  for (i = 0; i < p->n; i++)
+    {
+      raw[p->domains[i]] = result[i];
+    }
+}
+
+void
+rapl_read_start()
+{
+  if (!rapl_allowed())
+    {
+      return;
+    }
+  rapl_session_t* ss = rapl_session_default;
+  long long int result; 
+
+  /* the registers first: the timed edge is the timestamp and the energy read */
+  rapl_read_socket_regs(rapl_socket, ss->sk[rapl_socket], 0);
+
+  if (rapl_domain_available[RAPL_DOMAIN_PP0]) 
+    {
+      result = rapl_read_reg(rapl_socket, MSR_PP0_POLICY);
+      ss->pp0_policy = (int)result&0x001f;
+    }
+
+  if (rapl_domain_available[RAPL_DOMAIN_PP1]) 
+    {
+      result = rapl_read_reg(rapl_socket, MSR_PP1_POLICY);
+      ss->pp1_policy = (int)result&0x001f;
+    }
+  ss->sk[rapl_socket]->start_ts = rapl_read_now();
+  rapl_read_plan(&rapl_plan_all, rapl_socket, ss->sk[rapl_socket]->before);
+}
+
+
+
+void
+rapl_read_stop()
+{
+   if (!rapl_allowed())
+    {
+      return;
+    }
+
+  rapl_session_t* ss = rapl_session_default;
+  rapl_read_plan(&rapl_plan_all, rapl_socket, ss->sk[rapl_socket]->after);
+  ss->sk[rapl_socket]->stop_ts = rapl_read_now();
+  rapl_read_socket_regs(rapl_socket, ss->sk[rapl_socket], 1);
+}
+
+
+/* the package/pp0/dram reads of socket s, each socket with its own timestamps */
+static inline void
+rapl_start_pack_pp0_socket(rapl_session_t* ss, int s)
+{
+  rapl_read_socket_regs(s, ss->sk[s], 0);
+  ss->sk[s]->start_ts = rapl_read_now();
+  rapl_read_plan(&rapl_plan_pack_pp0, s, ss->sk[s]->before);
+}
+
+static inline void
+rapl_stop_pack_pp0_socket(rapl_session_t* ss, int s)
+{
+  rapl_read_plan(&rapl_plan_pack_pp0, s, ss->sk[s]->after);
+  ss->sk[s]->stop_ts = rapl_read_now();
+  rapl_read_socket_regs(s, ss->sk[s], 1);
+}
+
+void
+rapl_read_start_pack_pp0()
+{
+  if (!rapl_allowed())
+    {
+      return;
+    }
+  rapl_start_pack_pp0_socket(rapl_session_default, rapl_socket);
+}
+
+void
+rapl_read_stop_pack_pp0()
+{
+  if (!rapl_allowed())
+    {
+      return;
+    }
+  rapl_stop_pack_pp0_socket(rapl_session_default, rapl_socket);
+}
+
+void
+rapl_read_start_pack_pp0_unprotected()
+{
+  rapl_start_pack_pp0_socket(rapl_session_default, rapl_socket);
+}
+
+void
+rapl_read_stop_pack_pp0_unprotected()
+{
+  rapl_stop_pack_pp0_socket(rapl_session_default, rapl_socket);
+}
+
+/*********************************************************************************/
+/* parallel per-socket reads: one helper thread per socket, pinned to the socket, 
+   waits for an edge (start/stop), arrives at a spin barrier, and once all helpers
+   have arrived, they all read their socket at the same time. */
+/*********************************************************************************/
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define RAPL_PAUSE() __asm__ __volatile__ ("pause" ::: "memory")
+#else
+#  define RAPL_PAUSE() __asm__ __volatile__ ("" ::: "memory")
+#endif
+
+#define RAPL_PAR_START 1
+#define RAPL_PAR_STOP  2
+#define RAPL_PAR_EXIT  3
+
+static pthread_t* rapl_par_threads = NULL;
+static int rapl_par_num = 0;
+static pthread_mutex_t rapl_par_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rapl_par_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t rapl_par_epoch = 0;
+static int rapl_par_op = 0;
+static rapl_session_t* rapl_par_session = NULL;
+/* one edge at a time, whichever the session */
+static pthread_mutex_t rapl_par_edge_mutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile uint64_t rapl_par_release __attribute__ ((aligned(CACHE_LINE_SIZE))) = 0;
+static volatile uint32_t rapl_par_arrived __attribute__ ((aligned(CACHE_LINE_SIZE))) = 0;
+static volatile uint32_t rapl_par_done __attribute__ ((aligned(CACHE_LINE_SIZE))) = 0;
+
+static void*
+rapl_par_helper(void* arg)
+{
+  const int s = (int) (intptr_t) arg;
+
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  CPU_SET(rapl_sockets[s]->msr_core, &cpuset);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) != 0)
+    {
+      printf("[RAPL] Helper of socket %d could not pin to core %d\n", s, rapl_sockets[s]->msr_core);
+    }
+
+  uint64_t epoch = 0;
+  while (1)
+    {
+      pthread_mutex_lock(&rapl_par_mutex);
+      while (rapl_par_epoch == epoch)
+	{
+	  pthread_cond_wait(&rapl_par_cond, &rapl_par_mutex);
+	}
+      epoch = rapl_par_epoch;
+      int op = rapl_par_op;
+      rapl_session_t* ss = rapl_par_session;
+      pthread_mutex_unlock(&rapl_par_mutex);
+
+      if (op == RAPL_PAR_EXIT)
+	{
+	  break;
+	}
+
+      __sync_fetch_and_add(&rapl_par_arrived, 1);
+      while (rapl_par_release != epoch)
+	{
+	  RAPL_PAUSE();
+	}
+
+      if (op == RAPL_PAR_START)
+	{
+	  rapl_start_pack_pp0_socket(ss, s);
+	}
+      else
+	{
+	  rapl_stop_pack_pp0_socket(ss, s);
+	}
+      __sync_fetch_and_add(&rapl_par_done, 1);
+    }
+
+  return NULL;
+}
+
+/* wake the helpers, release them together once they are all spinning, and wait
+   for their reads (into ss) to complete */
+static void
+rapl_par_edge(rapl_session_t* ss, int op)
+{
+  pthread_mutex_lock(&rapl_par_edge_mutex);
+  pthread_mutex_lock(&rapl_par_mutex);
+  rapl_par_arrived = 0;
+  rapl_par_done = 0;
+  rapl_par_op = op;
+  rapl_par_session = ss;
+  uint64_t epoch = ++rapl_par_epoch;
+  pthread_cond_broadcast(&rapl_par_cond);
+  pthread_mutex_unlock(&rapl_par_mutex);
+
+  if (op == RAPL_PAR_EXIT)
+    {
+      pthread_mutex_unlock(&rapl_par_edge_mutex);
+      return;
+    }
+
+  while (rapl_par_arrived < (uint32_t) rapl_par_num)
+    {
+      RAPL_PAUSE();
+    }
+  __atomic_store_n(&rapl_par_release, epoch, __ATOMIC_RELEASE);
+  while (rapl_par_done < (uint32_t) rapl_par_num)
+    {
+      RAPL_PAUSE();
+    }
+  __sync_synchronize();
+  pthread_mutex_unlock(&rapl_par_edge_mutex);
+}
+
+int
+rapl_read_parallel_init()
+{
+  if (rapl_par_threads != NULL || rapl_num_sockets == 0)
+    {
+      return -1;
+    }
+
+  rapl_par_threads = (pthread_t*) calloc(rapl_num_sockets, sizeof(pthread_t));
+  if (rapl_par_threads == NULL)
+    {
+      return -1;
+    }
+
+  int s;
+  FOR_ALL_SOCKETS(s)
+  {
+    if (!rapl_sockets[s]->initialized)
+      {
+	printf("[RAPL] Parallel reads need all sockets initialized (RR_INIT_ALL)\n");
+	rapl_read_parallel_term();
+	return -1;
+      }
+    if (pthread_create(rapl_par_threads + s, NULL, rapl_par_helper, (void*) (intptr_t) s) != 0)
+      {
+	rapl_read_parallel_term();
+	return -1;
+      }
+    rapl_par_num++;
+  }
+  return rapl_par_num;
+}
+
+void
+rapl_read_parallel_term()
+{
+  if (rapl_par_threads == NULL)
+    {
+      return;
+    }
+
+  rapl_par_edge(NULL, RAPL_PAR_EXIT);
+  int s;
+  for (s = 0; s < rapl_par_num; s++)
+    {
+      pthread_join(rapl_par_threads[s], NULL);
+    }
+  free(rapl_par_threads);
+  rapl_par_threads = NULL;
+  rapl_par_num = 0;
+}
+
+/*********************************************************************************/
+/* sessions: independent package/pp0/dram windows on all the initialized sockets.
+   The sessions share the opened counters; the RR_* macros use the default session. */
+/*********************************************************************************/
+
+/* read domains[0..n) of all the initialized sockets, into out[s * n + i] */
+static void
+rapl_read_initialized_sockets(const int* domains, int n, uint64_t* out)
+{
+  int s0 = 0;
+  while (s0 < rapl_num_sockets)
+    {
+      if (!rapl_sockets[s0]->initialized)
+	{
+	  s0++;
+	  continue;
+	}
+      /* one batch per run of initialized sockets */
+      int s1 = s0 + 1;
+      while (s1 < rapl_num_sockets && rapl_sockets[s1]->initialized)
+	{
+	  s1++;
+	}
+      rapl_read_energy_batch(s0, s1, domains, n, out + s0 * n);
+      s0 = s1;
+    }
+}
+
+rapl_session_t*
+rapl_read_session_create()
+{
+  if (rapl_topology_init() < 0)
+    {
+      return NULL;
+    }
+  return rapl_session_alloc();
+}
+
+void
+rapl_read_session_destroy(rapl_session_t* ss)
+{
+  if (ss != NULL && ss != rapl_session_default)
+    {
+      rapl_session_free(ss);
+    }
+}
+
+rapl_session_t*
+rapl_read_default_session()
+{
+  if (rapl_topology_init() < 0)
+    {
+      return NULL;
+    }
+  return rapl_session_default;
+}
+
+/* the energy (J) of all the cores, with per-core counters, and the time of the read */
+static inline void
+rapl_read_cores(double* energy, rapl_read_ticks* ts)
+{
+  if (rapl_num_cores == 0 || energy == NULL)
+    {
+      return;
+    }
+  uint64_t raw[rapl_num_cores];
+  rapl_read_ticks t0 = rapl_read_now();
+  rapl_backend->read_cores(raw);
+  rapl_read_ticks t1 = rapl_read_now();
+  /* counted on the socket of the calling thread */
+  rapl_socket_state_t* st = rapl_sockets[(rapl_socket >= 0 && rapl_socket < rapl_num_sockets) ? rapl_socket : 0];
+  RAPL_COUNT(st->reads, rapl_num_cores);
+  RAPL_COUNT(st->batches, 1);
+  RAPL_COUNT(st->read_ticks, t1 - t0);
+  *ts = t0 + (t1 - t0) / 2;
+
+  int c;
+  for (c = 0; c < rapl_num_cores; c++)
+    {
+      energy[c] = (double) raw[c] * rapl_core_units;
+    }
+}
+
+/* the raw values of plan p of all the initialized sockets, from result[s * p->n + i], 
+   into the start (or the stop) edges of the session, with the timestamp ts */
+static inline void
+rapl_session_store(rapl_session_t* ss, const rapl_plan_t* p, const uint64_t* result, int stop,
+		   rapl_read_ticks ts)
+{
+  int s, i;
+  FOR_ALL_SOCKETS(s)
+  {
+    if (!rapl_sockets[s]->initialized)
+      {
+	continue;
+      }
+    rapl_session_socket_t* sk = ss->sk[s];
+    uint64_t* raw = sk->before;
+    if (stop)
+      {
+	raw = sk->after;
+	sk->stop_ts = ts;
+      }
+    else
+      {
+	sk->start_ts = ts;
+      }
+    for (i = 0; i < p->n; i++)
+      {
+	raw[p->domains[i]] = result[s * p->n + i];
+      }
+  }
+}
+
+/* the registers of all the initialized sockets, into the start (or the stop) edges
+   of the session */
+static void
+rapl_session_regs(rapl_session_t* ss, int stop)
+{
+  int s;
+  FOR_ALL_SOCKETS(s)
+  {
+    if (rapl_sockets[s]->initialized)
+      {
+	rapl_read_socket_regs(s, ss->sk[s], stop);
+      }
+  }
+}
+
+/* the energy (J) of a core between two values, across (at most) one wrap */
+static inline double
+rapl_core_energy_delta(double before, double after)
+{
+  if (after >= before)
+    {
+      return after - before;
+    }
+  return (double) rapl_core_range * rapl_core_units - before + after;
+}
+
+void
+rapl_read_session_start(rapl_session_t* ss)
+{
+  rapl_read_cores(ss->core_before, &ss->core_start_ts);
+  if (rapl_par_num > 0)
+    {
+      rapl_par_edge(ss, RAPL_PAR_START);
+      return;
+    }
+
+  const rapl_plan_t* p = &rapl_plan_pack_pp0;
+  uint64_t result[rapl_num_sockets * p->n];
+  rapl_session_regs(ss, 0);
+  rapl_read_ticks ts = rapl_read_now();
+  rapl_read_initialized_sockets(p->domains, p->n, result);
+  rapl_session_store(ss, p, result, 0, ts);
+}
+
+void
+rapl_read_session_stop(rapl_session_t* ss)
+{
+  if (rapl_par_num > 0)
+    {
+      rapl_par_edge(ss, RAPL_PAR_STOP);
+      rapl_read_cores(ss->core_after, &ss->core_stop_ts);
+      return;
+    }
+
+  const rapl_plan_t* p = &rapl_plan_pack_pp0;
+  uint64_t result[rapl_num_sockets * p->n];
+  rapl_read_initialized_sockets(p->domains, p->n, result);
+  rapl_read_ticks ts = rapl_read_now();
+  rapl_session_store(ss, p, result, 1, ts);
+  rapl_session_regs(ss, 1);
+  rapl_read_cores(ss->core_after, &ss->core_stop_ts);
+}
+
+void
+rapl_read_start_pack_pp0_unprotected_all()
+{
+  rapl_read_session_start(rapl_session_default);
+}
+
+void
+rapl_read_stop_pack_pp0_unprotected_all()
+{
+  rapl_read_session_stop(rapl_session_default);
+}
+
+void
+rapl_read_print(int detailed)
+{
+  if (!rapl_allowed())
+    {
+      return;
+    }
+  rapl_session_t* ss = rapl_session_default;
+
+  if (!rapl_window_accumulated(ss->sk[rapl_socket]) 
+      && ss->sk[rapl_socket]->after[RAPL_DOMAIN_PKG] < ss->sk[rapl_socket]->before[RAPL_DOMAIN_PKG])
+    {
+      printf("[RAPL] WARNING: the package counter wrapped (corrected once). For windows longer than"
+	     " %.0f J worth of energy, use RR_ACCUMULATE_START()\n", rapl_energy_wrap(RAPL_DOMAIN_PKG));
+    }
+  rapl_accumulate_warn(ss, rapl_socket);
+  rapl_throttled_warn(ss, rapl_socket);
+  rapl_thermal_warn(ss, rapl_socket);
+
+  if (detailed > RAPL_PRINT_NOT)
+    {
+      if (detailed >= RAPL_PRINT_ALL)
+	{
+	  printf("[RAPL] Backend                             : %s\n", rapl_read_backend_name());
+	  printf("[RAPL] Power units                         : %.3f W\n", rapl_power_units);
+	  printf("[RAPL] Energy units                        : %.8f J\n", rapl_energy_units);
+	  printf("[RAPL] Time units                          : %.8f s\n", rapl_time_units);
+	  printf("[RAPL] Time base                           : %s @ %.6f GHz\n", 
+		 rapl_read_clock_name(rapl_clock), rapl_ticks_per_s / 1e9);
+	  printf("[RAPL] PowerPlane0 core %2d policy          : %d\n", rapl_core, ss->pp0_policy);
+	}
+
+      if (detailed >= RAPL_PRINT_ALL && rapl_backend->read_reg != NULL)
+	{
+	  printf("[RAPL] Package thermal spec                : %.3f W\n", rapl_thermal_spec_power);
+	  printf("[RAPL] Package minimum power               : %.3f W\n", rapl_minimum_power);
+	  printf("[RAPL] Package maximum power               : %.3f W\n", rapl_maximum_power);
+	  printf("[RAPL] Package maximum time window         : %.6f s\n", rapl_time_window);
+	  long long int result = rapl_msr_pkg_settings;
+	  printf("[RAPL] Package power limits are            : %s\n",  (result >> 63) ? "locked" : "unlocked");
+	  printf("[RAPL] Package power limit #1              : %.3f W for %.6f s (%s, %s)\n", 
+		 rapl_pkg_power_limit_1, rapl_pkg_time_window_1,
+		 (result & (1LL<<15)) ? "enabled" : "disabled",
+		 (result & (1LL<<16)) ? "clamped" : "not_clamped");
+	  printf("[RAPL] Package power limit #2              : %.3f W for %.6fs (%s, %s)\n", 
+		 rapl_pkg_power_limit_2, rapl_pkg_time_window_2,
+		 (result & (1LL<<47)) ? "enabled" : "disabled",
+		 (result & (1LL<<48)) ? "clamped" : "not_clamped");
+
+	}
+  
+      if (detailed >= RAPL_PRINT_BEF_AFT)
+	{
+	  printf("[RAPL] BEFORE Package energy               : %.6f J\n", rapl_raw_energy(RAPL_DOMAIN_PKG, ss->sk[rapl_socket]->before[RAPL_DOMAIN_PKG]));
+	  printf("[RAPL] BEFORE] PowerPlane0 core %2d energy   : %.6f J\n", rapl_core, rapl_raw_energy(RAPL_DOMAIN_PP0, ss->sk[rapl_socket]->before[RAPL_DOMAIN_PP0]));
+	}
+
+
+      if (detailed >= RAPL_PRINT_BEF_AFT)
+	{
+	  if (rapl_domain_available[RAPL_DOMAIN_PP1])
+	    {
+	      if (ss->sk[rapl_socket]->before[RAPL_DOMAIN_PP1] > 0)
+		{
+		  printf("[RAPL] PowerPlane1 (on-core GPU) before[rapl_socket]: %.6fJ\n", rapl_raw_energy(RAPL_DOMAIN_PP1, ss->sk[rapl_socket]->before[RAPL_DOMAIN_PP1]));
+		  printf("[RAPL] PowerPlane1 (on-core GPU) %d policy: %d\n", rapl_core, ss->pp1_policy);
+		}
+	    }
+	  if (rapl_domain_available[RAPL_DOMAIN_DRAM])
+	    {
+	      printf("[RAPL] DRAM energy before[rapl_socket]: %.6fJ\n", rapl_raw_energy(RAPL_DOMAIN_DRAM, ss->sk[rapl_socket]->before[RAPL_DOMAIN_DRAM]));
+	    }
+	}
+
+      rapl_read_ticks duration = ss->sk[rapl_socket]->stop_ts - ss->sk[rapl_socket]->start_ts;
+      double duration_s = rapl_ticks_to_s(duration);
+      if (detailed >= RAPL_PRINT_ENE)
+	{
+	  printf("[RAPL] Duration                            : %f s\n", duration_s);
+	}
+
+      if (detailed >= RAPL_PRINT_BEF_AFT)
+	{
+	  printf("[RAPL] AFTER Package energy                : %.6f J\n", rapl_raw_energy(RAPL_DOMAIN_PKG, ss->sk[rapl_socket]->after[RAPL_DOMAIN_PKG]));
+	  printf("[RAPL] AFTER PowerPlane0 core %2d energy    : %.6f J\n", rapl_core, rapl_raw_energy(RAPL_DOMAIN_PP0, ss->sk[rapl_socket]->after[RAPL_DOMAIN_PP0]));
+	}
+
+      double rapl_package = rapl_energy_delta(RAPL_DOMAIN_PKG, ss->sk[rapl_socket]->before[RAPL_DOMAIN_PKG], ss->sk[rapl_socket]->after[RAPL_DOMAIN_PKG]);
+      double rapl_pp0 = rapl_energy_delta(RAPL_DOMAIN_PP0, ss->sk[rapl_socket]->before[RAPL_DOMAIN_PP0], ss->sk[rapl_socket]->after[RAPL_DOMAIN_PP0]);
+      double rapl_dram = rapl_energy_delta(RAPL_DOMAIN_DRAM, ss->sk[rapl_socket]->before[RAPL_DOMAIN_DRAM], ss->sk[rapl_socket]->after[RAPL_DOMAIN_DRAM]);
+      double rapl_rest = rapl_package - rapl_pp0;
+      if (detailed >= RAPL_PRINT_ENE)
+	{
+	  printf("[RAPL] CONSUMED Total energy               : %9.6f J\n", rapl_package + rapl_dram);
+	  printf("[RAPL] CONSUMED Package energy             : %9.6f J\n", rapl_package);
+	  printf("[RAPL] CONSUMED PowerPlane0 core %2d energy : %9.6f J\n", rapl_core, rapl_pp0);
+	  if (rapl_domain_available[RAPL_DOMAIN_DRAM])
+	    {
+	      printf("[RAPL] CONSUMED DRAM energy                : %9.6f J\n", rapl_dram);
+	    }
+	  if (rapl_domain_available[RAPL_DOMAIN_PSYS] && rapl_socket == 0)
+	    {
+	      printf("[RAPL] CONSUMED Platform (PSys) energy     : %9.6f J\n", 
+		     rapl_energy_delta(RAPL_DOMAIN_PSYS, ss->sk[0]->before[RAPL_DOMAIN_PSYS], ss->sk[0]->after[RAPL_DOMAIN_PSYS]));
+	    }
+	  printf("[RAPL] CONSUMED Rest energy                : %9.6f J\n", rapl_rest);
+	}
+
+      printf("[RAPL] Total power                         : %9.6f W\n", (rapl_package + rapl_dram) / duration_s);
+      printf("[RAPL] Package power                       : %9.6f W\n", rapl_package / duration_s);
+      printf("[RAPL] PowerPlane0 core %2d power           : %9.6f W\n", rapl_core, rapl_pp0 / duration_s);
+      printf("[RAPL] DRAM power                          : %9.6f W\n", rapl_dram / duration_s);
+      printf("[RAPL] Rest power                          : %9.6f W\n", rapl_rest / duration_s);
+      int t;
+      for (t = 0; t < RAPL_THROTTLE_NUM; t++)
+	{
+	  if (rapl_throttle_available[t])
+	    {
+	      printf("[RAPL] %-11s throttled time          : %9.2f %%\n", 
+		     rapl_throttle_name[t], rapl_throttled_pct(ss, rapl_socket, t));
+	    }
+	}
+
+      if (detailed >= RAPL_PRINT_ENE && rapl_act_available[RAPL_ACT_TSC] && ss->sk[rapl_socket]->act_on)
+	{
+	  double freq, busy;
+	  rapl_activity(ss, rapl_socket, &freq, &busy);
+	  int c;
+	  for (c = 0; c < RAPL_CSTATE_NUM; c++)
+	    {
+	      if (rapl_act_available[RAPL_ACT_CSTATE + c] && !rapl_cstate_is_core(c))
+		{
+		  printf("[RAPL] %-11s residency               : %9.2f %%\n", 
+			 rapl_cstate_name[c], rapl_residency_pct(ss, rapl_socket, c));
+		}
+	    }
+	  printf("[RAPL] Reading cpu                         : %9d\n", rapl_sockets[rapl_socket]->msr_core);
+	  printf("[RAPL] Reading cpu effective frequency     : %9.6f GHz\n", freq);
+	  printf("[RAPL] Reading cpu busy                    : %9.2f %%\n", 100 * busy);
+	  for (c = 0; c < RAPL_CSTATE_NUM; c++)
+	    {
+	      if (rapl_act_available[RAPL_ACT_CSTATE + c] && rapl_cstate_is_core(c))
+		{
+		  printf("[RAPL] Reading cpu %-7s residency       : %9.2f %%\n", 
+			 rapl_cstate_name[c], rapl_residency_pct(ss, rapl_socket, c));
+		}
+	    }
+	}
+
+      const rapl_session_socket_t* sk = ss->sk[rapl_socket];
+      if (detailed >= RAPL_PRINT_ALL && rapl_thermal_available && sk->temp_samples > 0)
+	{
+	  printf("[RAPL] Package temperature peak            : %9.1f C\n", sk->temp_pkg_peak);
+	  printf("[RAPL] Package temperature average         : %9.1f C\n", 
+		 sk->temp_pkg_sum / sk->temp_samples);
+	  printf("[RAPL] Core %2d temperature peak            : %9.1f C\n", rapl_core, sk->temp_core_peak);
+	  printf("[RAPL] Core %2d temperature average         : %9.1f C\n", rapl_core,
+		 sk->temp_core_sum / sk->temp_samples);
+	  printf("[RAPL] Thermal events                      : %#9x\n", rapl_thermal_events(ss, rapl_socket));
+	}
+
+      if (detailed >= RAPL_PRINT_BEF_AFT)
+	{
+	  if (rapl_domain_available[RAPL_DOMAIN_PP1])
+	    {
+	      if (ss->sk[rapl_socket]->after[RAPL_DOMAIN_PP1] > 0)
+		{
+		  printf("[RAPL] PowerPlane1 (on-core GPU) after[rapl_socket]: %.6f  (%.6fJ consumed)\n", 
+			 rapl_raw_energy(RAPL_DOMAIN_PP1, ss->sk[rapl_socket]->after[RAPL_DOMAIN_PP1]), rapl_energy_delta(RAPL_DOMAIN_PP1, ss->sk[rapl_socket]->before[RAPL_DOMAIN_PP1], ss->sk[rapl_socket]->after[RAPL_DOMAIN_PP1]));
+		}
+	    }
+	  if (rapl_domain_available[RAPL_DOMAIN_DRAM])
+	    {
+	      printf("[RAPL] DRAM energy after[rapl_socket]: %.6f  (%.6fJ consumed)\n", rapl_raw_energy(RAPL_DOMAIN_DRAM, ss->sk[rapl_socket]->after[RAPL_DOMAIN_DRAM]), rapl_energy_delta(RAPL_DOMAIN_DRAM, ss->sk[rapl_socket]->before[RAPL_DOMAIN_DRAM], ss->sk[rapl_socket]->after[RAPL_DOMAIN_DRAM]));
+	    }
+	}
+    }
+}
+
+
+#define FOR_ALL_SOCKETS_PRINT(pattern, var, div_sum, fin)	\
+  {								\
+    double ___sum = 0;						\
+    int ___s;							\
+    for (___s = 0; ___s < rapl_num_sockets; ___s++)		\
+      {								\
+	if (rapl_sockets[___s]->initialized)				\
+	  {							\
+	    ___sum += var[___s];				\
+	  }							\
+      }								\
+    printf(pattern, ___sum / div_sum);				\
+    for (___s = 0; ___s < rapl_num_sockets; ___s++)		\
+      {								\
+	if (rapl_sockets[___s]->initialized)				\
+	  {							\
+	    printf(pattern, var[___s]);				\
+	  }							\
+	else							\
+	  {							\
+	    printf(pattern, 0.0);				\
+	  }							\
+      }								\
+    printf(fin);						\
+  }
+
+
+void
+rapl_read_print_all_sockets(int detailed, int protected)
+{
+  rapl_read_print_sockets(RR_NODE_ALL, detailed, protected);
+}
+
+void
+rapl_read_print_sockets(int socket, int detailed, int protected)
+{
+  if (protected && !rapl_allowed_once())
+    {
+      return;
+    }
+  rapl_read_session_print(rapl_session_default, socket, detailed);
+  /* the regions and the threads are global: with the default session only */
+  if (detailed > RAPL_PRINT_NOT)
+    {
+      rapl_read_print_regions();
+      rapl_read_print_threads();
+    }
+}
+
+void
+rapl_read_session_print(rapl_session_t* ss, int socket, int detailed)
+{
+  int s;
+
+  FOR_ALL_SELECTED_SOCKETS(socket, s)
+    {
+      if (!rapl_window_accumulated(ss->sk[s]) && rapl_sockets[s]->initialized 
+	  && ss->sk[s]->after[RAPL_DOMAIN_PKG] < ss->sk[s]->before[RAPL_DOMAIN_PKG])
+	{
+	  printf("[RAPL][%d] WARNING: the package counter wrapped (corrected once). For windows longer than"
+		 " %.0f J worth of energy, use RR_ACCUMULATE_START()\n", s, rapl_energy_wrap(RAPL_DOMAIN_PKG));
+	}
+      if (rapl_sockets[s]->initialized)
+	{
+	  rapl_accumulate_warn(ss, s);
+	  rapl_throttled_warn(ss, s);
+	  rapl_thermal_warn(ss, s);
+	}
+    }
+
+  printf("[RAPL]                                     : ");
+  printf("%-12s", "Total");
+  FOR_ALL_SOCKETS(s)
+  {
+    printf("Socket %-4d ", s);
+  }
+  printf("\n");
+
+  if (detailed > RAPL_PRINT_NOT)
+    {
+      if (detailed >= RAPL_PRINT_ALL)
+	{
+	  printf("[RAPL] Backend                             : %s\n", rapl_read_backend_name());
+	  printf("[RAPL] Power units                         : %.3f W\n", rapl_power_units);
+	  printf("[RAPL] Energy units                        : %.8f J\n", rapl_energy_units);
+	  printf("[RAPL] Time units                          : %.8f s\n", rapl_time_units);
+	  printf("[RAPL] Time base                           : %s @ %.6f GHz\n", 
+		 rapl_read_clock_name(rapl_clock), rapl_ticks_per_s / 1e9);
+	  printf("[RAPL] PowerPlane0 core %2d policy          : %d\n", rapl_core, ss->pp0_policy);
+	}
+
+      if (detailed >= RAPL_PRINT_ALL && rapl_backend->read_reg != NULL)
+	{
+	  printf("[RAPL] Package thermal spec                : %.3f W\n", rapl_thermal_spec_power);
+	  printf("[RAPL] Package minimum power               : %.3f W\n", rapl_minimum_power);
+	  printf("[RAPL] Package maximum power               : %.3f W\n", rapl_maximum_power);
+	  printf("[RAPL] Package maximum time window         : %.6f s\n", rapl_time_window);
+	  long long int result = rapl_msr_pkg_settings;
+	  printf("[RAPL] Package power limits are            : %s\n",  (result >> 63) ? "locked" : "unlocked");
+	  printf("[RAPL] Package power limit #1              : %.3f W for %.6f s (%s, %s)\n", 
+		 rapl_pkg_power_limit_1, rapl_pkg_time_window_1,
+		 (result & (1LL<<15)) ? "enabled" : "disabled",
+		 (result & (1LL<<16)) ? "clamped" : "not_clamped");
+	  printf("[RAPL] Package power limit #2              : %.3f W for %.6fs (%s, %s)\n", 
+		 rapl_pkg_power_limit_2, rapl_pkg_time_window_2,
+		 (result & (1LL<<47)) ? "enabled" : "disabled",
+		 (result & (1LL<<48)) ? "clamped" : "not_clamped");
+
+	}
+  
+      if (detailed >= RAPL_PRINT_BEF_AFT)
+	{
+	  printf("[RAPL] BEFORE Package energy               : %.6f J\n", rapl_raw_energy(RAPL_DOMAIN_PKG, ss->sk[rapl_socket]->before[RAPL_DOMAIN_PKG]));
+	  printf("[RAPL] BEFORE PowerPlane0 core %2d energy   : %.6f J\n", rapl_core, rapl_raw_energy(RAPL_DOMAIN_PP0, ss->sk[rapl_socket]->before[RAPL_DOMAIN_PP0]));
+	}
+
+
+      if (detailed >= RAPL_PRINT_BEF_AFT)
+	{
+	  if (rapl_domain_available[RAPL_DOMAIN_PP1])
+	    {
+	      if (ss->sk[rapl_socket]->before[RAPL_DOMAIN_PP1] > 0)
+		{
+		  printf("[RAPL] PowerPlane1 (on-core GPU) before[rapl_socket]: %.6fJ\n", rapl_raw_energy(RAPL_DOMAIN_PP1, ss->sk[rapl_socket]->before[RAPL_DOMAIN_PP1]));
+		  printf("[RAPL] PowerPlane1 (on-core GPU) %d policy: %d\n", rapl_core, ss->pp1_policy);
+		}
+	    }
+	  if (rapl_domain_available[RAPL_DOMAIN_DRAM])
+	    {
+	      printf("[RAPL] DRAM energy before[rapl_socket]: %.6fJ\n", rapl_raw_energy(RAPL_DOMAIN_DRAM, ss->sk[rapl_socket]->before[RAPL_DOMAIN_DRAM]));
+	    }
+	}
+
+      rapl_read_ticks duration[rapl_num_sockets]; 
+      double duration_s[rapl_num_sockets];
+      FOR_ALL_SOCKETS(s)
+      {
+	duration[s] = ss->sk[s]->stop_ts - ss->sk[s]->start_ts;
+	duration_s[s] = rapl_ticks_to_s(duration[s]);
+      }
+
+      if (detailed >= RAPL_PRINT_POW)
+	{
+	  printf("[RAPL] Duration                            : ");
+	  FOR_ALL_SOCKETS_PRINT("%11.6f ", duration_s, rapl_num_active_sockets, " s\n");
+	}
+
+      if (detailed >= RAPL_PRINT_BEF_AFT)
+	{
+	  printf("[RAPL] AFTER Package energy                : %.6f J\n", rapl_raw_energy(RAPL_DOMAIN_PKG, ss->sk[rapl_socket]->after[RAPL_DOMAIN_PKG]));
+	  printf("[RAPL] AFTER PowerPlane0 core %2d energy    : %.6f J\n", rapl_core, rapl_raw_energy(RAPL_DOMAIN_PP0, ss->sk[rapl_socket]->after[RAPL_DOMAIN_PP0]));
+	}
+
+      double rapl_total[rapl_num_sockets];
+      double rapl_package[rapl_num_sockets];
+      double rapl_pp0[rapl_num_sockets]; 
+      double rapl_dram[rapl_num_sockets]; 
+      double rapl_rest[rapl_num_sockets]; 
+      double rapl_psys[rapl_num_sockets]; 
+
+      FOR_ALL_SELECTED_SOCKETS(socket, s)
+	{
+	  rapl_psys[s] = rapl_energy_delta(RAPL_DOMAIN_PSYS, ss->sk[s]->before[RAPL_DOMAIN_PSYS], ss->sk[s]->after[RAPL_DOMAIN_PSYS]);
+	  rapl_package[s] = rapl_energy_delta(RAPL_DOMAIN_PKG, ss->sk[s]->before[RAPL_DOMAIN_PKG], ss->sk[s]->after[RAPL_DOMAIN_PKG]);
+	  rapl_pp0[s] = rapl_energy_delta(RAPL_DOMAIN_PP0, ss->sk[s]->before[RAPL_DOMAIN_PP0], ss->sk[s]->after[RAPL_DOMAIN_PP0]);
+	  rapl_dram[s] = rapl_energy_delta(RAPL_DOMAIN_DRAM, ss->sk[s]->before[RAPL_DOMAIN_DRAM], ss->sk[s]->after[RAPL_DOMAIN_DRAM]);
+	  rapl_rest[s] = rapl_package[s] - rapl_pp0[s];
+	  rapl_total[s] = rapl_package[s] + rapl_dram[s];
+	}
+      NON_SELECTED_SOCKETS
+	{
+	  rapl_package[s] = 0;
+	  rapl_pp0[s] = 0;
+	  rapl_dram[s] = 0;
+	  rapl_rest[s] = 0;
+	  rapl_total[s] = 0;
+	  rapl_psys[s] = 0;
+	}
+
+      if (detailed >= RAPL_PRINT_ENE)
+	{
+	  printf("[RAPL] CONSUMED Total energy               : ");
+	  FOR_ALL_SOCKETS_PRINT("%11.6f ", rapl_total, 1, " J\n");
+	  printf("[RAPL] CONSUMED Package energy             : ");
+	  FOR_ALL_SOCKETS_PRINT("%11.6f ", rapl_package, 1, " J\n");
+	  printf("[RAPL] CONSUMED PowerPlane0 energy         : ");
+	  FOR_ALL_SOCKETS_PRINT("%11.6f ", rapl_pp0, 1, " J\n");
+	  if (rapl_domain_available[RAPL_DOMAIN_DRAM])
+	    {
+	      printf("[RAPL] CONSUMED DRAM energy                : ");
+	      FOR_ALL_SOCKETS_PRINT("%11.6f ", rapl_dram, 1, " J\n");
+	    }
+	  printf("[RAPL] CONSUMED Rest energy                : " );
+	  FOR_ALL_SOCKETS_PRINT("%11.6f ", rapl_rest, 1, " J\n");
+	  if (rapl_domain_available[RAPL_DOMAIN_PSYS])
+	    {
+	      printf("[RAPL] CONSUMED Platform (PSys) energy     : ");
+	      FOR_ALL_SOCKETS_PRINT("%11.6f ", rapl_psys, 1, " J\n");
+	    }
+	}
+
+      double rapl_total_pow[rapl_num_sockets];
+      double rapl_package_pow[rapl_num_sockets];
+      double rapl_pp0_pow[rapl_num_sockets]; 
+      double rapl_dram_pow[rapl_num_sockets]; 
+      double rapl_rest_pow[rapl_num_sockets]; 
+
+      FOR_ALL_SELECTED_SOCKETS(socket, s)
+	{
+	  rapl_package_pow[s] = rapl_package[s] / duration_s[s];
+	  rapl_pp0_pow[s] = rapl_pp0[s] / duration_s[s];
+	  rapl_dram_pow[s] = rapl_dram[s] / duration_s[s];		
+	  rapl_rest_pow[s] = rapl_rest[s] / duration_s[s];		
+	  rapl_total_pow[s] = rapl_total[s] / duration_s[s];
+	}
+      NON_SELECTED_SOCKETS
+	{
+	  rapl_package_pow[s] = 0;
+	  rapl_pp0_pow[s] = 0;
+	  rapl_dram_pow[s] = 0;
+	  rapl_rest_pow[s] = 0;
+	  rapl_total_pow[s] = 0;
+	}
+
+      printf("[RAPL] CONSUMED Total power                : ");
+      FOR_ALL_SOCKETS_PRINT("%11.6f ", rapl_total_pow, 1, " W\n");
+      printf("[RAPL] CONSUMED Package power              : ");
+      FOR_ALL_SOCKETS_PRINT("%11.6f ", rapl_package_pow, 1, " W\n");
+      printf("[RAPL] CONSUMED PowerPlane0 power          : ");
+      FOR_ALL_SOCKETS_PRINT("%11.6f ", rapl_pp0_pow, 1, " W\n");
+      if (rapl_domain_available[RAPL_DOMAIN_DRAM])
+	{
+	  printf("[RAPL] CONSUMED DRAM power                 : ");
+	  FOR_ALL_SOCKETS_PRINT("%11.6f ", rapl_dram_pow, 1, " W\n");
+	}
+      printf("[RAPL] CONSUMED Rest power                 : " );
+      FOR_ALL_SOCKETS_PRINT("%11.6f ", rapl_rest_pow, 1, " W\n");
+      if (rapl_domain_available[RAPL_DOMAIN_PSYS])
+	{
+	  FOR_ALL_SELECTED_SOCKETS(socket, s)
+	    {
+	      rapl_psys[s] /= duration_s[s];
+	    }
+	  printf("[RAPL] CONSUMED Platform (PSys) power      : ");
+	  FOR_ALL_SOCKETS_PRINT("%11.6f ", rapl_psys, 1, " W\n");
+	}
+
+      int t;
+      for (t = 0; t < RAPL_THROTTLE_NUM; t++)
+	{
+	  if (rapl_throttle_available[t])
+	    {
+	      double rapl_throttled[rapl_num_sockets];
+	      FOR_ALL_SOCKETS(s)
+	      {
+		rapl_throttled[s] = (socket == RR_NODE_ALL || socket == s) ? rapl_throttled_pct(ss, s, t) : 0;
+	      }
+	      printf("[RAPL] THROTTLED %-11s time          : ", rapl_throttle_name[t]);
+	      FOR_ALL_SOCKETS_PRINT("%11.2f ", rapl_throttled, rapl_num_active_sockets, " %%\n");
+	    }
+	}
+
+      if (detailed >= RAPL_PRINT_ENE && rapl_act_available[RAPL_ACT_TSC] 
+	  && rapl_session_edge_regs(ss, RAPL_EDGE_ACTIVITY))
+	{
+	  int c;
+	  for (c = 0; c < RAPL_CSTATE_NUM; c++)
+	    {
+	      if (rapl_act_available[RAPL_ACT_CSTATE + c] && !rapl_cstate_is_core(c))
+		{
+		  double rapl_residency[rapl_num_sockets];
+		  FOR_ALL_SOCKETS(s)
+		  {
+		    rapl_residency[s] = (socket == RR_NODE_ALL || socket == s) ? rapl_residency_pct(ss, s, c) : 0;
+		  }
+		  printf("[RAPL] RESIDENCY %-11s               : ", rapl_cstate_name[c]);
+		  FOR_ALL_SOCKETS_PRINT("%11.2f ", rapl_residency, rapl_num_active_sockets, " %%\n");
+		}
+	    }
+
+	  /* of the cpu that reads each socket, not of the socket */
+	  double rapl_freq[rapl_num_sockets];
+	  double rapl_busy[rapl_num_sockets];
+	  FOR_ALL_SOCKETS(s)
+	  {
+	    rapl_freq[s] = rapl_busy[s] = 0;
+	  }
+	  FOR_ALL_SELECTED_SOCKETS(socket, s)
+	    {
+	      rapl_activity(ss, s, rapl_freq + s, rapl_busy + s);
+	      rapl_busy[s] *= 100;
+	    }
+	  printf("[RAPL] READER cpu                          :             ");
+	  FOR_ALL_SOCKETS(s)
+	  {
+	    printf("%11d ", rapl_sockets[s]->msr_core);
+	  }
+	  printf("\n");
+	  printf("[RAPL] READER Effective frequency          : ");
+	  FOR_ALL_SOCKETS_PRINT("%11.6f ", rapl_freq, rapl_num_active_sockets, " GHz\n");
+	  printf("[RAPL] READER Busy                         : ");
+	  FOR_ALL_SOCKETS_PRINT("%11.2f ", rapl_busy, rapl_num_active_sockets, " %%\n");
+	  for (c = 0; c < RAPL_CSTATE_NUM; c++)
+	    {
+	      if (rapl_act_available[RAPL_ACT_CSTATE + c] && rapl_cstate_is_core(c))
+		{
+		  double rapl_residency[rapl_num_sockets];
+		  FOR_ALL_SOCKETS(s)
+		  {
+		    rapl_residency[s] = (socket == RR_NODE_ALL || socket == s) ? rapl_residency_pct(ss, s, c) : 0;
+		  }
+		  printf("[RAPL] READER %-7s residency            : ", rapl_cstate_name[c]);
+		  FOR_ALL_SOCKETS_PRINT("%11.2f ", rapl_residency, rapl_num_active_sockets, " %%\n");
+		}
+	    }
+	}
+
+      if (detailed >= RAPL_PRINT_ALL && rapl_thermal_available && rapl_session_edge_regs(ss, RAPL_EDGE_THERMAL))
+	{
+	  rapl_session_stats_t st;
+	  memset(&st, 0, sizeof(st));
+	  rapl_read_session_stats(ss, &st);
+	  double* rows[4] = 
+	    {
+	      st.temp_package_peak, st.temp_package_avg, st.temp_core_peak, st.temp_core_avg
+	    };
+	  static const char* names[4] = 
+	    {
+	      "Package peak   ", "Package average", "Core peak      ", "Core average   "
+	    };
+	  int r;
+	  for (r = 0; r < 4 && st.duration != NULL; r++)
+	    {
+	      printf("[RAPL] TEMPERATURE %s         : %11.1f ", names[r], rows[r][rapl_num_sockets]);
+	      FOR_ALL_SOCKETS(s)
+	      {
+		printf("%11.1f ", (socket == RR_NODE_ALL || socket == s) ? rows[r][s] : 0.0);
+	      }
+	      printf(" C\n");
+	    }
+	  if (st.duration != NULL)
+	    {
+	      printf("[RAPL] THERMAL events                      : %#11x ", st.thermal[rapl_num_sockets]);
+	      FOR_ALL_SOCKETS(s)
+	      {
+		printf("%#11x ", (socket == RR_NODE_ALL || socket == s) ? st.thermal[s] : 0);
+	      }
+	      printf("\n");
+	    }
+	  rapl_read_session_stats_free(&st);
+	}
+
+
+      if (detailed >= RAPL_PRINT_BEF_AFT)
+	{
+	  if (rapl_domain_available[RAPL_DOMAIN_PP1])
+	    {
+	      if (ss->sk[rapl_socket]->after[RAPL_DOMAIN_PP1] > 0)
+		{
+		  printf("[RAPL] PowerPlane1 (on-core GPU) after[rapl_socket]: %.6f  (%.6fJ consumed)\n", 
+			 rapl_raw_energy(RAPL_DOMAIN_PP1, ss->sk[rapl_socket]->after[RAPL_DOMAIN_PP1]), rapl_energy_delta(RAPL_DOMAIN_PP1, ss->sk[rapl_socket]->before[RAPL_DOMAIN_PP1], ss->sk[rapl_socket]->after[RAPL_DOMAIN_PP1]));
+		}
+	    }
+	  if (rapl_domain_available[RAPL_DOMAIN_DRAM])
+	    {
+	      printf("[RAPL] DRAM energy after[rapl_socket]: %.6f  (%.6fJ consumed)\n", rapl_raw_energy(RAPL_DOMAIN_DRAM, ss->sk[rapl_socket]->after[RAPL_DOMAIN_DRAM]), rapl_energy_delta(RAPL_DOMAIN_DRAM, ss->sk[rapl_socket]->before[RAPL_DOMAIN_DRAM], ss->sk[rapl_socket]->after[RAPL_DOMAIN_DRAM]));
+	    }
+	}
+
+      if (detailed >= RAPL_PRINT_ENE && ss->core_before != NULL)
+	{
+	  const double d = rapl_ticks_to_s(ss->core_stop_ts - ss->core_start_ts);
+	  int c;
+	  for (c = 0; c < rapl_num_cores; c++)
+	    {
+	      const int sk = rapl_cpu_socket[rapl_core_cpu[c]];
+	      if (socket != RR_NODE_ALL && socket != sk)
+		{
+		  continue;
+		}
+	      const double e = rapl_core_energy_delta(ss->core_before[c], ss->core_after[c]);
+	      printf("[RAPL] CONSUMED Core %3d (cpu %3d, socket %d) : %11.6f J %11.6f W\n", c, 
+		     rapl_core_cpu[c], sk, e, (d > 0) ? e / d : 0);
+	    }
+	}
+    }
+}
+
+void
+rapl_read_term()
+{
+  if (!rapl_allowed())
+    {
+      return;
+    }
+
+  rapl_read_export_stop();
+  rapl_read_tune_stop();
+  rapl_read_restore_power_limits();
+  rapl_read_sampler_free();
+  rapl_read_trace_close();
+  rapl_read_accumulate_stop();
+  rapl_read_parallel_term();
+  rapl_backend->close(rapl_socket);
+}
+
+
+#define FOR_ALL_SOCKETS_SUM(p_in, p_out)		\
+  {							\
+    double ___sum = 0;					\
+    int ___s;						\
+    for (___s = 0; ___s < rapl_num_sockets; ___s++)	\
+      {							\
+	___sum += p_in[___s];				\
+	p_out[___s] = p_in[___s];			\
+      }							\
+    p_out[___s] = ___sum;				\
+  }						
+
+#define FOR_ALL_SOCKETS_PLUS1(s)		\
+    for (s = 0; s < rapl_num_sockets + 1; s++)
+
+/* the per-core arrays of s, once the backend is known to have per-core counters */
+static int
+rapl_stats_cores_init(rapl_session_stats_t* s)
+{
+  if (rapl_num_cores == 0 || s->energy_core != NULL)
+    {
+      return 0;
+    }
+  s->energy_core = (double*) calloc(2 * rapl_num_cores, sizeof(double));
+  if (s->energy_core == NULL)
+    {
+      return -1;
+    }
+  s->power_core = s->energy_core + rapl_num_cores;
+  s->num_cores = rapl_num_cores;
+  s->core_cpu = rapl_core_cpu;
+  return 0;
+}
+
+int
+rapl_read_session_stats_init(rapl_session_stats_t* s)
+{
+  if (rapl_topology_init() < 0)
+    {
+      return -1;
+    }
+
+  double** arrays[] =
+    {
+      &s->duration, &s->energy_package, &s->energy_pp0, &s->energy_pp1, &s->energy_rest,
+      &s->energy_dram, &s->energy_psys, &s->energy_total, &s->power_package, &s->power_pp0, 
+      &s->power_pp1, &s->power_rest, &s->power_dram, &s->power_psys, &s->power_total,
+      &s->throttled_package, &s->throttled_pp0, &s->throttled_dram, 
+      &s->residency[0], &s->residency[1], &s->residency[2], &s->residency[3], 
+      &s->residency[4], &s->residency[5], &s->residency[6], &s->reader_frequency, 
+      &s->reader_busy, &s->reader_residency[0], &s->reader_residency[1], 
+      &s->reader_residency[2], &s->reader_residency[3], &s->reader_residency[4], 
+      &s->reader_residency[5], &s->reader_residency[6],
+      &s->temp_package_peak, &s->temp_package_avg, &s->temp_core_peak, &s->temp_core_avg
+    };
+  const size_t num_arrays = sizeof(arrays) / sizeof(arrays[0]);
+  const size_t n = rapl_num_sockets + 1;
+
+  /* one allocation for all the arrays; duration points to its beginning */
+  double* mem = (double*) calloc(num_arrays * n, sizeof(double));
+  if (mem == NULL)
+    {
+      return -1;
+    }
+
+  size_t a;
+  for (a = 0; a < num_arrays; a++)
+    {
+      *arrays[a] = mem + a * n;
+    }
+  /* and one for the integer arrays; thermal points to its beginning */
+  s->thermal = (uint32_t*) calloc(2 * n, sizeof(uint32_t));
+  if (s->thermal == NULL)
+    {
+      free(mem);
+      s->duration = NULL;
+      return -1;
+    }
+  s->reader_cpu = (int*) (s->thermal + n);
+  s->num_sockets = rapl_num_sockets;
+  s->clock = rapl_clock;
+  s->clock_hz = rapl_ticks_per_s;
+  s->energy_core = NULL;
+  return rapl_stats_cores_init(s);
+}
+
+void
+rapl_read_session_stats_free(rapl_session_stats_t* s)
+{
+  free(s->duration);
+  free(s->thermal);
+  free(s->energy_core);
+  memset(s, 0, sizeof(rapl_session_stats_t));
+}
+
+/* the statistics of the default session, in the fixed arrays of rapl_stats_t: the 
+   first NUMBER_OF_SOCKETS sockets, and the total of all of them at NUMBER_OF_SOCKETS */
+void
+rapl_read_stats(rapl_stats_t* s)
+{
+  rapl_session_stats_t st;
+  memset(&st, 0, sizeof(st));
+  memset(s, 0, sizeof(*s));
+  rapl_read_session_stats(rapl_session_default, &st);
+  if (st.duration == NULL)
+    {
+      return;
+    }
+
+  const double* in[] =
+    {
+      st.duration, st.energy_package, st.energy_pp0, st.energy_pp1, st.energy_rest, st.energy_dram,
+      st.energy_total, st.power_package, st.power_pp0, st.power_pp1, st.power_rest, st.power_dram,
+      st.power_total
+    };
+  double* out[] =
+    {
+      s->duration, s->energy_package, s->energy_pp0, s->energy_pp1, s->energy_rest, s->energy_dram,
+      s->energy_total, s->power_package, s->power_pp0, s->power_pp1, s->power_rest, s->power_dram,
+      s->power_total
+    };
+  size_t a;
+  int i;
+  for (a = 0; a < sizeof(in) / sizeof(in[0]); a++)
+    {
+      for (i = 0; i < rapl_num_sockets && i < NUMBER_OF_SOCKETS; i++)
+	{
+	  out[a][i] = in[a][i];
+	}
+      out[a][NUMBER_OF_SOCKETS] = in[a][RAPL_STATS_TOTAL(&st)];
+    }
+  rapl_read_session_stats_free(&st);
+}
+
+void
+rapl_read_session_stats(rapl_session_t* ss, rapl_session_stats_t* s)
+{
+  if (s->duration == NULL && rapl_read_session_stats_init(s) < 0)
+    {
+      return;
+    }
+
+  s->clock = rapl_clock;
+  s->clock_hz = rapl_ticks_per_s;
+
+  rapl_read_ticks duration[rapl_num_sockets];
+  double duration_s[rapl_num_sockets];
+  double rapl_package[rapl_num_sockets];
+  double rapl_pp0[rapl_num_sockets];
+  double rapl_rest[rapl_num_sockets];
+  double rapl_dram[rapl_num_sockets];
+  double rapl_psys[rapl_num_sockets];
+  double rapl_throttled[RAPL_THROTTLE_NUM][rapl_num_sockets];
+  double rapl_freq[rapl_num_sockets];
+  double rapl_busy[rapl_num_sockets];
+  double rapl_residency[RAPL_CSTATE_NUM][rapl_num_sockets];
+  double rapl_reader_residency[RAPL_CSTATE_NUM][rapl_num_sockets];
+
+  int i, t;
+  FOR_ALL_SOCKETS(i)
+  {
+    for (t = 0; t < RAPL_THROTTLE_NUM; t++)
+      {
+	rapl_throttled[t][i] = rapl_throttled_pct(ss, i, t);
+      }
+    rapl_activity(ss, i, rapl_freq + i, rapl_busy + i);
+    s->reader_cpu[i] = rapl_sockets[i]->msr_core;
+    for (t = 0; t < RAPL_CSTATE_NUM; t++)
+      {
+	const double pct = rapl_residency_pct(ss, i, t);
+	rapl_residency[t][i] = rapl_cstate_is_core(t) ? 0 : pct;
+	rapl_reader_residency[t][i] = rapl_cstate_is_core(t) ? pct : 0;
+      }
+    duration[i] = ss->sk[i]->stop_ts - ss->sk[i]->start_ts;
+    duration_s[i] = rapl_ticks_to_s(duration[i]);
+    rapl_package[i] = rapl_energy_delta(RAPL_DOMAIN_PKG, ss->sk[i]->before[RAPL_DOMAIN_PKG], ss->sk[i]->after[RAPL_DOMAIN_PKG]);
+    rapl_pp0[i] = rapl_energy_delta(RAPL_DOMAIN_PP0, ss->sk[i]->before[RAPL_DOMAIN_PP0], ss->sk[i]->after[RAPL_DOMAIN_PP0]);
+    rapl_rest[i] = rapl_package[i] - rapl_pp0[i];
+    if (rapl_domain_available[RAPL_DOMAIN_DRAM])
+      {
+	rapl_dram[i] = rapl_energy_delta(RAPL_DOMAIN_DRAM, ss->sk[i]->before[RAPL_DOMAIN_DRAM], ss->sk[i]->after[RAPL_DOMAIN_DRAM]);
+      }
+    else
+      {
+	rapl_dram[i] = 0;
+      }
+    if (rapl_domain_available[RAPL_DOMAIN_PSYS])
+      {
+	rapl_psys[i] = rapl_energy_delta(RAPL_DOMAIN_PSYS, ss->sk[i]->before[RAPL_DOMAIN_PSYS], ss->sk[i]->after[RAPL_DOMAIN_PSYS]);
+      }
+    else
+      {
+	rapl_psys[i] = 0;
+      }
+  }
+  
+  FOR_ALL_SOCKETS_SUM(duration_s, s->duration);
+  s->duration[rapl_num_sockets] /= rapl_num_active_sockets;
+  FOR_ALL_SOCKETS_SUM(rapl_package, s->energy_package);
+  FOR_ALL_SOCKETS_SUM(rapl_pp0, s->energy_pp0);
+  FOR_ALL_SOCKETS_SUM(rapl_rest, s->energy_rest);
+  FOR_ALL_SOCKETS_SUM(rapl_dram, s->energy_dram);
+  FOR_ALL_SOCKETS_SUM(rapl_psys, s->energy_psys);
+  FOR_ALL_SOCKETS_SUM(rapl_throttled[RAPL_THROTTLE_PKG], s->throttled_package);
+  FOR_ALL_SOCKETS_SUM(rapl_throttled[RAPL_THROTTLE_PP0], s->throttled_pp0);
+  FOR_ALL_SOCKETS_SUM(rapl_throttled[RAPL_THROTTLE_DRAM], s->throttled_dram);
+  s->throttled_package[rapl_num_sockets] /= rapl_num_active_sockets;
+  s->throttled_pp0[rapl_num_sockets] /= rapl_num_active_sockets;
+  s->throttled_dram[rapl_num_sockets] /= rapl_num_active_sockets;
+  FOR_ALL_SOCKETS_SUM(rapl_freq, s->reader_frequency);
+  FOR_ALL_SOCKETS_SUM(rapl_busy, s->reader_busy);
+  s->reader_frequency[rapl_num_sockets] /= rapl_num_active_sockets;
+  s->reader_busy[rapl_num_sockets] /= rapl_num_active_sockets;
+  s->reader_cpu[rapl_num_sockets] = -1;
+  for (t = 0; t < RAPL_CSTATE_NUM; t++)
+    {
+      FOR_ALL_SOCKETS_SUM(rapl_residency[t], s->residency[t]);
+      s->residency[t][rapl_num_sockets] /= rapl_num_active_sockets;
+      FOR_ALL_SOCKETS_SUM(rapl_reader_residency[t], s->reader_residency[t]);
+      s->reader_residency[t][rapl_num_sockets] /= rapl_num_active_sockets;
+    }
+  const int n = rapl_num_sockets;
+  s->temp_package_peak[n] = s->temp_core_peak[n] = 0;
+  s->temp_package_avg[n] = s->temp_core_avg[n] = 0;
+  s->thermal[n] = 0;
+  FOR_ALL_SOCKETS(i)
+  {
+    const rapl_session_socket_t* sk = ss->sk[i];
+    if (!rapl_thermal_available || sk->temp_samples == 0)
+      {
+	s->temp_package_peak[i] = s->temp_core_peak[i] = 0;
+	s->temp_package_avg[i] = s->temp_core_avg[i] = 0;
+	s->thermal[i] = 0;
+	continue;
+      }
+    s->temp_package_peak[i] = sk->temp_pkg_peak;
+    s->temp_core_peak[i] = sk->temp_core_peak;
+    s->temp_package_avg[i] = sk->temp_pkg_sum / sk->temp_samples;
+    s->temp_core_avg[i] = sk->temp_core_sum / sk->temp_samples;
+    s->thermal[i] = rapl_thermal_events(ss, i);
+    s->temp_package_peak[n] = fmax(s->temp_package_peak[n], s->temp_package_peak[i]);
+    s->temp_core_peak[n] = fmax(s->temp_core_peak[n], s->temp_core_peak[i]);
+    s->temp_package_avg[n] += s->temp_package_avg[i] / rapl_num_active_sockets;
+    s->temp_core_avg[n] += s->temp_core_avg[i] / rapl_num_active_sockets;
+    s->thermal[n] |= s->thermal[i];
+  }
+
+  FOR_ALL_SOCKETS_PLUS1(i)
+  {
+    s->energy_total[i] = s->energy_package[i] + s->energy_dram[i];
+  }
+
+  FOR_ALL_SOCKETS_PLUS1(i)
+  {
+    if (s->duration[i] > 0)
+      {
+	s->power_package[i] = s->energy_package[i] / s->duration[i];
+	s->power_pp0[i] = s->energy_pp0[i] / s->duration[i];
+	s->power_rest[i] = s->energy_rest[i] / s->duration[i];
+	s->power_dram[i] = s->energy_dram[i] / s->duration[i];
+	s->power_psys[i] = s->energy_psys[i] / s->duration[i];
+	s->power_total[i] = s->energy_total[i] / s->duration[i];
+      }
+  }
+
+  if (ss->core_before != NULL && rapl_stats_cores_init(s) == 0)
+    {
+      const double d = rapl_ticks_to_s(ss->core_stop_ts - ss->core_start_ts);
+      int c;
+      for (c = 0; c < rapl_num_cores; c++)
+	{
+	  s->energy_core[c] = rapl_core_energy_delta(ss->core_before[c], ss->core_after[c]);
+	  s->power_core[c] = (d > 0) ? s->energy_core[c] / d : 0;
+	}
+    }
+}
+
+
+/*********************************************************************************/
+/* binary trace: records are reserved with an atomic increment and published by 
+   writing their type last, so that the writers never format or lock */
+/*********************************************************************************/
+
+typedef char rapl_trace_header_size_check[(sizeof(rapl_trace_header_t) == 256) ? 1 : -1];
+
+static rapl_trace_header_t* volatile rapl_trace = NULL;
+static rapl_trace_record_t* rapl_trace_records;
+static size_t rapl_trace_size;
+static int rapl_trace_fd = -1;
+static volatile uint64_t rapl_trace_next = 0;
+static volatile uint64_t rapl_trace_lost = 0;
+static volatile uint32_t rapl_trace_writers = 0;
+
+static void rapl_region_trace_names();
+
+/* a free record, or NULL if the trace is closed or full. rapl_trace_commit() must
+   follow a non-NULL reservation. */
+static inline rapl_trace_record_t*
+rapl_trace_reserve()
+{
+  if (rapl_trace == NULL)
+    {
+      return NULL;
+    }
+  __sync_fetch_and_add(&rapl_trace_writers, 1);
+  rapl_trace_header_t* t = rapl_trace;
+  if (t != NULL)
+    {
+      uint64_t i = __sync_fetch_and_add(&rapl_trace_next, 1);
+      if (i < t->capacity)
+	{
+	  return rapl_trace_records + i;
+	}
+      __sync_fetch_and_add(&rapl_trace_lost, 1);
+    }
+  __sync_fetch_and_sub(&rapl_trace_writers, 1);
+  return NULL;
+}
+
+static inline void
+rapl_trace_commit(rapl_trace_record_t* r, uint8_t type)
+{
+  __atomic_store_n(&r->type, type, __ATOMIC_RELEASE);
+  __sync_fetch_and_sub(&rapl_trace_writers, 1);
+}
+
+/* a record of socket s, with the values of domains[0..n) */
+static inline void
+rapl_trace_energy(uint8_t type, uint32_t id, int s, rapl_read_ticks ts, const int* domains, int n, 
+		  const uint64_t* raw, uint8_t flags)
+{
+  rapl_trace_record_t* r = rapl_trace_reserve();
+  if (r == NULL)
+    {
+      return;
+    }
+  r->flags = flags;
+  r->socket = s;
+  r->id = id;
+  r->ts = ts;
+  int i;
+  for (i = 0; i < n; i++)
+    {
+      r->energy[domains[i]] = raw[i];
+    }
+  rapl_trace_commit(r, type);
+}
+
+/* the values of domains[0..n) of all the initialized sockets, in out[s * n + i] */
+static inline void
+rapl_trace_sockets(uint8_t type, uint32_t id, rapl_read_ticks ts, const int* domains, int n, 
+		   const uint64_t* out)
+{
+  if (rapl_trace == NULL)
+    {
+      return;
+    }
+  const uint8_t flags = rapl_accumulating ? RAPL_TRACE_F_ACC : 0;
+  int s;
+  FOR_ALL_SOCKETS(s)
+  {
+    if (rapl_sockets[s]->initialized)
+      {
+	rapl_trace_energy(type, id, s, ts, domains, n, out + s * n, flags);
+      }
+  }
+}
+
+static void
+rapl_trace_name(uint32_t id, const char* name)
+{
+  rapl_trace_record_t* r = rapl_trace_reserve();
+  if (r == NULL)
+    {
+      return;
+    }
+  r->id = id;
+  r->ts = rapl_read_now();
+  strncpy(r->name, name, sizeof(r->name) - 1);
+  rapl_trace_commit(r, RAPL_TRACE_REGION_NAME);
+}
+
+int
+rapl_read_trace_open(const char* path, uint64_t max_records)
+{
+  if (rapl_trace != NULL || max_records == 0 || rapl_topology_init() < 0 || !rapl_backend_ok)
+    {
+      return -1;
+    }
+
+  size_t size = sizeof(rapl_trace_header_t) + max_records * sizeof(rapl_trace_record_t);
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    {
+      printf("[RAPL] Cannot create the trace %s\n", path);
+      return -1;
+    }
+  if (ftruncate(fd, size) < 0)
+    {
+      close(fd);
+      return -1;
+    }
+  void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mem == MAP_FAILED)
+    {
+      close(fd);
+      return -1;
+    }
+
+  /* the file is zero-filled */
+  rapl_trace_header_t* t = (rapl_trace_header_t*) mem;
+  memcpy(t->magic, RAPL_TRACE_MAGIC, sizeof(RAPL_TRACE_MAGIC));
+  t->version = RAPL_TRACE_VERSION;
+  t->header_size = sizeof(rapl_trace_header_t);
+  t->record_size = sizeof(rapl_trace_record_t);
+  t->num_sockets = rapl_num_sockets;
+  t->clock = rapl_clock;
+  t->clock_hz = rapl_ticks_per_s;
+  int d;
+  for (d = 0; d < RAPL_DOMAIN_NUM; d++)
+    {
+      t->domains |= rapl_domain_available[d] << d;
+      t->units[d] = rapl_domain_units[d];
+      t->range[d] = rapl_domain_range[d];
+    }
+  t->capacity = max_records;
+  t->start_ts = rapl_read_now();
+  strncpy(t->backend, rapl_read_backend_name(), sizeof(t->backend) - 1);
+
+  rapl_trace_records = (rapl_trace_record_t*) (t + 1);
+  rapl_trace_size = size;
+  rapl_trace_fd = fd;
+  rapl_trace_next = 0;
+  rapl_trace_lost = 0;
+  __atomic_store_n(&rapl_trace, t, __ATOMIC_RELEASE);
+
+  rapl_region_trace_names();
+  return 0;
+}
+
+void
+rapl_read_trace_sample()
+{
+  if (rapl_trace == NULL)
+    {
+      return;
+    }
+  int domains[RAPL_DOMAIN_NUM];
+  int n = rapl_domains_available(domains);
+  uint64_t raw[rapl_num_sockets * n];
+  rapl_read_initialized_sockets(domains, n, raw);
+  rapl_trace_sockets(RAPL_TRACE_SAMPLE, 0, rapl_read_now(), domains, n, raw);
+}
+
+void
+rapl_read_trace_close()
+{
+  rapl_trace_header_t* t = rapl_trace;
+  if (t == NULL || !__sync_bool_compare_and_swap(&rapl_trace, t, NULL))
+    {
+      return;
+    }
+  /* wait for the writers that got a record before the trace was closed */
+  while (rapl_trace_writers > 0)
+    {
+      RAPL_PAUSE();
+    }
+
+  uint64_t count = (rapl_trace_next < t->capacity) ? rapl_trace_next : t->capacity;
+  t->count = count;
+  t->dropped = rapl_trace_lost;
+  msync(t, rapl_trace_size, MS_SYNC);
+  munmap(t, rapl_trace_size);
+  if (ftruncate(rapl_trace_fd, sizeof(rapl_trace_header_t) + count * sizeof(rapl_trace_record_t)) < 0)
+    {
+      printf("[RAPL] Cannot truncate the trace\n");
+    }
+  close(rapl_trace_fd);
+  rapl_trace_fd = -1;
+}
+
+uint64_t
+rapl_read_trace_dropped()
+{
+  return rapl_trace_lost;
+}
+
+
+/*********************************************************************************/
+/* regions: named, nestable windows, measured on all the initialized sockets and 
+   aggregated per region. Nested regions are inclusive: their energy also counts in
+   the enclosing regions. */
+/*********************************************************************************/
+
+#define RAPL_REGIONS_MAX      64
+#define RAPL_REGION_DEPTH     16
+#define RAPL_REGION_NAME_LEN  48
+
+typedef struct rapl_region
+{
+  volatile uint32_t lock;
+  char name[RAPL_REGION_NAME_LEN];
+  uint64_t calls;
+  double duration;
+  double energy[RAPL_DOMAIN_NUM];
+  double power_min, power_max;
+} __attribute__ ((aligned(CACHE_LINE_SIZE))) rapl_region_t;
+
+typedef struct rapl_region_frame
+{
+  int id;
+  rapl_read_ticks ts;
+  uint64_t* raw;		/* socket * (number of domains) + i */
+} rapl_region_frame_t;
+
+static rapl_region_t rapl_regions[RAPL_REGIONS_MAX];
+static volatile int rapl_num_regions = 0;
+static pthread_mutex_t rapl_regions_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t rapl_region_key;
+static pthread_once_t rapl_region_key_once = PTHREAD_ONCE_INIT;
+static __thread rapl_region_frame_t* rapl_region_stack = NULL;
+static __thread int rapl_region_depth = 0;
+
+static void
+rapl_region_key_create()
+{
+  pthread_key_create(&rapl_region_key, free);
+}
+
+/* the next frame of the region stack of the calling thread, created on first use */
+static rapl_region_frame_t*
+rapl_region_push(int id)
+{
+  if (rapl_region_stack == NULL)
+    {
+      /* the frames, followed by their raw values */
+      const size_t raw = rapl_num_sockets * RAPL_DOMAIN_NUM * sizeof(uint64_t);
+      char* mem = (char*) malloc(RAPL_REGION_DEPTH * (sizeof(rapl_region_frame_t) + raw));
+      if (mem == NULL)
+	{
+	  return NULL;
+	}
+      rapl_region_stack = (rapl_region_frame_t*) mem;
+      int i;
+      for (i = 0; i < RAPL_REGION_DEPTH; i++)
+	{
+	  rapl_region_stack[i].raw = (uint64_t*) (mem + RAPL_REGION_DEPTH * sizeof(rapl_region_frame_t) + i * raw);
+	}
+      pthread_once(&rapl_region_key_once, rapl_region_key_create);
+      pthread_setspecific(rapl_region_key, mem);
+    }
+
+  if (rapl_region_depth == RAPL_REGION_DEPTH)
+    {
+      printf("[RAPL] Regions nested deeper than %d, ignoring %s\n", RAPL_REGION_DEPTH, rapl_regions[id].name);
+      return NULL;
+    }
+  rapl_region_frame_t* f = rapl_region_stack + rapl_region_depth++;
+  f->id = id;
+  return f;
+}
+
+int
+rapl_read_region_id(const char* name)
+{
+  int id;
+  pthread_mutex_lock(&rapl_regions_mutex);
+  for (id = 0; id < rapl_num_regions && strcmp(rapl_regions[id].name, name); id++)
+    ;
+  if (id == rapl_num_regions)
+    {
+      if (id == RAPL_REGIONS_MAX)
+	{
+	  pthread_mutex_unlock(&rapl_regions_mutex);
+	  printf("[RAPL] Too many regions, ignoring %s\n", name);
+	  return -1;
+	}
+      rapl_region_t* r = rapl_regions + id;
+      memset(r, 0, sizeof(rapl_region_t));
+      strncpy(r->name, name, RAPL_REGION_NAME_LEN - 1);
+      r->power_min = HUGE_VAL;
+      __sync_synchronize();
+      rapl_num_regions++;
+      rapl_trace_name(id, r->name);
+    }
+  pthread_mutex_unlock(&rapl_regions_mutex);
+  return id;
+}
+
+/* the names of the regions registered before the trace was opened */
+static void
+rapl_region_trace_names()
+{
+  int id;
+  pthread_mutex_lock(&rapl_regions_mutex);
+  for (id = 0; id < rapl_num_regions; id++)
+    {
+      rapl_trace_name(id, rapl_regions[id].name);
+    }
+  pthread_mutex_unlock(&rapl_regions_mutex);
+}
+
+void
+rapl_read_region_begin(int id)
+{
+  if (id < 0 || id >= rapl_num_regions || !rapl_backend_ok)
+    {
+      return;
+    }
+  rapl_region_frame_t* f = rapl_region_push(id);
+  if (f == NULL)
+    {
+      return;
+    }
+
+  int domains[RAPL_DOMAIN_NUM];
+  int n = rapl_domains_available(domains);
+  f->ts = rapl_read_now();
+  rapl_read_initialized_sockets(domains, n, f->raw);
+  rapl_trace_sockets(RAPL_TRACE_REGION_BEGIN, id, f->ts, domains, n, f->raw);
+}
+
+void
+rapl_read_region_end(int id)
+{
+  if (id < 0 || id >= rapl_num_regions || !rapl_backend_ok)
+    {
+      return;
+    }
+  if (rapl_region_depth == 0 || rapl_region_stack[rapl_region_depth - 1].id != id)
+    {
+      printf("[RAPL] Region %s ended, but it is not the innermost open region\n", rapl_regions[id].name);
+      return;
+    }
+  rapl_region_frame_t* f = rapl_region_stack + --rapl_region_depth;
+
+  int domains[RAPL_DOMAIN_NUM];
+  int s, i, n = rapl_domains_available(domains);
+  uint64_t raw[rapl_num_sockets * n];
+  rapl_read_initialized_sockets(domains, n, raw);
+  rapl_read_ticks ts = rapl_read_now();
+  double duration = rapl_ticks_to_s(ts - f->ts);
+  rapl_trace_sockets(RAPL_TRACE_REGION_END, id, ts, domains, n, raw);
+
+  double energy[RAPL_DOMAIN_NUM] = { 0 };
+  FOR_ALL_SOCKETS(s)
+  {
+    if (!rapl_sockets[s]->initialized)
+      {
+	continue;
+      }
+    for (i = 0; i < n; i++)
+      {
+	const int d = domains[i];
+	energy[d] += (double) rapl_counter_delta(d, f->raw[s * n + i], raw[s * n + i]) * rapl_domain_units[d];
+      }
+  }
+  double power = (energy[RAPL_DOMAIN_PKG] + energy[RAPL_DOMAIN_DRAM]) / duration;
+
+  rapl_region_t* r = rapl_regions + id;
+  rapl_spin_lock(&r->lock);
+  r->calls++;
+  r->duration += duration;
+  for (i = 0; i < RAPL_DOMAIN_NUM; i++)
+    {
+      r->energy[i] += energy[i];
+    }
+  if (duration > 0)
+    {
+      if (power < r->power_min)
+	{
+	  r->power_min = power;
+	}
+      if (power > r->power_max)
+	{
+	  r->power_max = power;
+	}
+    }
+  rapl_spin_unlock(&r->lock);
+}
+
+int
+rapl_read_num_regions()
+{
+  return rapl_num_regions;
+}
+
+int
+rapl_read_region_stats(int id, rapl_region_stats_t* s)
+{
+  if (id < 0 || id >= rapl_num_regions)
+    {
+      return -1;
+    }
+
+  rapl_region_t* r = rapl_regions + id;
+  rapl_spin_lock(&r->lock);
+  s->name = r->name;
+  s->calls = r->calls;
+  s->duration = r->duration;
+  s->energy_package = r->energy[RAPL_DOMAIN_PKG];
+  s->energy_pp0 = r->energy[RAPL_DOMAIN_PP0];
+  s->energy_dram = r->energy[RAPL_DOMAIN_DRAM];
+  s->energy_total = s->energy_package + s->energy_dram;
+  s->power_mean = (s->duration > 0) ? s->energy_total / s->duration : 0;
+  s->power_min = (r->power_min == HUGE_VAL) ? 0 : r->power_min;
+  s->power_max = r->power_max;
+  rapl_spin_unlock(&r->lock);
+  return 0;
+}
+
+void
+rapl_read_print_regions()
+{
+  if (rapl_num_regions == 0)
+    {
+      return;
+    }
+
+  printf("[RAPL] %-24s %10s %11s %11s %11s %11s %11s %11s %11s %11s\n", "Region", "Calls", "Time (s)", 
+	 "Total (J)", "Package (J)", "PP0 (J)", "DRAM (J)", "Mean (W)", "Min (W)", "Max (W)");
+  int id;
+  for (id = 0; id < rapl_num_regions; id++)
+    {
+      rapl_region_stats_t s;
+      rapl_read_region_stats(id, &s);
+      printf("[RAPL] %-24s %10" PRIu64 " %11.6f %11.6f %11.6f %11.6f %11.6f %11.6f %11.6f %11.6f\n", 
+	     s.name, s.calls, s.duration, s.energy_total, s.energy_package, s.energy_pp0, s.energy_dram,
+	     s.power_mean, s.power_min, s.power_max);
+    }
+}
+
+
+/*********************************************************************************/
+/* attribution: the package and pp0 energy of each socket over a window, split 
+   between the registered threads of the socket in proportion to their on-cpu time
+   (CLOCK_THREAD_CPUTIME_ID of each thread). */
+/*********************************************************************************/
+
+#define RAPL_THREADS_MAX      256
+#define RAPL_THREAD_NAME_LEN  48
+
+typedef struct rapl_thread
+{
+  char name[RAPL_THREAD_NAME_LEN];
+  clockid_t clock;		/* the cpu-time clock of the thread */
+  int socket;
+  int exited;
+  uint64_t cpu_exit;		/* the cpu time (ns) when the thread unregistered */
+  uint64_t cpu_start;
+  uint64_t cpu_stop;
+  double share;
+  double energy[RAPL_DOMAIN_NUM];
+} rapl_thread_t;
+
+static rapl_thread_t rapl_threads[RAPL_THREADS_MAX];
+static int rapl_num_threads = 0;
+static pthread_mutex_t rapl_threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread int rapl_thread_id = -1;
+static rapl_session_t* rapl_attrib_session = NULL;
+static int rapl_attrib_active = 0;
+
+/* the cpu time (ns) of t, or the last one if it exited */
+static uint64_t
+rapl_thread_cpu_ns(rapl_thread_t* t)
+{
+  struct timespec ts;
+  if (t->exited || clock_gettime(t->clock, &ts) != 0)
+    {
+      return t->cpu_exit;
+    }
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int
+rapl_read_thread_register(const char* name)
+{
+  if (rapl_thread_id >= 0)
+    {
+      return rapl_thread_id;
+    }
+  clockid_t clock;
+  if (rapl_topology_init() < 0 || pthread_getcpuclockid(pthread_self(), &clock) != 0)
+    {
+      return -1;
+    }
+  int socket = rapl_read_cpu_socket(sched_getcpu());
+
+  pthread_mutex_lock(&rapl_threads_mutex);
+  if (rapl_num_threads == RAPL_THREADS_MAX)
+    {
+      pthread_mutex_unlock(&rapl_threads_mutex);
+      printf("[RAPL] Too many threads, ignoring %s\n", name);
+      return -1;
+    }
+  int id = rapl_num_threads;
+  rapl_thread_t* t = rapl_threads + id;
+  memset(t, 0, sizeof(rapl_thread_t));
+  strncpy(t->name, name, RAPL_THREAD_NAME_LEN - 1);
+  t->clock = clock;
+  t->socket = (socket < 0) ? 0 : socket;
+  /* a thread that registers within a window counts from now */
+  t->cpu_start = rapl_thread_cpu_ns(t);
+  rapl_num_threads++;
+  pthread_mutex_unlock(&rapl_threads_mutex);
+
+  rapl_thread_id = id;
+  return id;
+}
+
+void
+rapl_read_thread_unregister()
+{
+  if (rapl_thread_id < 0)
+    {
+      return;
+    }
+  rapl_thread_t* t = rapl_threads + rapl_thread_id;
+  pthread_mutex_lock(&rapl_threads_mutex);
+  t->cpu_exit = rapl_thread_cpu_ns(t);
+  t->exited = 1;
+  pthread_mutex_unlock(&rapl_threads_mutex);
+  rapl_thread_id = -1;
+}
+
+void
+rapl_read_attrib_start()
+{
+  if (rapl_topology_init() < 0)
+    {
+      return;
+    }
+
+  pthread_mutex_lock(&rapl_threads_mutex);
+  if (rapl_attrib_session == NULL)
+    {
+      rapl_attrib_session = rapl_session_alloc();
+      if (rapl_attrib_session == NULL)
+	{
+	  pthread_mutex_unlock(&rapl_threads_mutex);
+	  return;
+	}
+    }
+
+  rapl_read_session_start(rapl_attrib_session);
+  int id;
+  for (id = 0; id < rapl_num_threads; id++)
+    {
+      rapl_thread_t* t = rapl_threads + id;
+      t->cpu_start = rapl_thread_cpu_ns(t);
+    }
+  rapl_attrib_active = 1;
+  pthread_mutex_unlock(&rapl_threads_mutex);
+}
+
+void
+rapl_read_attrib_stop()
+{
+  pthread_mutex_lock(&rapl_threads_mutex);
+  if (!rapl_attrib_active)
+    {
+      pthread_mutex_unlock(&rapl_threads_mutex);
+      return;
+    }
+
+  int id, s;
+  for (id = 0; id < rapl_num_threads; id++)
+    {
+      rapl_thread_t* t = rapl_threads + id;
+      t->cpu_stop = rapl_thread_cpu_ns(t);
+      if (t->cpu_stop < t->cpu_start)
+	{
+	  /* exited without unregistering */
+	  t->cpu_stop = t->cpu_start;
+	}
+    }
+  rapl_session_t* ss = rapl_attrib_session;
+  rapl_read_session_stop(ss);
+
+  double cpu_sum[rapl_num_sockets];
+  FOR_ALL_SOCKETS(s)
+  {
+    cpu_sum[s] = 0;
+  }
+  for (id = 0; id < rapl_num_threads; id++)
+    {
+      rapl_thread_t* t = rapl_threads + id;
+      cpu_sum[t->socket] += t->cpu_stop - t->cpu_start;
+    }
+
+  for (id = 0; id < rapl_num_threads; id++)
+    {
+      rapl_thread_t* t = rapl_threads + id;
+      s = t->socket;
+      t->share = (cpu_sum[s] > 0) ? (t->cpu_stop - t->cpu_start) / cpu_sum[s] : 0;
+      t->energy[RAPL_DOMAIN_PKG] = t->share * 
+	rapl_energy_delta(RAPL_DOMAIN_PKG, ss->sk[s]->before[RAPL_DOMAIN_PKG], ss->sk[s]->after[RAPL_DOMAIN_PKG]);
+      t->energy[RAPL_DOMAIN_PP0] = t->share * 
+	rapl_energy_delta(RAPL_DOMAIN_PP0, ss->sk[s]->before[RAPL_DOMAIN_PP0], ss->sk[s]->after[RAPL_DOMAIN_PP0]);
+    }
+  rapl_attrib_active = 0;
+  pthread_mutex_unlock(&rapl_threads_mutex);
+}
+
+int
+rapl_read_num_threads()
+{
+  return rapl_num_threads;
+}
+
+int
+rapl_read_thread_stats(int id, rapl_thread_stats_t* s)
+{
+  if (id < 0 || id >= rapl_num_threads)
+    {
+      return -1;
+    }
+
+  rapl_thread_t* t = rapl_threads + id;
+  pthread_mutex_lock(&rapl_threads_mutex);
+  s->name = t->name;
+  s->socket = t->socket;
+  s->cpu_time = (t->cpu_stop - t->cpu_start) / 1e9;
+  s->share = t->share;
+  s->energy_package = t->energy[RAPL_DOMAIN_PKG];
+  s->energy_pp0 = t->energy[RAPL_DOMAIN_PP0];
+  pthread_mutex_unlock(&rapl_threads_mutex);
+  return 0;
+}
+
+void
+rapl_read_print_threads()
+{
+  if (rapl_num_threads == 0)
+    {
+      return;
+    }
+
+  printf("[RAPL] %-24s %6s %11s %8s %11s %11s\n", "Thread", "Socket", "CPU (s)", "Share", 
+	 "Package (J)", "PP0 (J)");
+  int id;
+  for (id = 0; id < rapl_num_threads; id++)
+    {
+      rapl_thread_stats_t s;
+      rapl_read_thread_stats(id, &s);
+      printf("[RAPL] %-24s %6d %11.6f %7.2f%% %11.6f %11.6f\n", 
+	     s.name, s.socket, s.cpu_time, 100 * s.share, s.energy_package, s.energy_pp0);
+    }
+}
+
+
+/*********************************************************************************/
+/* benchmark harness: runs a workload at increasing thread counts, the threads 
+   pinned per the_cores, each run measured with its own session. */
+/*********************************************************************************/
+
+typedef struct rapl_bench_thread
+{
+  pthread_t thread;
+  int id;
+  int num_threads;
+  rapl_bench_fn fn;
+  void* arg;
+  volatile uint32_t* ready;
+  volatile int* go;
+  volatile int* stop;
+  uint64_t ops;
+} rapl_bench_thread_t;
+
+static void*
+rapl_bench_thread(void* arg)
+{
+  rapl_bench_thread_t* t = (rapl_bench_thread_t*) arg;
+  __sync_fetch_and_add(t->ready, 1);
+  while (!*t->go)
+    {
+      RAPL_PAUSE();
+    }
+  t->ops = t->fn(t->id, t->num_threads, t->stop, t->arg);
+  return NULL;
+}
+
+/* one run of fn with num_threads threads for duration_ms, into r */
+static int
+rapl_bench_run(rapl_bench_fn fn, void* arg, int num_threads, uint32_t duration_ms, 
+	       rapl_session_t* ss, rapl_bench_result_t* r)
+{
+  rapl_bench_thread_t threads[num_threads];
+  volatile uint32_t ready = 0;
+  volatile int go = 0, stop = 0;
+  const int num_cores = sizeof(the_cores) / sizeof(the_cores[0]);
+
+  int i, created;
+  for (created = 0; created < num_threads; created++)
+    {
+      rapl_bench_thread_t* t = threads + created;
+      t->id = created;
+      t->num_threads = num_threads;
+      t->fn = fn;
+      t->arg = arg;
+      t->ready = &ready;
+      t->go = &go;
+      t->stop = &stop;
+      t->ops = 0;
+
+      pthread_attr_t attr;
+      pthread_attr_init(&attr);
+      const int core = the_cores[created % num_cores];
+      if (core < rapl_num_cpus)
+	{
+	  cpu_set_t cpuset;
+	  CPU_ZERO(&cpuset);
+	  CPU_SET(core, &cpuset);
+	  pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpuset);
+	}
+      int ret = pthread_create(&t->thread, &attr, rapl_bench_thread, t);
+      pthread_attr_destroy(&attr);
+      if (ret == EINVAL)
+	{
+	  /* the core is not available to the process */
+	  printf("[RAPL] Benchmark thread %d could not pin to core %d\n", created, core);
+	  ret = pthread_create(&t->thread, NULL, rapl_bench_thread, t);
+	}
+      if (ret != 0)
+	{
+	  break;
+	}
+    }
+  if (created < num_threads)
+    {
+      printf("[RAPL] Could not create benchmark thread %d\n", created);
+      stop = 1;
+    }
+
+  /* all the threads are running before the window starts */
+  while (ready < (uint32_t) created)
+    {
+      RAPL_PAUSE();
+    }
+  rapl_read_session_start(ss);
+  go = 1;
+  struct timespec ts = { duration_ms / 1000, (duration_ms % 1000) * 1000000L };
+  nanosleep(&ts, NULL);
+  stop = 1;
+  rapl_read_session_stop(ss);
+
+  r->num_threads = num_threads;
+  r->ops = 0;
+  for (i = 0; i < created; i++)
+    {
+      pthread_join(threads[i].thread, NULL);
+      r->ops += threads[i].ops;
+    }
+  if (created < num_threads)
+    {
+      return -1;
+    }
+
+  rapl_read_session_stats(ss, &r->stats);
+  const int total = RAPL_STATS_TOTAL(&r->stats);
+  r->duration = r->stats.duration[total];
+  r->energy = r->stats.energy_total[total];
+  r->throughput = (r->duration > 0) ? r->ops / r->duration : 0;
+  r->joules_per_op = (r->ops > 0) ? r->energy / r->ops : 0;
+  r->ops_per_joule = (r->energy > 0) ? r->ops / r->energy : 0;
+  return 0;
+}
+
+int
+rapl_read_bench(rapl_bench_fn fn, void* arg, int max_threads, int step, uint32_t duration_ms, 
+		rapl_bench_result_t* results)
+{
+  if (rapl_topology_init() < 0 || !rapl_backend_ok || max_threads < 1)
+    {
+      printf("[RAPL] The benchmark needs an initialized library (RR_INIT_ALL)\n");
+      return -1;
+    }
+  rapl_session_t* ss = rapl_session_alloc();
+  if (ss == NULL)
+    {
+      return -1;
+    }
+
+  int n = 0, num_threads = 1;
+  while (num_threads <= max_threads)
+    {
+      memset(results + n, 0, sizeof(rapl_bench_result_t));
+      if (rapl_bench_run(fn, arg, num_threads, duration_ms, ss, results + n) < 0)
+	{
+	  rapl_read_session_stats_free(&results[n].stats);
+	  break;
+	}
+      n++;
+      /* 1, then the multiples of step */
+      num_threads = (step > 1) ? (num_threads / step + 1) * step : num_threads + 1;
+    }
+  rapl_session_free(ss);
+  return n;
+}
+
+int
+rapl_read_bench_num_runs(int max_threads, int step)
+{
+  if (max_threads < 1)
+    {
+      return 0;
+    }
+  return (step > 1) ? 1 + max_threads / step : max_threads;
+}
+
+void
+rapl_read_bench_free(rapl_bench_result_t* results, int n)
 {
-  rapl_read_ticks duration[NUMBER_OF_SOCKETS];
-  double duration_s[NUMBER_OF_SOCKETS];
-  double rapl_package[NUMBER_OF_SOCKETS];
-  double rapl_pp0[NUMBER_OF_SOCKETS];
-  double rapl_rest[NUMBER_OF_SOCKETS];
-  double rapl_dram[NUMBER_OF_SOCKETS];
-
   int i;
-  FOR_ALL_SOCKETS(i)
+  for (i = 0; i < n; i++)
+    {
+      rapl_read_session_stats_free(&results[i].stats);
+    }
+}
+
+void
+rapl_read_bench_print(const rapl_bench_result_t* results, int n)
+{
+  int i, s;
+  printf("[RAPL] %7s %10s %14s %12s %10s %12s %12s", "Threads", "Time (s)", "Ops", "Mops/s", 
+	 "Power (W)", "nJ/op", "ops/J");
+  FOR_ALL_SOCKETS(s)
+  {
+    char col[32];
+    snprintf(col, sizeof(col), "Socket %d (W)", s);
+    printf(" %14s", col);
+  }
+  printf("\n");
+
+  for (i = 0; i < n; i++)
+    {
+      const rapl_bench_result_t* r = results + i;
+      const int total = RAPL_STATS_TOTAL(&r->stats);
+      printf("[RAPL] %7d %10.6f %14" PRIu64 " %12.3f %10.3f %12.3f %12.1f", r->num_threads, r->duration, 
+	     r->ops, r->throughput / 1e6, r->stats.power_total[total], 1e9 * r->joules_per_op, 
+	     r->ops_per_joule);
+      FOR_ALL_SOCKETS(s)
+      {
+	printf(" %14.3f", r->stats.power_total[s]);
+      }
+      printf("\n");
+    }
+}
+
+
+/*********************************************************************************/
+/* autotuner */
+/*********************************************************************************/
+
+#define RAPL_TUNE_MIN_GAIN 0.02	/* a step is kept if it improves ops/J by 2% */
+#define RAPL_TUNE_HOLD     8	/* windows at a local optimum before exploring again */
+
+/* the directions of a step: threads up, threads down, cap up, cap down */
+#define RAPL_TUNE_DIRS 4
+
+static rapl_tune_config_t rapl_tune_config;
+static rapl_tune_state_t rapl_tune_state;
+static volatile int rapl_tuning = 0;
+static pthread_t rapl_tune_thread;
+static pthread_mutex_t rapl_tune_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rapl_tune_cond = PTHREAD_COND_INITIALIZER;
+static rapl_session_t* rapl_tune_session = NULL;
+static rapl_session_stats_t rapl_tune_stats;
+/* the PL1 limits of the sockets when the tuner started, restored when it stops (and
+   not the original limits: the application may have set its own before) */
+static rapl_power_limit_t* rapl_tune_saved = NULL;
+
+/* waits for ms; -1 if the tuner was stopped meanwhile */
+static int
+rapl_tune_wait(uint32_t ms)
+{
+  struct timespec next;
+  clock_gettime(CLOCK_REALTIME, &next);
+  next.tv_sec += ms / 1000;
+  next.tv_nsec += (ms % 1000) * 1000000L;
+  if (next.tv_nsec >= 1000000000L)
+    {
+      next.tv_nsec -= 1000000000L;
+      next.tv_sec++;
+    }
+
+  pthread_mutex_lock(&rapl_tune_mutex);
+  while (rapl_tuning && pthread_cond_timedwait(&rapl_tune_cond, &rapl_tune_mutex, &next) != ETIMEDOUT)
+    ;
+  int ret = rapl_tuning ? 0 : -1;
+  pthread_mutex_unlock(&rapl_tune_mutex);
+  return ret;
+}
+
+/* the ops/J of the current configuration over one window; -1 if stopped */
+static double
+rapl_tune_measure()
+{
+  const rapl_tune_config_t* c = &rapl_tune_config;
+  uint64_t ops = c->ops(c->arg);
+  rapl_read_session_start(rapl_tune_session);
+  if (rapl_tune_wait(c->period_ms) < 0)
+    {
+      return -1;
+    }
+  rapl_read_session_stop(rapl_tune_session);
+  ops = c->ops(c->arg) - ops;
+
+  rapl_read_session_stats(rapl_tune_session, &rapl_tune_stats);
+  const double energy = rapl_tune_stats.energy_total[RAPL_STATS_TOTAL(&rapl_tune_stats)];
+  const double e = (energy > 0) ? ops / energy : 0;
+
+  pthread_mutex_lock(&rapl_tune_mutex);
+  rapl_tune_state.windows++;
+  pthread_mutex_unlock(&rapl_tune_mutex);
+  return e;
+}
+
+/* set the PL1 cap of the initialized sockets, then the threads of the application */
+static void
+rapl_tune_apply(int num_threads, double cap)
+{
+  const rapl_tune_config_t* c = &rapl_tune_config;
+  if (cap > 0)
+    {
+      int s;
+      FOR_ALL_SOCKETS(s)
+      {
+	rapl_power_limit_t l;
+	if (!rapl_sockets[s]->initialized || rapl_read_get_power_limit(s, RAPL_LIMIT_PKG_PL1, &l) < 0)
+	  {
+	    continue;
+	  }
+	l.power = cap;
+	l.enabled = 1;
+	rapl_read_set_power_limit(s, RAPL_LIMIT_PKG_PL1, &l);
+      }
+    }
+  c->apply(num_threads, cap, c->arg);
+}
+
+/* the configuration one step from (num_threads, cap) in direction dir; -1 if it is 
+   out of the range */
+static int
+rapl_tune_step(int dir, int* num_threads, double* cap)
+{
+  const rapl_tune_config_t* c = &rapl_tune_config;
+  switch (dir)
+    {
+    case 0:
+      if (*num_threads + c->thread_step > c->max_threads)
+	{
+	  return -1;
+	}
+      *num_threads += c->thread_step;
+      return 0;
+    case 1:
+      if (*num_threads - c->thread_step < c->min_threads)
+	{
+	  return -1;
+	}
+      *num_threads -= c->thread_step;
+      return 0;
+    case 2:
+      if (c->max_cap <= 0 || *cap + c->cap_step > c->max_cap + 1e-9)
+	{
+	  return -1;
+	}
+      *cap += c->cap_step;
+      return 0;
+    default:
+      if (c->max_cap <= 0 || *cap - c->cap_step < c->min_cap - 1e-9)
+	{
+	  return -1;
+	}
+      *cap -= c->cap_step;
+      return 0;
+    }
+}
+
+static void*
+rapl_tune_controller(void* arg)
+{
+  int num_threads = rapl_tune_state.num_threads;
+  double cap = rapl_tune_state.cap;
+  rapl_tune_apply(num_threads, cap);
+  double e = rapl_tune_measure();
+
+  int dir = 0, fails = 0, hold = 0;
+  while (e >= 0)
+    {
+      pthread_mutex_lock(&rapl_tune_mutex);
+      rapl_tune_state.ops_per_joule = e;
+      pthread_mutex_unlock(&rapl_tune_mutex);
+
+      if (hold > 0)
+	{
+	  hold--;
+	  e = rapl_tune_measure();
+	  continue;
+	}
+
+      /* the next direction with a step in the range */
+      int t = num_threads, i;
+      double p = cap;
+      for (i = 0; i < RAPL_TUNE_DIRS && rapl_tune_step(dir, &t, &p) < 0; i++)
+	{
+	  dir = (dir + 1) % RAPL_TUNE_DIRS;
+	  fails++;
+	}
+      if (i == RAPL_TUNE_DIRS || fails >= RAPL_TUNE_DIRS)
+	{
+	  /* no step from here improved (or a single configuration) */
+	  fails = 0;
+	  hold = RAPL_TUNE_HOLD;
+	  continue;
+	}
+
+      rapl_tune_apply(t, p);
+      double e_step = rapl_tune_measure();
+      if (e_step < 0)
+	{
+	  break;
+	}
+      if (e_step > e * (1 + RAPL_TUNE_MIN_GAIN))
+	{
+	  /* keep the step, and the direction */
+	  num_threads = t;
+	  cap = p;
+	  e = e_step;
+	  fails = 0;
+	  pthread_mutex_lock(&rapl_tune_mutex);
+	  rapl_tune_state.num_threads = num_threads;
+	  rapl_tune_state.cap = cap;
+	  rapl_tune_state.moves++;
+	  pthread_mutex_unlock(&rapl_tune_mutex);
+	  continue;
+	}
+
+      /* back, and measure again: the load of the application changes */
+      dir = (dir + 1) % RAPL_TUNE_DIRS;
+      if (++fails >= RAPL_TUNE_DIRS)
+	{
+	  fails = 0;
+	  hold = RAPL_TUNE_HOLD;
+	}
+      rapl_tune_apply(num_threads, cap);
+      e = rapl_tune_measure();
+    }
+  return NULL;
+}
+
+int
+rapl_read_tune_start(const rapl_tune_config_t* c)
+{
+  if (rapl_tuning)
+    {
+      return -1;
+    }
+  if (rapl_topology_init() < 0 || !rapl_backend_ok)
+    {
+      printf("[RAPL] The autotuner needs an initialized library (RR_INIT_ALL)\n");
+      return -1;
+    }
+  if (c->ops == NULL || c->apply == NULL || c->min_threads < 1 || c->max_threads < c->min_threads 
+      || c->period_ms == 0 || (c->max_cap > 0 && (c->cap_step <= 0 || c->min_cap > c->max_cap)))
+    {
+      return -1;
+    }
+
+  rapl_tune_config = *c;
+  if (rapl_tune_config.thread_step < 1)
+    {
+      rapl_tune_config.thread_step = 1;
+    }
+  if (rapl_tune_config.max_cap > 0)
+    {
+      /* the cap needs writable power limits */
+      rapl_power_limit_t l;
+      int s;
+      FOR_ALL_SOCKETS(s)
+      {
+	if (rapl_sockets[s]->initialized && (rapl_read_get_power_limit(s, RAPL_LIMIT_PKG_PL1, &l) < 0 
+				    || l.locked || rapl_backend->write_reg == NULL))
+	  {
+	    printf("[RAPL] The PL1 limit of socket %d cannot be set: tuning the threads only\n", s);
+	    rapl_tune_config.max_cap = 0;
+	    break;
+	  }
+      }
+    }
+
+  if (rapl_tune_config.max_cap > 0)
+    {
+      rapl_tune_saved = (rapl_power_limit_t*) calloc(rapl_num_sockets, sizeof(rapl_power_limit_t));
+      if (rapl_tune_saved == NULL)
+	{
+	  return -1;
+	}
+      int s;
+      FOR_ALL_SOCKETS(s)
+      {
+	/* locked marks the sockets that are not capped */
+	rapl_tune_saved[s].locked = !rapl_sockets[s]->initialized 
+	  || rapl_read_get_power_limit(s, RAPL_LIMIT_PKG_PL1, rapl_tune_saved + s) < 0;
+      }
+    }
+
+  rapl_tune_session = rapl_session_alloc();
+  if (rapl_tune_session == NULL)
+    {
+      free(rapl_tune_saved);
+      rapl_tune_saved = NULL;
+      return -1;
+    }
+  memset(&rapl_tune_stats, 0, sizeof(rapl_tune_stats));
+  memset(&rapl_tune_state, 0, sizeof(rapl_tune_state));
+  rapl_tune_state.num_threads = rapl_tune_config.max_threads;
+  rapl_tune_state.cap = (rapl_tune_config.max_cap > 0) ? rapl_tune_config.max_cap : 0;
+
+  rapl_tuning = 1;
+  if (pthread_create(&rapl_tune_thread, NULL, rapl_tune_controller, NULL) != 0)
+    {
+      rapl_tuning = 0;
+      rapl_session_free(rapl_tune_session);
+      rapl_tune_session = NULL;
+      free(rapl_tune_saved);
+      rapl_tune_saved = NULL;
+      return -1;
+    }
+  return 0;
+}
+
+void
+rapl_read_tune_stop()
+{
+  if (!rapl_tuning)
+    {
+      return;
+    }
+  pthread_mutex_lock(&rapl_tune_mutex);
+  rapl_tuning = 0;
+  pthread_cond_signal(&rapl_tune_cond);
+  pthread_mutex_unlock(&rapl_tune_mutex);
+  pthread_join(rapl_tune_thread, NULL);
+
+  if (rapl_tune_saved != NULL)
+    {
+      int s;
+      FOR_ALL_SOCKETS(s)
+      {
+	if (!rapl_tune_saved[s].locked)
+	  {
+	    rapl_read_set_power_limit(s, RAPL_LIMIT_PKG_PL1, rapl_tune_saved + s);
+	  }
+      }
+      free(rapl_tune_saved);
+      rapl_tune_saved = NULL;
+    }
+  rapl_read_session_stats_free(&rapl_tune_stats);
+  rapl_session_free(rapl_tune_session);
+  rapl_tune_session = NULL;
+}
+
+void
+rapl_read_tune_get(rapl_tune_state_t* t)
+{
+  pthread_mutex_lock(&rapl_tune_mutex);
+  *t = rapl_tune_state;
+  pthread_mutex_unlock(&rapl_tune_mutex);
+}
+
+
+/*********************************************************************************/
+/* sampler */
+/*********************************************************************************/
+
+typedef struct rapl_ring
+{
+  /* written only by the sampler thread */
+  volatile uint64_t head __attribute__ ((aligned(CACHE_LINE_SIZE)));
+  uint64_t dropped;
+  /* written only by the consumer */
+  volatile uint64_t tail __attribute__ ((aligned(CACHE_LINE_SIZE)));
+  uint64_t mask __attribute__ ((aligned(CACHE_LINE_SIZE)));
+  rapl_sample_t* buf;
+} rapl_ring_t;
+
+typedef struct rapl_sampler
+{
+  rapl_ring_t ring;
+  pthread_t thread;
+  int socket;
+  int active;
+} rapl_sampler_t;
+
+static rapl_sampler_t* rapl_samplers = NULL;
+static volatile int rapl_sampler_running = 0;
+static uint64_t rapl_sampler_period_ns;
+
+/* the latest state of each socket, kept by its sampler for the readers that must not
+   touch the counters (e.g., the exporter). Never reset, so that the energy is 
+   monotonic across sampler restarts. */
+typedef struct rapl_snap
+{
+  volatile uint32_t seq;	/* odd while the sampler updates it */
+  int valid;
+  uint64_t raw[RAPL_DOMAIN_NUM];
+  rapl_snapshot_t snapshot;
+} __attribute__ ((aligned(CACHE_LINE_SIZE))) rapl_snap_t;
+
+static rapl_snap_t* rapl_snaps = NULL;
+
+static void
+rapl_snap_update(int s, const int* domains, int n, const uint64_t* raw, rapl_read_ticks ts)
+{
+  rapl_snap_t* p = rapl_snaps + s;
+  rapl_snapshot_t* snap = &p->snapshot;
+  const double dt = p->valid ? rapl_ticks_to_s(ts - snap->ts) : 0;
+
+  p->seq++;
+  __sync_synchronize();
+  int i;
+  for (i = 0; i < n; i++)
+    {
+      const int d = domains[i];
+      if (p->valid)
+	{
+	  double e = (double) rapl_counter_delta(d, p->raw[d], raw[i]) * rapl_domain_units[d];
+	  snap->energy[d] += e;
+	  snap->power[d] = (dt > 0) ? e / dt : 0;
+	}
+      p->raw[d] = raw[i];
+    }
+  snap->ts = ts;
+  snap->samples++;
+  p->valid = 1;
+  __sync_synchronize();
+  p->seq++;
+}
+
+int
+rapl_read_snapshot(int socket, rapl_snapshot_t* s)
+{
+  if (rapl_snaps == NULL || socket < 0 || socket >= rapl_num_sockets)
+    {
+      return -1;
+    }
+
+  rapl_snap_t* p = rapl_snaps + socket;
+  uint32_t seq;
+  do
+    {
+      seq = __atomic_load_n(&p->seq, __ATOMIC_ACQUIRE);
+      *s = p->snapshot;
+      __sync_synchronize();
+    }
+  while ((seq & 1) || seq != p->seq);
+  return (s->samples > 0) ? 0 : -1;
+}
+
+static inline void
+rapl_ring_push(rapl_ring_t* r, const rapl_sample_t* smp)
+{
+  uint64_t head = r->head;
+  if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) > r->mask)
+    {
+      r->dropped++;
+      return;
+    }
+  r->buf[head & r->mask] = *smp;
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void*
+rapl_sampler_thread(void* arg)
+{
+  rapl_sampler_t* smp = (rapl_sampler_t*) arg;
+  const int s = smp->socket;
+
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  CPU_SET(rapl_sockets[s]->msr_core, &cpuset);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) != 0)
+    {
+      printf("[RAPL] Sampler of socket %d could not pin to core %d\n", s, rapl_sockets[s]->msr_core);
+    }
+
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+
+  int domains[RAPL_DOMAIN_NUM];
+  uint64_t raw[RAPL_DOMAIN_NUM];
+  int i, n = rapl_domains_available(domains);
+
+  rapl_sample_t sample;
+  memset(&sample, 0, sizeof(sample));
+  sample.socket = s;
+  while (rapl_sampler_running)
+    {
+      rapl_backend_read(s, s + 1, domains, n, raw);
+      sample.ts = rapl_read_now();
+      for (i = 0; i < n; i++)
+	{
+	  sample.energy[domains[i]] = raw[i];
+	}
+      if (rapl_thermal_available)
+	{
+	  rapl_therm_t t;
+	  rapl_read_thermal(s, &t);
+	  sample.temp_package = t.pkg;
+	  sample.temp_core = t.core;
+	  sample.therm_package = t.status[0];
+	  sample.therm_core = t.status[1];
+	  rapl_thermal_sample(s, &t);
+	}
+      rapl_ring_push(&smp->ring, &sample);
+      rapl_snap_update(s, domains, n, raw, sample.ts);
+      rapl_trace_energy(RAPL_TRACE_SAMPLE, 0, s, sample.ts, domains, n, raw, 0);
+
+      next.tv_nsec += rapl_sampler_period_ns;
+      while (next.tv_nsec >= 1000000000L)
+	{
+	  next.tv_nsec -= 1000000000L;
+	  next.tv_sec++;
+	}
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+
+  return NULL;
+}
+
+void
+rapl_read_sampler_free()
+{
+  rapl_read_sampler_stop();
+  if (rapl_samplers != NULL)
+    {
+      int s;
+      FOR_ALL_SOCKETS(s)
+      {
+	free(rapl_samplers[s].ring.buf);
+      }
+      free(rapl_samplers);
+      rapl_samplers = NULL;
+    }
+}
+
+int
+rapl_read_sampler_start(uint32_t period_us, uint32_t ring_size)
+{
+  /* before the topology, rapl_num_sockets is 0: no zero-size rings and snapshots */
+  if (rapl_sampler_running || period_us == 0 || rapl_topology_init() < 0 || !rapl_backend_ok)
+    {
+      return -1;
+    }
+
+  if (rapl_snaps == NULL)
+    {
+      if (posix_memalign((void**) &rapl_snaps, CACHE_LINE_SIZE, rapl_num_sockets * sizeof(rapl_snap_t)) != 0)
+	{
+	  rapl_snaps = NULL;
+	  return -1;
+	}
+      memset(rapl_snaps, 0, rapl_num_sockets * sizeof(rapl_snap_t));
+    }
+
+  uint64_t size = 2;
+  while (size < ring_size)
+    {
+      size <<= 1;
+    }
+
+  /* the rings of a previous run are kept (a consumer may still drain them) and 
+     reused; only rapl_read_sampler_free() releases them */
+  if (rapl_samplers == NULL)
+    {
+      rapl_sampler_t* smps;
+      if (posix_memalign((void**) &smps, CACHE_LINE_SIZE, rapl_num_sockets * sizeof(rapl_sampler_t)) != 0)
+	{
+	  return -1;
+	}
+      memset(smps, 0, rapl_num_sockets * sizeof(rapl_sampler_t));
+      __atomic_store_n(&rapl_samplers, smps, __ATOMIC_RELEASE);
+    }
+
+  rapl_sampler_period_ns = (uint64_t) period_us * 1000;
+  rapl_sampler_running = 1;
+
+  int s, started = 0;
+  FOR_ALL_SOCKETS(s)
   {
-    duration[i] = rapl_stop_ts[i] - rapl_start_ts[i];
-    duration_s[i] = (double) duration[i] / ((CORE_SPEED_GHZ) * 1e9);
-    rapl_package[i] = rapl_package_after[i] - rapl_package_before[i];
-    rapl_pp0[i] = rapl_pp0_after[i] - rapl_pp0_before[i];
-    rapl_rest[i] = rapl_package[i] - rapl_pp0[i];
-    if (rapl_dram_counter)
+    rapl_sampler_t* smp = rapl_samplers + s;
+    smp->socket = s;
+    if (!rapl_sockets[s]->initialized)
       {
-	rapl_dram[i] = rapl_dram_after[i] - rapl_dram_before[i];
+	continue;
       }
-    else
+
+    if (smp->ring.buf == NULL)
       {
-	rapl_dram[i] = 0;
+	smp->ring.mask = size - 1;
+	__atomic_store_n(&smp->ring.buf, (rapl_sample_t*) malloc(size * sizeof(rapl_sample_t)), __ATOMIC_RELEASE);
+      }
+    else if (smp->ring.mask + 1 < size)
+      {
+	printf("[RAPL] The sampler ring of socket %d has %" PRIu64 " samples; rapl_read_sampler_free() "
+	       "releases it for a larger one\n", s, smp->ring.mask + 1);
+	continue;
+      }
+    if (smp->ring.buf == NULL || pthread_create(&smp->thread, NULL, rapl_sampler_thread, smp) != 0)
+      {
+	printf("[RAPL] Could not start the sampler of socket %d\n", s);
+	continue;
       }
+    smp->active = 1;
+    started++;
   }
-  
-  FOR_ALL_SOCKETS_SUM(duration_s, s->duration);
-  s->duration[NUMBER_OF_SOCKETS] /= rapl_num_active_sockets;
-  FOR_ALL_SOCKETS_SUM(rapl_package, s->energy_package);
-  FOR_ALL_SOCKETS_SUM(rapl_pp0, s->energy_pp0);
-  FOR_ALL_SOCKETS_SUM(rapl_rest, s->energy_rest);
-  FOR_ALL_SOCKETS_SUM(rapl_dram, s->energy_dram);
-  FOR_ALL_SOCKETS_PLUS1(i)
+
+  if (started == 0)
+    {
+      rapl_sampler_running = 0;
+      return -1;
+    }
+  return started;
+}
+
+void
+rapl_read_sampler_stop()
+{
+  if (!rapl_sampler_running)
+    {
+      return;
+    }
+
+  rapl_sampler_running = 0;
+  int s;
+  FOR_ALL_SOCKETS(s)
   {
-    s->energy_total[i] = s->energy_package[i] + s->energy_dram[i];
+    if (rapl_samplers[s].active)
+      {
+	pthread_join(rapl_samplers[s].thread, NULL);
+	rapl_samplers[s].active = 0;
+      }
+  }
+}
+
+size_t
+rapl_read_sampler_drain(int socket, rapl_sample_t* out, size_t max)
+{
+  if (rapl_samplers == NULL || socket < 0 || socket >= rapl_num_sockets || rapl_samplers[socket].ring.buf == NULL)
+    {
+      return 0;
+    }
+
+  rapl_ring_t* r = &rapl_samplers[socket].ring;
+  uint64_t tail = r->tail;
+  uint64_t avail = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - tail;
+  size_t n = (avail < max) ? avail : max;
+  size_t i;
+  for (i = 0; i < n; i++)
+    {
+      out[i] = r->buf[(tail + i) & r->mask];
+    }
+  __atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+  return n;
+}
+
+uint64_t
+rapl_read_sampler_dropped(int socket)
+{
+  if (rapl_samplers == NULL || socket < 0 || socket >= rapl_num_sockets)
+    {
+      return 0;
+    }
+  return rapl_samplers[socket].ring.dropped;
+}
+
+double
+rapl_read_sample_energy(int domain, uint64_t before, uint64_t after)
+{
+  if (domain < 0 || domain >= RAPL_DOMAIN_NUM)
+    {
+      return 0;
+    }
+  return (double) rapl_counter_delta(domain, before, after) * rapl_domain_units[domain];
+}
+
+
+/*********************************************************************************/
+/* exporter: the sampler snapshots in the OpenMetrics text format, served over HTTP
+   or written atomically to a node-exporter textfile. Scrapes never read the 
+   counters. */
+/*********************************************************************************/
+
+#define RAPL_EXPORT_PERIOD_US  1000000	/* of the sampler, if the exporter starts it */
+#define RAPL_EXPORT_SLICE_MS   100	/* how often the exporter threads check for stop */
+
+static const char* rapl_export_domain[RAPL_DOMAIN_NUM] = { "package", "pp0", "pp1", "dram", "psys" };
+
+static volatile int rapl_export_running = 0;
+static int rapl_export_owns_sampler = 0;
+static int rapl_export_listen_fd = -1;
+static pthread_t rapl_export_http_thread, rapl_export_file_thread;
+static int rapl_export_http_active = 0, rapl_export_file_active = 0;
+static char* rapl_export_path = NULL;
+static uint32_t rapl_export_period_ms;
+
+static void
+rapl_export_append(char* buf, size_t len, size_t* off, const char* fmt, ...)
+{
+  if (*off >= len)
+    {
+      return;
+    }
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(buf + *off, len - *off, fmt, ap);
+  va_end(ap);
+  if (n > 0)
+    {
+      *off += n;
+    }
+}
+
+/* the size of a buffer for rapl_export_format() */
+static size_t
+rapl_export_buf_size()
+{
+  return 1024 + rapl_num_sockets * 2048;
+}
+
+/* the metrics of the sockets with a snapshot, in OpenMetrics (openmetrics) or in the
+   Prometheus text format of the node-exporter textfile collector */
+static size_t
+rapl_export_format(char* buf, size_t len, int openmetrics)
+{
+  size_t off = 0;
+  int s, d;
+  rapl_snapshot_t snap[rapl_num_sockets];
+  int valid[rapl_num_sockets];
+  FOR_ALL_SOCKETS(s)
+  {
+    valid[s] = (rapl_read_snapshot(s, snap + s) == 0);
   }
 
-  if (duration_s > 0)
+  /* the counter family has no _total suffix in OpenMetrics only */
+  const char* family = openmetrics ? "raplread_energy_joules" : "raplread_energy_joules_total";
+  rapl_export_append(buf, len, &off, "# HELP %s Energy consumed, per socket and domain.\n"
+		     "# TYPE %s counter\n", family, family);
+  if (openmetrics)
     {
-      FOR_ALL_SOCKETS_PLUS1(i)
+      rapl_export_append(buf, len, &off, "# UNIT %s joules\n", family);
+    }
+  FOR_ALL_SOCKETS(s)
+  {
+    for (d = 0; d < RAPL_DOMAIN_NUM && valid[s]; d++)
       {
-	s->power_package[i] = s->energy_package[i] / s->duration[i];
-	s->power_pp0[i] = s->energy_pp0[i] / s->duration[i];
-	s->power_rest[i] = s->energy_rest[i] / s->duration[i];
-	s->power_dram[i] = s->energy_dram[i] / s->duration[i];
-	s->power_total[i] = s->energy_total[i] / s->duration[i];
+	if (rapl_domain_available[d] && (d != RAPL_DOMAIN_PSYS || s == 0))
+	  {
+	    rapl_export_append(buf, len, &off, "raplread_energy_joules_total{socket=\"%d\",domain=\"%s\"} %.6f\n",
+			       s, rapl_export_domain[d], snap[s].energy[d]);
+	  }
+      }
+  }
+
+  rapl_export_append(buf, len, &off, "# HELP raplread_power_watts Average power over the last sampling period.\n"
+		     "# TYPE raplread_power_watts gauge\n");
+  if (openmetrics)
+    {
+      rapl_export_append(buf, len, &off, "# UNIT raplread_power_watts watts\n");
+    }
+  FOR_ALL_SOCKETS(s)
+  {
+    for (d = 0; d < RAPL_DOMAIN_NUM && valid[s]; d++)
+      {
+	if (rapl_domain_available[d] && (d != RAPL_DOMAIN_PSYS || s == 0))
+	  {
+	    rapl_export_append(buf, len, &off, "raplread_power_watts{socket=\"%d\",domain=\"%s\"} %.3f\n",
+			       s, rapl_export_domain[d], snap[s].power[d]);
+	  }
       }
+  }
+
+  if (openmetrics)
+    {
+      rapl_export_append(buf, len, &off, "# EOF\n");
+    }
+  return (off < len) ? off : len - 1;
+}
+
+static void
+rapl_export_send(int fd, const char* buf, size_t len)
+{
+  while (len > 0)
+    {
+      ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+      if (n <= 0)
+	{
+	  return;
+	}
+      buf += n;
+      len -= n;
+    }
+}
+
+static void*
+rapl_export_http(void* arg)
+{
+  const size_t size = rapl_export_buf_size();
+  char* body = (char*) malloc(size);
+  if (body == NULL)
+    {
+      return NULL;
+    }
+
+  struct pollfd pfd = { rapl_export_listen_fd, POLLIN, 0 };
+  while (rapl_export_running)
+    {
+      if (poll(&pfd, 1, RAPL_EXPORT_SLICE_MS) <= 0)
+	{
+	  continue;
+	}
+      int fd = accept(rapl_export_listen_fd, NULL, NULL);
+      if (fd < 0)
+	{
+	  continue;
+	}
+
+      struct timeval tv = { 1, 0 };
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+      char req[1024];
+      ssize_t n = recv(fd, req, sizeof(req) - 1, 0);
+      req[(n > 0) ? n : 0] = '\0';
+
+      char head[256];
+      if (!strncmp(req, "GET /metrics", 12) || !strncmp(req, "GET / ", 6))
+	{
+	  size_t len = rapl_export_format(body, size, 1);
+	  int hlen = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\n"
+			      "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+			      "Content-Length: %zu\r\nConnection: close\r\n\r\n", len);
+	  rapl_export_send(fd, head, hlen);
+	  rapl_export_send(fd, body, len);
+	}
+      else
+	{
+	  int hlen = snprintf(head, sizeof(head), "HTTP/1.0 404 Not Found\r\n"
+			      "Content-Length: 0\r\nConnection: close\r\n\r\n");
+	  rapl_export_send(fd, head, hlen);
+	}
+      close(fd);
+    }
+
+  free(body);
+  return NULL;
+}
+
+/* write the metrics to a temporary file and rename it over the textfile, so that 
+   the collector never reads a partial file */
+static void
+rapl_export_write_file(char* buf, size_t size)
+{
+  char tmp[strlen(rapl_export_path) + 32];
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", rapl_export_path, (int) getpid());
+  size_t len = rapl_export_format(buf, size, 0);
+
+  FILE* f = fopen(tmp, "w");
+  if (f == NULL)
+    {
+      return;
+    }
+  int ok = (fwrite(buf, 1, len, f) == len);
+  ok = (fclose(f) == 0) && ok;
+  if (!ok || rename(tmp, rapl_export_path) < 0)
+    {
+      unlink(tmp);
+    }
+}
+
+static void*
+rapl_export_file(void* arg)
+{
+  const size_t size = rapl_export_buf_size();
+  char* buf = (char*) malloc(size);
+  if (buf == NULL)
+    {
+      return NULL;
+    }
+
+  uint32_t elapsed_ms = rapl_export_period_ms;
+  while (rapl_export_running)
+    {
+      if (elapsed_ms >= rapl_export_period_ms)
+	{
+	  rapl_export_write_file(buf, size);
+	  elapsed_ms = 0;
+	}
+      uint32_t slice = rapl_export_period_ms - elapsed_ms;
+      if (slice > RAPL_EXPORT_SLICE_MS)
+	{
+	  slice = RAPL_EXPORT_SLICE_MS;
+	}
+      struct timespec ts = { 0, slice * 1000000L };
+      nanosleep(&ts, NULL);
+      elapsed_ms += slice;
+    }
+
+  free(buf);
+  return NULL;
+}
+
+/* the exporter needs the sampler: start it if the application did not */
+static int
+rapl_export_prepare()
+{
+  if (!rapl_backend_ok)
+    {
+      printf("[RAPL] The exporter needs an initialized library\n");
+      return -1;
+    }
+  if (!rapl_sampler_running)
+    {
+      if (rapl_read_sampler_start(RAPL_EXPORT_PERIOD_US, 2) < 0)
+	{
+	  return -1;
+	}
+      rapl_export_owns_sampler = 1;
+    }
+  rapl_export_running = 1;
+  return 0;
+}
+
+int
+rapl_read_export_http(const char* addr, uint16_t port)
+{
+  if (rapl_export_http_active)
+    {
+      return -1;
+    }
+
+  struct sockaddr_in sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(port);
+  if (inet_pton(AF_INET, (addr != NULL) ? addr : "127.0.0.1", &sa.sin_addr) != 1)
+    {
+      return -1;
+    }
+
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  int one = 1;
+  if (fd < 0)
+    {
+      return -1;
+    }
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(fd, (struct sockaddr*) &sa, sizeof(sa)) < 0 || listen(fd, 16) < 0)
+    {
+      printf("[RAPL] Cannot listen on port %u\n", port);
+      close(fd);
+      return -1;
+    }
 
+  if (rapl_export_prepare() < 0)
+    {
+      close(fd);
+      return -1;
+    }
+  rapl_export_listen_fd = fd;
+  if (pthread_create(&rapl_export_http_thread, NULL, rapl_export_http, NULL) != 0)
+    {
+      close(fd);
+      rapl_export_listen_fd = -1;
+      return -1;
+    }
+  rapl_export_http_active = 1;
+  return 0;
+}
+
+int
+rapl_read_export_textfile(const char* path, uint32_t period_ms)
+{
+  if (rapl_export_file_active || period_ms == 0)
+    {
+      return -1;
+    }
+  rapl_export_path = strdup(path);
+  if (rapl_export_path == NULL || rapl_export_prepare() < 0)
+    {
+      free(rapl_export_path);
+      rapl_export_path = NULL;
+      return -1;
+    }
+  rapl_export_period_ms = period_ms;
+  if (pthread_create(&rapl_export_file_thread, NULL, rapl_export_file, NULL) != 0)
+    {
+      free(rapl_export_path);
+      rapl_export_path = NULL;
+      return -1;
+    }
+  rapl_export_file_active = 1;
+  return 0;
+}
+
+void
+rapl_read_export_stop()
+{
+  if (!rapl_export_http_active && !rapl_export_file_active)
+    {
+      return;
+    }
+
+  rapl_export_running = 0;
+  if (rapl_export_http_active)
+    {
+      pthread_join(rapl_export_http_thread, NULL);
+      close(rapl_export_listen_fd);
+      rapl_export_listen_fd = -1;
+      rapl_export_http_active = 0;
+    }
+  if (rapl_export_file_active)
+    {
+      pthread_join(rapl_export_file_thread, NULL);
+      free(rapl_export_path);
+      rapl_export_path = NULL;
+      rapl_export_file_active = 0;
+    }
+  /* its rings are too small for a later RR_SAMPLER_START(): release them */
+  if (rapl_export_owns_sampler)
+    {
+      rapl_read_sampler_free();
+      rapl_export_owns_sampler = 0;
     }
 }
@@ -97,6 +97,66 @@ extern "C" {
 #define RR_TERM()				
 /* generate stats and store them in s (rapl_stats_t*) */
 #define RR_STATS(s)				
+/* start one sampler thread per initialized socket, polling the energy counters every
+   period_us microseconds into a ring of (at least) size samples */
+#define RR_SAMPLER_START(period_us, size)
+/* stop the sampler threads. The samples remain available for draining. */
+#define RR_SAMPLER_STOP()
+/* extend the energy counters to 64 bits by polling them every period_ms 
+   milliseconds (0 for a period derived from the counter wrap time). To be used 
+   for windows that are long enough for the 32-bit counters to wrap. Outside the
+   windows: a window during which the accumulation starts or stops reports 0 J. */
+#define RR_ACCUMULATE_START(period_ms)
+/* stop extending the energy counters */
+#define RR_ACCUMULATE_STOP()
+/* also read the activity (RAPL_EDGE_ACTIVITY) and the thermal (RAPL_EDGE_THERMAL)
+   registers at the edges of the windows started afterwards */
+#define RR_EDGE_REGS(flags)
+/* start one helper thread per socket, so that RR_START_UNPROTECTED_ALL and 
+   RR_STOP_UNPROTECTED_ALL read all sockets at the same time, each socket with its 
+   own timestamps. Requires RR_INIT_ALL. */
+#define RR_PARALLEL_INIT()
+/* stop the per-socket helper threads */
+#define RR_PARALLEL_TERM()
+/* batch the counter reads of each start/stop edge in one io_uring submission */
+#define RR_URING_INIT()
+/* go back to one pread per counter */
+#define RR_URING_TERM()
+/* begin the region name (a string) on all the initialized sockets. Regions can be
+   nested and entered repeatedly; each region accumulates its calls, time, and energy. */
+#define RR_REGION_BEGIN(name)
+/* end the region name; it must be the innermost open region of the thread */
+#define RR_REGION_END(name)
+/* print the per-region table */
+#define RR_PRINT_REGIONS()
+/* register the calling thread under name for the energy attribution */
+#define RR_THREAD_REGISTER(name)
+/* unregister the calling thread (e.g., before it exits) */
+#define RR_THREAD_UNREGISTER()
+/* start an attribution window: the package and pp0 energy of each socket is split
+   between its registered threads in proportion to their on-cpu time */
+#define RR_ATTRIB_START()
+/* stop the attribution window and update the per-thread energies */
+#define RR_ATTRIB_STOP()
+/* print the per-thread table */
+#define RR_PRINT_THREADS()
+/* write the samples of the sampler and the region markers to the binary trace file
+   path (of at most max_records records) */
+#define RR_TRACE_OPEN(path, max_records)
+/* write a sample of all the initialized sockets to the trace */
+#define RR_TRACE_SAMPLE()
+/* close the trace, truncated to its records */
+#define RR_TRACE_CLOSE()
+/* serve the per-socket energy counters in the OpenMetrics format on 127.0.0.1:port */
+#define RR_EXPORT_HTTP(port)
+/* rewrite the node-exporter textfile path with the counters every period_ms */
+#define RR_EXPORT_TEXTFILE(path, period_ms)
+/* stop the exporters */
+#define RR_EXPORT_STOP()
+/* start the autotuner with config (rapl_tune_config_t*) */
+#define RR_TUNE_START(config)
+/* stop the autotuner and restore the PL1 limits that it found at its start */
+#define RR_TUNE_STOP()
 
 #else  /* RAPL_READ_ENABLE *********************************************************/
 
@@ -151,6 +211,119 @@ extern "C" {
 #define RR_STATS(s)				\
   rapl_read_stats(s)
 
+#define RR_SAMPLER_START(period_us, size)			\
+  if (rapl_read_sampler_start(period_us, size) < 0)		\
+    {								\
+      printf("[RAPL] Could not start the sampler\n");		\
+    }
+
+#define RR_SAMPLER_STOP()			\
+  rapl_read_sampler_stop()
+
+#define RR_ACCUMULATE_START(period_ms)				\
+  if (rapl_read_accumulate_start(period_ms) < 0)		\
+    {								\
+      printf("[RAPL] Could not start accumulating\n");	\
+    }
+
+#define RR_ACCUMULATE_STOP()			\
+  rapl_read_accumulate_stop()
+
+#define RR_EDGE_REGS(flags)			\
+  rapl_read_edge_regs(flags)
+
+#define RR_PARALLEL_INIT()					\
+  if (rapl_read_parallel_init() < 0)				\
+    {								\
+      printf("[RAPL] Could not start the parallel readers\n");	\
+    }
+
+#define RR_PARALLEL_TERM()			\
+  rapl_read_parallel_term()
+
+#define RR_URING_INIT()						\
+  if (rapl_read_uring_init() < 0)				\
+    {								\
+      printf("[RAPL] Could not enable io_uring reads\n");	\
+    }
+
+#define RR_URING_TERM()				\
+  rapl_read_uring_term()
+
+#define RR_REGION_BEGIN(name)				\
+  {							\
+    static int ___rr_region = -1;			\
+    if (___rr_region < 0)				\
+      {							\
+	___rr_region = rapl_read_region_id(name);	\
+      }							\
+    rapl_read_region_begin(___rr_region);		\
+  }
+
+#define RR_REGION_END(name)				\
+  {							\
+    static int ___rr_region = -1;			\
+    if (___rr_region < 0)				\
+      {							\
+	___rr_region = rapl_read_region_id(name);	\
+      }							\
+    rapl_read_region_end(___rr_region);			\
+  }
+
+#define RR_PRINT_REGIONS()			\
+  rapl_read_print_regions()
+
+#define RR_THREAD_REGISTER(name)		\
+  rapl_read_thread_register(name)
+
+#define RR_THREAD_UNREGISTER()			\
+  rapl_read_thread_unregister()
+
+#define RR_ATTRIB_START()			\
+  rapl_read_attrib_start()
+
+#define RR_ATTRIB_STOP()			\
+  rapl_read_attrib_stop()
+
+#define RR_PRINT_THREADS()			\
+  rapl_read_print_threads()
+
+#define RR_TRACE_OPEN(path, max_records)			\
+  if (rapl_read_trace_open(path, max_records) < 0)		\
+    {								\
+      printf("[RAPL] Could not open the trace\n");		\
+    }
+
+#define RR_TRACE_SAMPLE()			\
+  rapl_read_trace_sample()
+
+#define RR_TRACE_CLOSE()			\
+  rapl_read_trace_close()
+
+#define RR_EXPORT_HTTP(port)					\
+  if (rapl_read_export_http(NULL, port) < 0)			\
+    {								\
+      printf("[RAPL] Could not start the exporter\n");		\
+    }
+
+#define RR_EXPORT_TEXTFILE(path, period_ms)			\
+  if (rapl_read_export_textfile(path, period_ms) < 0)		\
+    {								\
+      printf("[RAPL] Could not start the exporter\n");		\
+    }
+
+#define RR_EXPORT_STOP()			\
+  rapl_read_export_stop()
+
+#define RR_TUNE_START(config)					\
+  if (rapl_read_tune_start(config) < 0)				\
+    {								\
+      printf("[RAPL] Could not start the autotuner\n");		\
+    }
+
+#define RR_TUNE_STOP()				\
+  rapl_read_tune_stop()
+
 #endif	/* RAPL_READ_ENABLE ***********************************************************/
 
 #define RAPL_PRINT_NOT     -1L
@@ -161,6 +334,16 @@ extern "C" {
 
 #define RR_NODE_ALL      -1
 
+/* the msr device of a cpu; can be overriden with a pattern in the RAPL_MSR_DEV 
+   environment variable (e.g., a regular file that stands in for the device), with 
+   one %d for the cpu and no other % */
+#define RAPL_MSR_DEV_DEFAULT "/dev/cpu/%d/msr"
+/* the powercap sysfs class; can be overriden with the RAPL_POWERCAP_ROOT environment
+   variable (e.g., a copy of the tree) */
+#define RAPL_POWERCAP_ROOT_DEFAULT "/sys/class/powercap"
+/* the perf_event RAPL PMU */
+#define RAPL_PERF_PMU "/sys/bus/event_source/devices/power"
+
 #define MSR_RAPL_POWER_UNIT		0x606
 
 /*
@@ -191,6 +374,42 @@ extern "C" {
 #define MSR_DRAM_PERF_STATUS		0x61B
 #define MSR_DRAM_POWER_INFO		0x61C
 
+/* PSys (platform) RAPL Domain */
+#define MSR_PLATFORM_ENERGY_STATUS	0x64D
+
+/* AMD Zen (family 17h and later) */
+#define MSR_AMD_RAPL_POWER_UNIT		0xC0010299
+#define MSR_AMD_CORE_ENERGY_STATUS	0xC001029A
+#define MSR_AMD_PKG_ENERGY_STATUS	0xC001029B
+
+/* Time stamp, frequency, and C-state residency counters (of a cpu, or of the 
+   package for MSR_PKG_*) */
+#define MSR_IA32_TSC			0x10
+#define MSR_IA32_MPERF			0xE7
+#define MSR_IA32_APERF			0xE8
+#define MSR_PKG_C2_RESIDENCY		0x60D
+#define MSR_PKG_C3_RESIDENCY		0x3F8
+#define MSR_PKG_C6_RESIDENCY		0x3F9
+#define MSR_PKG_C7_RESIDENCY		0x3FA
+#define MSR_CORE_C3_RESIDENCY		0x3FC
+#define MSR_CORE_C6_RESIDENCY		0x3FD
+#define MSR_CORE_C7_RESIDENCY		0x3FE
+
+/* Thermal status (of a cpu, or of the package) and TjMax */
+#define MSR_IA32_THERM_STATUS		0x19C
+#define MSR_IA32_PACKAGE_THERM_STATUS	0x1B1
+#define MSR_TEMPERATURE_TARGET		0x1A2
+
+/* the status (now) and log (since cleared) bits of the thermal status registers */
+#define RAPL_THERM_THROTTLE		(1 << 0)
+#define RAPL_THERM_THROTTLE_LOG		(1 << 1)
+#define RAPL_THERM_PROCHOT		(1 << 2)
+#define RAPL_THERM_PROCHOT_LOG		(1 << 3)
+#define RAPL_THERM_CRITICAL		(1 << 4)	/* of a cpu only */
+#define RAPL_THERM_CRITICAL_LOG		(1 << 5)
+#define RAPL_THERM_POWER_LIMIT		(1 << 10)
+#define RAPL_THERM_POWER_LIMIT_LOG	(1 << 11)
+
 /* RAPL UNIT BITMASK */
 #define POWER_UNIT_OFFSET	0
 #define POWER_UNIT_MASK		0x0F
@@ -206,9 +425,31 @@ extern "C" {
 #define CPU_IVYBRIDGE		58
 #define CPU_IVYBRIDGE_EP	62
 #define CPU_HASWELL		60
+#define CPU_HASWELL_ULT		69
+#define CPU_HASWELL_GT3E	70
+#define CPU_HASWELL_EP		63
+#define CPU_BROADWELL		61
+#define CPU_BROADWELL_GT3E	71
+#define CPU_BROADWELL_EP	79
+#define CPU_BROADWELL_DE	86
+#define CPU_SKYLAKE_MOBILE	78
+#define CPU_SKYLAKE		94
+#define CPU_SKYLAKE_X		85	/* also Cascade Lake and Cooper Lake */
+#define CPU_KABYLAKE_MOBILE	142
+#define CPU_KABYLAKE		158
+#define CPU_ICELAKE_MOBILE	126
+#define CPU_ICELAKE_X		106
+#define CPU_ICELAKE_D		108
+#define CPU_ALDERLAKE		151
+#define CPU_ALDERLAKE_MOBILE	154
+#define CPU_RAPTORLAKE		183
+#define CPU_RAPTORLAKE_P	186
+#define CPU_RAPTORLAKE_S	191
+#define CPU_SAPPHIRERAPIDS_X	143
+#define CPU_EMERALDRAPIDS_X	207
 
 int open_msr(int core);
-long long int read_msr(int fd, int which);
+long long int read_msr(int fd, uint32_t which);
 int detect_cpu(void);
 
 int rapl_read_init(int core);
@@ -225,7 +466,24 @@ void rapl_read_term();
 void rapl_read_print(int detailed);
 void rapl_read_print_all_sockets(int detailed, int protected);
 void rapl_read_print_sockets(int socket, int detailed, int protected);
-
+/* returns the polling period in ms, or -1 on error */
+int rapl_read_accumulate_start(uint32_t period_ms);
+void rapl_read_accumulate_stop();
+/* returns the number of helper threads, or -1 on error */
+int rapl_read_parallel_init();
+void rapl_read_parallel_term();
+int rapl_read_uring_init();
+void rapl_read_uring_term();
+
+/* the number of sockets (packages) of the machine, discovered at runtime */
+int rapl_read_num_sockets();
+/* the socket index of cpu, or -1 if the cpu is offline/unknown */
+int rapl_read_cpu_socket(int cpu);
+
+/* The statistics of RR_STATS, as in the original interface: one entry per socket, 
+   for the first NUMBER_OF_SOCKETS sockets of the machine, and the total (or average, 
+   for the duration) of all the sockets at index NUMBER_OF_SOCKETS. Needs no 
+   initialization. */
 typedef struct rapl_stats
 {
   double duration[NUMBER_OF_SOCKETS + 1];
@@ -245,6 +503,200 @@ typedef struct rapl_stats
 
 void rapl_read_stats(rapl_stats_t* s);
 
+/* the C-state residency counters */
+#define RAPL_CSTATE_PKG_C2  0
+#define RAPL_CSTATE_PKG_C3  1
+#define RAPL_CSTATE_PKG_C6  2
+#define RAPL_CSTATE_PKG_C7  3
+#define RAPL_CSTATE_CORE_C3 4
+#define RAPL_CSTATE_CORE_C6 5
+#define RAPL_CSTATE_CORE_C7 6
+#define RAPL_CSTATE_NUM     7
+
+/* Per-socket statistics of a session, sized for the sockets discovered at runtime. 
+   Each array has num_sockets + 1 entries: one per socket and the total (or average, 
+   for the duration) at index num_sockets (RAPL_STATS_TOTAL(s)). The arrays are 
+   allocated by rapl_read_session_stats_init() (or by rapl_read_session_stats() on a 
+   zeroed struct) and released with rapl_read_session_stats_free(). */
+typedef struct rapl_session_stats
+{
+  int num_sockets;
+  int clock;			/* the time base of the durations (RAPL_CLOCK_*) */
+  double clock_hz;		/* ticks per second of the time base */
+  double* duration;
+  double* energy_package;
+  double* energy_pp0;
+  double* energy_pp1;
+  double* energy_rest;
+  double* energy_dram;
+  double* energy_psys;		/* the platform, on the first socket (RR_START/RR_STOP only) */
+  double* energy_total;
+  double* power_package;
+  double* power_pp0;
+  double* power_pp1;
+  double* power_rest;
+  double* power_dram;
+  double* power_psys;
+  double* power_total;
+  /* the time that RAPL throttled each domain, as a percentage of the window (0 on 
+     the models without the MSR_*_PERF_STATUS counter of the domain) */
+  double* throttled_package;
+  double* throttled_pp0;
+  double* throttled_dram;
+  /* the percentage of the window in each package C-state (RAPL_CSTATE_PKG_*); 0 if
+     the model does not count it or without RAPL_EDGE_ACTIVITY. The RAPL_CSTATE_CORE_* entries are 0: the core 
+     counters are only read on the reading cpu (reader_residency). */
+  double* residency[RAPL_CSTATE_NUM];
+  /* the activity of the cpu that reads each socket (reader_cpu), which describes that
+     cpu only and not the socket: from its TSC, APERF, and MPERF, the effective 
+     frequency (GHz) while in C0 and the fraction of the window in C0, and the 
+     percentage of the window of its core in each core C-state (RAPL_CSTATE_CORE_*). 
+     The entry at num_sockets is the average over the reading cpus. 0 without access
+     to the registers or without RAPL_EDGE_ACTIVITY. */
+  int* reader_cpu;
+  double* reader_frequency;
+  double* reader_busy;
+  double* reader_residency[RAPL_CSTATE_NUM];
+  /* the temperatures (C) over the window, from its edges and from the samples of the
+     sampler in between: of the package, and of the core of the reading cpu. 0 without
+     access to the thermal registers or without RAPL_EDGE_THERMAL. */
+  double* temp_package_peak;
+  double* temp_package_avg;
+  double* temp_core_peak;
+  double* temp_core_avg;
+  /* the thermal events of the window: the RAPL_THERM_*_LOG bits of the package (bits
+     15:0) and of the core (bits 31:16) raised during the window */
+  uint32_t* thermal;
+  /* per core, with a backend that has per-core counters (amd), by the session 
+     functions (e.g., RR_START_UNPROTECTED_ALL/RR_STOP_UNPROTECTED_ALL) */
+  int num_cores;		/* 0 without per-core counters */
+  const int* core_cpu;		/* the cpu that reads each core */
+  double* energy_core;
+  double* power_core;
+} rapl_session_stats_t;
+
+#define RAPL_STATS_TOTAL(s) ((s)->num_sockets)
+
+int rapl_read_session_stats_init(rapl_session_stats_t* s);
+void rapl_read_session_stats_free(rapl_session_stats_t* s);
+
+/* The edges of a window always read the throttled-time counters; the activity 
+   (residency, reader_*) and thermal (temp_*, thermal) values cost up to 13 more 
+   register reads per socket and edge, so they are only read if enabled. A window 
+   reports them if they were enabled at its start. */
+#define RAPL_EDGE_ACTIVITY 1	/* TSC, APERF, MPERF, and the C-state residencies */
+#define RAPL_EDGE_THERMAL  2	/* the temperatures and the thermal status */
+
+void rapl_read_edge_regs(int flags);
+
+/* A session is an independent measurement window (package, pp0, and dram) on all the
+   initialized sockets, with its own start/stop timestamps and statistics. All the 
+   sessions share the opened counters, so they can overlap (e.g., one per request and
+   one for a background task). The RR_* macros use the default session. */
+typedef struct rapl_session rapl_session_t;
+
+/* a new session, or NULL on error. Release it with rapl_read_session_destroy(). */
+rapl_session_t* rapl_read_session_create();
+void rapl_read_session_destroy(rapl_session_t* ss);
+/* the session of the RR_* macros */
+rapl_session_t* rapl_read_default_session();
+void rapl_read_session_start(rapl_session_t* ss);
+void rapl_read_session_stop(rapl_session_t* ss);
+void rapl_read_session_stats(rapl_session_t* ss, rapl_session_stats_t* s);
+/* print the statistics of ss for socket, or for all sockets if socket == RR_NODE_ALL
+   (without the region and thread tables) */
+void rapl_read_session_print(rapl_session_t* ss, int socket, int detailed);
+
+/* Per-region statistics, summed over the initialized sockets. */
+typedef struct rapl_region_stats
+{
+  const char* name;
+  uint64_t calls;
+  double duration;		/* total time in the region (s) */
+  double energy_package;
+  double energy_pp0;
+  double energy_dram;
+  double energy_total;		/* package + dram */
+  double power_mean;		/* energy_total / duration */
+  double power_min;		/* of a single call */
+  double power_max;
+} rapl_region_stats_t;
+
+/* the id of the region name, registered on first use; -1 if there are too many */
+int rapl_read_region_id(const char* name);
+void rapl_read_region_begin(int id);
+void rapl_read_region_end(int id);
+int rapl_read_num_regions();
+int rapl_read_region_stats(int id, rapl_region_stats_t* s);
+void rapl_read_print_regions();
+
+/* Per-thread energy of the last attribution window. A thread is attributed to the 
+   socket it registered on (e.g., a pinned worker). */
+typedef struct rapl_thread_stats
+{
+  const char* name;
+  int socket;
+  double cpu_time;		/* on-cpu time in the window (s) */
+  double share;			/* of the on-cpu time of the registered threads of the socket */
+  double energy_package;
+  double energy_pp0;
+} rapl_thread_stats_t;
+
+/* register the calling thread; returns its id, or -1 on error */
+int rapl_read_thread_register(const char* name);
+void rapl_read_thread_unregister();
+void rapl_read_attrib_start();
+void rapl_read_attrib_stop();
+int rapl_read_num_threads();
+int rapl_read_thread_stats(int id, rapl_thread_stats_t* s);
+void rapl_read_print_threads();
+
+/* What the reads of the library cost, counted since the start (or the last reset).
+   With the msr backend, reads is the number of MSR reads. The counts are kept per
+   socket and summed by rapl_read_get_counters(); read_ns is only counted while 
+   enabled with rapl_read_time_counters(1), as it takes two timestamps per read. */
+typedef struct rapl_read_counters
+{
+  uint64_t reads;		/* energy counter values read */
+  uint64_t batches;		/* backend reads (e.g., one io_uring submission or perf read) */
+  uint64_t reg_reads;		/* register reads (policies, limits, ...) */
+  uint64_t read_ns;		/* total time spent in reads */
+} rapl_read_counters_t;
+
+void rapl_read_get_counters(rapl_read_counters_t* c);
+void rapl_read_time_counters(int enable);
+void rapl_read_reset_counters();
+
+/*********************************************************************************/
+/* benchmark harness: runs a workload at 1, step, 2 * step, ..., max_threads threads,
+   pinned per the_cores, and reports the energy efficiency of each thread count. 
+   Requires RR_INIT_ALL. */
+/*********************************************************************************/
+
+/* the workload of benchmark thread `thread` out of num_threads: performs operations 
+   until *stop becomes non-zero and returns the number of operations completed */
+typedef uint64_t (*rapl_bench_fn)(int thread, int num_threads, volatile int* stop, void* arg);
+
+typedef struct rapl_bench_result
+{
+  int num_threads;
+  uint64_t ops;
+  double duration;		/* s */
+  double throughput;		/* ops/s */
+  double energy;		/* package + dram of all sockets (J) */
+  double joules_per_op;
+  double ops_per_joule;
+  rapl_session_stats_t stats;	/* the per-socket statistics of the run (e.g., power_total) */
+} rapl_bench_result_t;
+
+/* the number of runs (results) of a sweep */
+int rapl_read_bench_num_runs(int max_threads, int step);
+/* run the sweep, each thread count for duration_ms; returns the number of results */
+int rapl_read_bench(rapl_bench_fn fn, void* arg, int max_threads, int step, uint32_t duration_ms,
+		    rapl_bench_result_t* results);
+void rapl_read_bench_free(rapl_bench_result_t* results, int n);
+void rapl_read_bench_print(const rapl_bench_result_t* results, int n);
+
 typedef uint64_t rapl_read_ticks;
 
 #if defined(__i386__)
@@ -274,6 +726,292 @@ typedef uint64_t rapl_read_ticks;
 
 #endif
 
+/*********************************************************************************/
+/* time base: the invariant TSC, calibrated against CLOCK_MONOTONIC_RAW at init, or 
+   CLOCK_MONOTONIC_RAW (in ns) if the TSC is not invariant. */
+/*********************************************************************************/
+
+#define RAPL_CLOCK_TSC            0
+#define RAPL_CLOCK_MONOTONIC_RAW  1
+
+/* the current timestamp in the time base used for the measurements */
+rapl_read_ticks rapl_read_timestamp();
+/* convert a difference of timestamps to seconds */
+double rapl_read_ticks_to_seconds(rapl_read_ticks ticks);
+/* the time base used for the measurements (RAPL_CLOCK_*) */
+int rapl_read_clock();
+const char* rapl_read_clock_name(int clock);
+
+/*********************************************************************************/
+/* backends: where the energy counters are read from. The backend is selected with
+   rapl_read_select_backend()/rapl_read_set_backend() before the initialization, or
+   with the RAPL_BACKEND environment variable; by default it is "msr" if the msr 
+   device can be read, and "powercap" otherwise. */
+/*********************************************************************************/
+
+#define RAPL_DOMAIN_PKG   0
+#define RAPL_DOMAIN_PP0   1
+#define RAPL_DOMAIN_PP1   2
+#define RAPL_DOMAIN_DRAM  3
+#define RAPL_DOMAIN_PSYS  4	/* the whole platform; reported on the first socket */
+#define RAPL_DOMAIN_NUM   5
+
+/* the RAPL capabilities of a processor model (family 6) */
+typedef struct rapl_cpu_info
+{
+  int model;
+  const char* name;
+  int domains;			/* bitmask of (1 << RAPL_DOMAIN_*) */
+  double units[RAPL_DOMAIN_NUM];	/* fixed energy units (J); 0 for MSR_RAPL_POWER_UNIT */
+  int pkg_perf_status;		/* MSR_PKG_PERF_STATUS (package throttled time) */
+  int pp0_perf_status;		/* MSR_PP0_PERF_STATUS (core throttled time) */
+  int dram_perf_status;		/* MSR_DRAM_PERF_STATUS (dram throttled time) */
+  int cstates;			/* bitmask of (1 << RAPL_CSTATE_*) with a counter */
+} rapl_cpu_info_t;
+
+/* the capabilities of model, or NULL if it is not supported */
+const rapl_cpu_info_t* rapl_read_cpu_info(int model);
+
+typedef struct rapl_backend
+{
+  const char* name;
+  /* called once, before any socket is opened: mark the domains that the backend 
+     provides and set their units (J per count) and ranges (the raw value wraps to 0 
+     at range; 0 for a 64-bit counter). Returns 0 on success. */
+  int (*init)(int* available, double* units, uint64_t* range);
+  /* open the counters of socket, from cpu (a cpu of the socket). Returns 0 on success. */
+  int (*open)(int socket, int cpu);
+  void (*close)(int socket);
+  /* raw values of the n domains of each socket in [s0, s1), into out[(s - s0) * n + i] */
+  void (*read)(int s0, int s1, const int* domains, int n, uint64_t* out);
+  /* a model-specific register of socket (power info, limits, ...), or NULL if the 
+     backend has no access to registers. Returns 0 on success. */
+  int (*read_reg)(int socket, uint32_t reg, uint64_t* val);
+  /* the machine the counters come from, instead of the one in sysfs: the number of 
+     cpus and the package id of each cpu (malloc'ed; -1 if offline). NULL for the 
+     sysfs topology. Returns 0 on success. */
+  int (*topology)(int* num_cpus, int** pkg_of_cpu);
+  /* write a model-specific register of socket, or NULL if the backend cannot write 
+     registers. Returns 0 on success. */
+  int (*write_reg)(int socket, uint32_t reg, uint64_t val);
+  /* per-core energy counters, or NULL: open the counters of the cores, each read from 
+     the cpu in (*core_cpu)[core] (malloc'ed), and set their units and range. Called 
+     once, after init. Returns 0 on success. */
+  int (*cores)(int* num_cores, int** core_cpu, double* units, uint64_t* range);
+  /* raw values of all the cores, into out[core] */
+  void (*read_cores)(uint64_t* out);
+} rapl_backend_t;
+
+/* the energy status MSRs through the msr device */
+extern const rapl_backend_t rapl_backend_msr;
+/* the energy_uj files of the powercap intel-rapl zones */
+extern const rapl_backend_t rapl_backend_powercap;
+/* the energy-* events of the perf_event power PMU, one group per socket */
+extern const rapl_backend_t rapl_backend_perf;
+/* recorded or synthetic counters from the trace file in RAPL_REPLAY */
+extern const rapl_backend_t rapl_backend_replay;
+/* the package and per-core energy MSRs of AMD Zen through the msr device */
+extern const rapl_backend_t rapl_backend_amd;
+
+/* select a built-in backend by name, before any other call to the library. Returns 0
+   on success. */
+int rapl_read_select_backend(const char* name);
+int rapl_read_set_backend(const rapl_backend_t* backend);
+/* the name of the backend in use ("none" before the initialization) */
+const char* rapl_read_backend_name();
+/* 1 if the backend provides the domain (RAPL_DOMAIN_*) */
+int rapl_read_domain_available(int domain);
+
+/*********************************************************************************/
+/* binary trace: a header followed by fixed-size records, appended to an mmap'd file
+   without any formatting (see raplread-decode for CSV/JSON). All the fields are in
+   the byte order of the machine that wrote the trace. */
+/*********************************************************************************/
+
+#define RAPL_TRACE_MAGIC    "RAPLTRC"
+#define RAPL_TRACE_VERSION  1
+
+typedef struct rapl_trace_header
+{
+  char magic[8];		/* RAPL_TRACE_MAGIC */
+  uint32_t version;
+  uint32_t header_size;		/* the offset of the first record */
+  uint32_t record_size;
+  uint32_t num_sockets;
+  uint32_t clock;		/* the time base of the timestamps (RAPL_CLOCK_*) */
+  uint32_t domains;		/* bit d is set if the domain d (RAPL_DOMAIN_*) is available */
+  double clock_hz;		/* ticks per second of the timestamps */
+  double units[RAPL_DOMAIN_NUM];	/* J per count */
+  uint64_t range[RAPL_DOMAIN_NUM];	/* the raw values wrap at range (0 for 64 bits) */
+  uint64_t capacity;		/* records */
+  uint64_t count;		/* records written; set when the trace is closed */
+  uint64_t dropped;		/* records dropped because the trace was full */
+  uint64_t start_ts;		/* the timestamp when the trace was opened */
+  char backend[16];
+  uint8_t reserved[88];		/* the header is 256 bytes */
+} rapl_trace_header_t;
+
+#define RAPL_TRACE_SAMPLE        1	/* a sample of a socket */
+#define RAPL_TRACE_REGION_BEGIN  2	/* id is the region id */
+#define RAPL_TRACE_REGION_END    3
+#define RAPL_TRACE_REGION_NAME   4	/* name is the name of region id */
+
+#define RAPL_TRACE_F_ACC         1	/* 64-bit accumulated values (no wrap) */
+
+typedef struct rapl_trace_record
+{
+  uint8_t type;			/* RAPL_TRACE_*; 0 for a record that is not written (yet) */
+  uint8_t flags;
+  uint16_t socket;
+  uint32_t id;
+  uint64_t ts;
+  union
+  {
+    uint64_t energy[RAPL_DOMAIN_NUM];	/* raw values, indexed by RAPL_DOMAIN_* */
+    char name[48];
+  };
+} rapl_trace_record_t;
+
+/* create the trace file path with room for max_records records. Requires an 
+   initialized library. Returns 0 on success. */
+int rapl_read_trace_open(const char* path, uint64_t max_records);
+void rapl_read_trace_sample();
+/* close the trace; no records are written after it returns */
+void rapl_read_trace_close();
+/* the number of records dropped because the trace was full */
+uint64_t rapl_read_trace_dropped();
+
+/*********************************************************************************/
+/* power limits: read and write the RAPL power limits of a socket. Requires a backend
+   that can write registers (msr, replay). The original value of each register is 
+   saved before its first write and restored by rapl_read_restore_power_limits(),
+   rapl_read_term(), and at exit. */
+/*********************************************************************************/
+
+#define RAPL_LIMIT_PKG_PL1  0	/* MSR_PKG_RAPL_POWER_LIMIT, bits 23:0 */
+#define RAPL_LIMIT_PKG_PL2  1	/* MSR_PKG_RAPL_POWER_LIMIT, bits 55:32 */
+#define RAPL_LIMIT_DRAM     2	/* MSR_DRAM_POWER_LIMIT */
+#define RAPL_LIMIT_PP0      3	/* MSR_PP0_POWER_LIMIT */
+#define RAPL_LIMIT_NUM      4
+
+typedef struct rapl_power_limit
+{
+  double power;			/* W */
+  double window;		/* s, the averaging time window */
+  int enabled;
+  int clamped;			/* allowed to go below the requested p-states */
+  int locked;			/* read only: locked until the next reset (bit 63 or 31) */
+} rapl_power_limit_t;
+
+/* Returns 0 on success */
+int rapl_read_get_power_limit(int socket, int limit, rapl_power_limit_t* l);
+/* set power, window, enabled, and clamped of the limit (rounded to the units of the 
+   register). Fails if the register is locked. Returns 0 on success. */
+int rapl_read_set_power_limit(int socket, int limit, const rapl_power_limit_t* l);
+/* write back the original value of every power-limit register that was written */
+void rapl_read_restore_power_limits();
+
+/*********************************************************************************/
+/* autotuner: a controller thread that measures the operations per Joule of the 
+   application in windows of period_ms and hill-climbs over the number of active 
+   threads and the PL1 cap of the initialized sockets, one step at a time, keeping a 
+   step only if it improves the efficiency. The application reports its operations
+   through ops and applies the thread count in apply. Requires RR_INIT_ALL. */
+/*********************************************************************************/
+
+typedef struct rapl_tune_config
+{
+  int min_threads;		/* >= 1 */
+  int max_threads;		/* the start */
+  int thread_step;		/* 0 for 1 */
+  double min_cap;		/* W; max_cap <= 0 to keep the PL1 limits */
+  double max_cap;		/* W, the start */
+  double cap_step;		/* W */
+  uint32_t period_ms;		/* the measurement window of each configuration */
+  /* the (monotonic) number of operations completed by the application */
+  uint64_t (*ops)(void* arg);
+  /* run num_threads active threads from now on (cap is already applied) */
+  void (*apply)(int num_threads, double cap, void* arg);
+  void* arg;
+} rapl_tune_config_t;
+
+typedef struct rapl_tune_state
+{
+  int num_threads;		/* the best configuration so far */
+  double cap;			/* W, 0 if not tuned */
+  double ops_per_joule;		/* in its last window */
+  uint64_t windows;		/* measured */
+  uint64_t moves;		/* steps kept */
+} rapl_tune_state_t;
+
+int rapl_read_tune_start(const rapl_tune_config_t* c);
+/* stop the controller and restore the PL1 limits of the sockets as they were when it
+   started (the limits set by the application before are kept) */
+void rapl_read_tune_stop();
+void rapl_read_tune_get(rapl_tune_state_t* t);
+
+/*********************************************************************************/
+/* sampler: one thread per socket, pinned to the core that opened the socket's 
+   counters, that periodically stores timestamped raw counter values in a
+   single-producer/single-consumer lock-free ring. */
+/*********************************************************************************/
+
+typedef struct rapl_sample
+{
+  rapl_read_ticks ts;		/* rapl_read_timestamp() right after the reads */
+  uint32_t socket;
+  uint64_t energy[RAPL_DOMAIN_NUM]; /* raw backend values, indexed by RAPL_DOMAIN_* 
+				       (0 for the domains the backend does not provide) */
+  double temp_package;		/* C (0 without access to the thermal registers) */
+  double temp_core;		/* C, of the reading cpu */
+  uint16_t therm_package;	/* RAPL_THERM_* bits of the package */
+  uint16_t therm_core;		/* RAPL_THERM_* bits of the reading cpu */
+} rapl_sample_t;
+
+/* start the sampler threads; ring_size is rounded up to a power of two. A restart 
+   reuses the rings of the previous run, and their samples that were not drained, if
+   they are large enough (and fails for the sockets whose ring is too small). */
+int rapl_read_sampler_start(uint32_t period_us, uint32_t ring_size);
+/* stop and join the sampler threads */
+void rapl_read_sampler_stop();
+/* stop the sampler and release its rings (e.g., before a restart with larger rings).
+   Must not run concurrently with rapl_read_sampler_drain() or 
+   rapl_read_sampler_dropped(). */
+void rapl_read_sampler_free();
+/* move up to max samples of socket to out; returns the number of samples moved.
+   Must be called by a single consumer thread per socket. */
+size_t rapl_read_sampler_drain(int socket, rapl_sample_t* out, size_t max);
+/* number of samples of socket that were dropped because the ring was full */
+uint64_t rapl_read_sampler_dropped(int socket);
+/* energy (J) between two raw counter values of domain, wrap-corrected */
+double rapl_read_sample_energy(int domain, uint64_t before, uint64_t after);
+
+/* the latest state of a socket, kept by its sampler thread */
+typedef struct rapl_snapshot
+{
+  rapl_read_ticks ts;		/* the time of the last sample */
+  uint64_t samples;
+  double energy[RAPL_DOMAIN_NUM];	/* J since the first sample (monotonic) */
+  double power[RAPL_DOMAIN_NUM];	/* W over the last sampling period */
+} rapl_snapshot_t;
+
+/* the snapshot of socket, without reading the counters. Returns 0 on success, -1 if
+   the socket was not sampled yet. */
+int rapl_read_snapshot(int socket, rapl_snapshot_t* s);
+
+/*********************************************************************************/
+/* exporter: the snapshots of the sampler (started at a 1 s period if it is not 
+   running) as monotonic per-socket joule counters and watts, in the OpenMetrics 
+   text format. Scrapes never read the counters. */
+/*********************************************************************************/
+
+/* serve the metrics on addr:port (addr NULL for 127.0.0.1). Returns 0 on success. */
+int rapl_read_export_http(const char* addr, uint16_t port);
+/* atomically rewrite path (e.g., <node-exporter textfile dir>/raplread.prom) every 
+   period_ms. Returns 0 on success. */
+int rapl_read_export_textfile(const char* path, uint32_t period_ms);
+void rapl_read_export_stop();
+
 #ifdef __cplusplus
 }
 #endif
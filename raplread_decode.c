@@ -0,0 +1,399 @@
+/*   
+ *   File: raplread_decode.c
+ *   Author: Vasileios Trigonakis <vasileios.trigonakis@epfl.ch>
+ *   Description: 
+ *   raplread_decode.c is part of ASCYLIB
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014 Vasileios Trigonakis <vasileios.trigonakis@epfl.ch>
+ *	      	      Distributed Programming Lab (LPD), EPFL
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <getopt.h>
+
+#include "rapl_read.h"
+
+/* raplread-decode: streams a binary trace (RR_TRACE_OPEN) to CSV or JSON lines, 
+   with the energy and power integrated from the raw counter values */
+
+#define MAX_REGIONS  64
+#define MAX_NESTING  16
+
+static const char* domain_name[RAPL_DOMAIN_NUM] = { "pkg", "pp0", "pp1", "dram", "psys" };
+static const char* type_name[] = { "none", "sample", "begin", "end", "name" };
+
+typedef struct open_region
+{
+  int depth;
+  rapl_trace_record_t begin[MAX_NESTING];
+} open_region_t;
+
+typedef struct decoder
+{
+  rapl_trace_header_t h;
+  int json;
+  char names[MAX_REGIONS][48];
+  /* per socket */
+  int* have_last;
+  rapl_trace_record_t* last;	/* the previous sample */
+  double* total;		/* the integrated energy since the first sample (J), per domain */
+  open_region_t* open;		/* socket * MAX_REGIONS + id */
+} decoder_t;
+
+/* the energy (J) of domain d between two records */
+static double
+energy(const decoder_t* dc, int d, const rapl_trace_record_t* before, const rapl_trace_record_t* after)
+{
+  uint64_t delta = after->energy[d] - before->energy[d];
+  if (!((before->flags | after->flags) & RAPL_TRACE_F_ACC) && dc->h.range[d] != 0)
+    {
+      delta = (after->energy[d] + dc->h.range[d] - before->energy[d]) % dc->h.range[d];
+    }
+  return delta * dc->h.units[d];
+}
+
+static void
+print_header(const decoder_t* dc)
+{
+  if (dc->json)
+    {
+      printf("{\"version\":%u,\"backend\":\"%s\",\"sockets\":%u,\"clock_hz\":%.0f,\"records\":%" PRIu64 
+	     ",\"dropped\":%" PRIu64 ",\"domains\":[", dc->h.version, dc->h.backend, dc->h.num_sockets, 
+	     dc->h.clock_hz, dc->h.count, dc->h.dropped);
+      int d, first = 1;
+      for (d = 0; d < RAPL_DOMAIN_NUM; d++)
+	{
+	  if (dc->h.domains & (1 << d))
+	    {
+	      printf("%s{\"name\":\"%s\",\"units\":%.12g,\"range\":%" PRIu64 "}", first ? "" : ",", 
+		     domain_name[d], dc->h.units[d], dc->h.range[d]);
+	      first = 0;
+	    }
+	}
+      printf("]}\n");
+      return;
+    }
+
+  printf("record,socket,time_s,region,interval_s");
+  int d;
+  const char* cols[] = { "raw", "j", "w" };
+  size_t c;
+  for (c = 0; c < sizeof(cols) / sizeof(cols[0]); c++)
+    {
+      for (d = 0; d < RAPL_DOMAIN_NUM; d++)
+	{
+	  if (dc->h.domains & (1 << d))
+	    {
+	      printf(",%s_%s", domain_name[d], cols[c]);
+	    }
+	}
+    }
+  printf("\n");
+}
+
+/* one output line: the raw values of r, and j (J) and w (W) over interval (s) */
+static void
+print_record(const decoder_t* dc, const rapl_trace_record_t* r, const char* region, double interval, 
+	     const double* j, const double* w)
+{
+  const double t = (double) (int64_t) (r->ts - dc->h.start_ts) / dc->h.clock_hz;
+  int d;
+  if (dc->json)
+    {
+      printf("{\"record\":\"%s\",\"socket\":%u,\"time_s\":%.9f", type_name[r->type], r->socket, t);
+      if (region != NULL)
+	{
+	  printf(",\"region\":\"%s\"", region);
+	}
+      if (r->type == RAPL_TRACE_REGION_NAME)
+	{
+	  printf(",\"id\":%u}\n", r->id);
+	  return;
+	}
+      const char* sep = "";
+      printf(",\"raw\":{");
+      for (d = 0; d < RAPL_DOMAIN_NUM; d++)
+	{
+	  if (dc->h.domains & (1 << d))
+	    {
+	      printf("%s\"%s\":%" PRIu64, sep, domain_name[d], r->energy[d]);
+	      sep = ",";
+	    }
+	}
+      printf("}");
+      if (j != NULL)
+	{
+	  printf(",\"interval_s\":%.9f,\"energy_j\":{", interval);
+	  sep = "";
+	  for (d = 0; d < RAPL_DOMAIN_NUM; d++)
+	    {
+	      if (dc->h.domains & (1 << d))
+		{
+		  printf("%s\"%s\":%.9f", sep, domain_name[d], j[d]);
+		  sep = ",";
+		}
+	    }
+	  printf("},\"power_w\":{");
+	  sep = "";
+	  for (d = 0; d < RAPL_DOMAIN_NUM; d++)
+	    {
+	      if (dc->h.domains & (1 << d))
+		{
+		  printf("%s\"%s\":%.6f", sep, domain_name[d], w[d]);
+		  sep = ",";
+		}
+	    }
+	  printf("}");
+	}
+      printf("}\n");
+      return;
+    }
+
+  printf("%s,%u,%.9f,%s,", type_name[r->type], r->socket, t, region != NULL ? region : "");
+  if (j != NULL)
+    {
+      printf("%.9f", interval);
+    }
+  for (d = 0; d < RAPL_DOMAIN_NUM; d++)
+    {
+      if (dc->h.domains & (1 << d))
+	{
+	  if (r->type == RAPL_TRACE_REGION_NAME)
+	    {
+	      printf(",");
+	    }
+	  else
+	    {
+	      printf(",%" PRIu64, r->energy[d]);
+	    }
+	}
+    }
+  for (d = 0; d < RAPL_DOMAIN_NUM; d++)
+    {
+      if (dc->h.domains & (1 << d))
+	{
+	  if (j != NULL)
+	    {
+	      printf(",%.9f", j[d]);
+	    }
+	  else
+	    {
+	      printf(",");
+	    }
+	}
+    }
+  for (d = 0; d < RAPL_DOMAIN_NUM; d++)
+    {
+      if (dc->h.domains & (1 << d))
+	{
+	  if (w != NULL)
+	    {
+	      printf(",%.6f", w[d]);
+	    }
+	  else
+	    {
+	      printf(",");
+	    }
+	}
+    }
+  printf("\n");
+}
+
+/* samples: j is the energy integrated since the first sample of the socket, and w 
+   the power since the previous one. Region ends: j and w of the call. */
+static void
+decode(decoder_t* dc, const rapl_trace_record_t* r)
+{
+  double j[RAPL_DOMAIN_NUM] = { 0 }, w[RAPL_DOMAIN_NUM] = { 0 };
+  int d;
+  const char* region = (r->id < MAX_REGIONS && dc->names[r->id][0] != '\0') ? dc->names[r->id] : NULL;
+
+  if (r->type != RAPL_TRACE_REGION_NAME && r->socket >= dc->h.num_sockets)
+    {
+      return;
+    }
+
+  switch (r->type)
+    {
+    case RAPL_TRACE_SAMPLE:
+      {
+	const int s = r->socket;
+	double interval = 0;
+	if (dc->have_last[s])
+	  {
+	    const rapl_trace_record_t* p = dc->last + s;
+	    interval = (double) (r->ts - p->ts) / dc->h.clock_hz;
+	    for (d = 0; d < RAPL_DOMAIN_NUM; d++)
+	      {
+		if (dc->h.domains & (1 << d))
+		  {
+		    double e = energy(dc, d, p, r);
+		    dc->total[s * RAPL_DOMAIN_NUM + d] += e;
+		    w[d] = (interval > 0) ? e / interval : 0;
+		  }
+	      }
+	  }
+	for (d = 0; d < RAPL_DOMAIN_NUM; d++)
+	  {
+	    j[d] = dc->total[s * RAPL_DOMAIN_NUM + d];
+	  }
+	dc->last[s] = *r;
+	dc->have_last[s] = 1;
+	print_record(dc, r, NULL, interval, j, w);
+      }
+      break;
+    case RAPL_TRACE_REGION_BEGIN:
+      if (r->id < MAX_REGIONS)
+	{
+	  open_region_t* o = dc->open + r->socket * MAX_REGIONS + r->id;
+	  if (o->depth < MAX_NESTING)
+	    {
+	      o->begin[o->depth] = *r;
+	    }
+	  o->depth++;
+	}
+      print_record(dc, r, region, 0, NULL, NULL);
+      break;
+    case RAPL_TRACE_REGION_END:
+      {
+	open_region_t* o = (r->id < MAX_REGIONS) ? dc->open + r->socket * MAX_REGIONS + r->id : NULL;
+	if (o == NULL || o->depth == 0 || --o->depth >= MAX_NESTING)
+	  {
+	    print_record(dc, r, region, 0, NULL, NULL);
+	    break;
+	  }
+	const rapl_trace_record_t* b = o->begin + o->depth;
+	double interval = (double) (r->ts - b->ts) / dc->h.clock_hz;
+	for (d = 0; d < RAPL_DOMAIN_NUM; d++)
+	  {
+	    if (dc->h.domains & (1 << d))
+	      {
+		j[d] = energy(dc, d, b, r);
+		w[d] = (interval > 0) ? j[d] / interval : 0;
+	      }
+	  }
+	print_record(dc, r, region, interval, j, w);
+      }
+      break;
+    case RAPL_TRACE_REGION_NAME:
+      if (r->id < MAX_REGIONS)
+	{
+	  memcpy(dc->names[r->id], r->name, sizeof(dc->names[r->id]));
+	  dc->names[r->id][sizeof(dc->names[r->id]) - 1] = '\0';
+	}
+      print_record(dc, r, dc->names[r->id < MAX_REGIONS ? r->id : 0], 0, NULL, NULL);
+      break;
+    }
+}
+
+static void
+usage(const char* prog)
+{
+  printf("usage: %s [-f csv|json] <trace>\n", prog);
+}
+
+int
+main(int argc, char** argv)
+{
+  decoder_t dc;
+  memset(&dc, 0, sizeof(dc));
+
+  int c;
+  while ((c = getopt(argc, argv, "f:h")) != -1)
+    {
+      switch (c)
+	{
+	case 'f':
+	  if (!strcmp(optarg, "json"))
+	    {
+	      dc.json = 1;
+	    }
+	  else if (strcmp(optarg, "csv"))
+	    {
+	      usage(argv[0]);
+	      return 1;
+	    }
+	  break;
+	default:
+	  usage(argv[0]);
+	  return (c == 'h') ? 0 : 1;
+	}
+    }
+  if (optind != argc - 1)
+    {
+      usage(argv[0]);
+      return 1;
+    }
+
+  FILE* f = fopen(argv[optind], "rb");
+  if (f == NULL)
+    {
+      fprintf(stderr, "Cannot open %s\n", argv[optind]);
+      return 1;
+    }
+  if (fread(&dc.h, sizeof(dc.h), 1, f) != 1 || memcmp(dc.h.magic, RAPL_TRACE_MAGIC, sizeof(RAPL_TRACE_MAGIC)))
+    {
+      fprintf(stderr, "%s is not a raplread trace\n", argv[optind]);
+      return 1;
+    }
+  if (dc.h.version != RAPL_TRACE_VERSION || dc.h.record_size != sizeof(rapl_trace_record_t) 
+      || dc.h.clock_hz <= 0)
+    {
+      fprintf(stderr, "Unsupported trace version %u (record size %u)\n", dc.h.version, dc.h.record_size);
+      return 1;
+    }
+  if (fseek(f, dc.h.header_size, SEEK_SET) < 0)
+    {
+      return 1;
+    }
+
+  const int num_sockets = dc.h.num_sockets;
+  dc.have_last = (int*) calloc(num_sockets, sizeof(int));
+  dc.last = (rapl_trace_record_t*) calloc(num_sockets, sizeof(rapl_trace_record_t));
+  dc.total = (double*) calloc(num_sockets * RAPL_DOMAIN_NUM, sizeof(double));
+  dc.open = (open_region_t*) calloc(num_sockets * MAX_REGIONS, sizeof(open_region_t));
+  if (dc.have_last == NULL || dc.last == NULL || dc.total == NULL || dc.open == NULL)
+    {
+      return 1;
+    }
+
+  print_header(&dc);
+
+  /* the count is only set when the trace is closed: otherwise, decode up to the end
+     of the file, skipping the records that are not written yet */
+  uint64_t i;
+  rapl_trace_record_t r;
+  for (i = 0; (dc.h.count == 0 || i < dc.h.count) && fread(&r, sizeof(r), 1, f) == 1; i++)
+    {
+      if (r.type >= RAPL_TRACE_SAMPLE && r.type <= RAPL_TRACE_REGION_NAME)
+	{
+	  decode(&dc, &r);
+	}
+    }
+
+  if (dc.h.dropped > 0)
+    {
+      fprintf(stderr, "%" PRIu64 " records were dropped (the trace was full)\n", dc.h.dropped);
+    }
+  fclose(f);
+  return 0;
+}
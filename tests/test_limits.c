@@ -0,0 +1,45 @@
+/*
+ *   File: test_limits.c
+ *   Description:
+ *   runs the library on a replay fixture without the PP0 domain 
+ *   (tests/replay_nopp0.trace) and checks that its PP0 limit is rejected, while the 
+ *   package and DRAM limits are still read
+ */
+
+#include "../rapl_read.h"
+
+static int failed = 0;
+
+#define CHECK(cond, ...)			\
+  if (!(cond))					\
+    {						\
+      printf("FAIL: " __VA_ARGS__);		\
+      printf("\n");				\
+      failed = 1;				\
+    }
+
+int
+main()
+{
+  RR_INIT_ALL();
+  CHECK(!strcmp(rapl_read_backend_name(), "replay"), "backend %s", rapl_read_backend_name());
+  CHECK(!rapl_read_domain_available(RAPL_DOMAIN_PP0), "PP0 domain available");
+  if (failed)
+    {
+      return 1;
+    }
+
+  rapl_power_limit_t l;
+  memset(&l, 0, sizeof(l));
+  CHECK(rapl_read_get_power_limit(0, RAPL_LIMIT_PKG_PL1, &l) == 0, "cannot read PL1");
+  CHECK(rapl_read_get_power_limit(0, RAPL_LIMIT_DRAM, &l) == 0, "cannot read the DRAM limit");
+  CHECK(rapl_read_get_power_limit(0, RAPL_LIMIT_PP0, &l) < 0, "PP0 limit read without a PP0 domain");
+  l.power = 20;
+  l.window = 1;
+  l.enabled = 1;
+  CHECK(rapl_read_set_power_limit(0, RAPL_LIMIT_PP0, &l) < 0, "PP0 limit set without a PP0 domain");
+
+  RR_TERM();
+  printf("%s: %s\n", __FILE__, failed ? "FAILED" : "ok");
+  return failed;
+}
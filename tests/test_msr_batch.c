@@ -0,0 +1,119 @@
+/*
+ *   File: test_msr_batch.c
+ *   Description:
+ *   checks the batched MSR reads (pread and io_uring) against single preads, on a
+ *   regular file that stands in for the msr device (RAPL_MSR_DEV)
+ */
+
+/* the batch reads and the path pattern are internal */
+#include "../rapl_read.c"
+
+static int failed = 0;
+
+#define CHECK(cond, ...)			\
+  if (!(cond))					\
+    {						\
+      printf("FAIL: " __VA_ARGS__);		\
+      printf("\n");				\
+      failed = 1;				\
+    }
+
+static const uint32_t regs[] =
+  {
+    MSR_RAPL_POWER_UNIT, MSR_PKG_ENERGY_STATUS, MSR_PP0_ENERGY_STATUS, MSR_PP1_ENERGY_STATUS,
+    MSR_DRAM_ENERGY_STATUS, MSR_PLATFORM_ENERGY_STATUS, MSR_PKG_PERF_STATUS, MSR_PP0_PERF_STATUS,
+    MSR_DRAM_PERF_STATUS, MSR_PKG_RAPL_POWER_LIMIT, MSR_IA32_TSC, MSR_IA32_MPERF, MSR_IA32_APERF,
+    MSR_IA32_PACKAGE_THERM_STATUS, MSR_AMD_RAPL_POWER_UNIT, MSR_AMD_CORE_ENERGY_STATUS,
+    MSR_AMD_PKG_ENERGY_STATUS
+  };
+#define NUM_REGS (int) (sizeof(regs) / sizeof(regs[0]))
+
+static void
+check_batch(const char* name, int fd, const uint64_t* expected)
+{
+  int fds[NUM_REGS];
+  uint32_t msrs[NUM_REGS];
+  uint64_t vals[NUM_REGS];
+  int i;
+  for (i = 0; i < NUM_REGS; i++)
+    {
+      fds[i] = fd;
+      msrs[i] = regs[i];
+      vals[i] = 0;
+    }
+  rapl_msr_read_batch(NUM_REGS, fds, msrs, vals);
+  for (i = 0; i < NUM_REGS; i++)
+    {
+      CHECK(vals[i] == expected[i], "%s: register 0x%x: %" PRIx64 " instead of %" PRIx64,
+	    name, regs[i], vals[i], expected[i]);
+    }
+}
+
+int
+main()
+{
+  char dir[] = "/tmp/raplread-msr-XXXXXX";
+  if (mkdtemp(dir) == NULL)
+    {
+      perror("mkdtemp");
+      return 1;
+    }
+  char pattern[BUFSIZ], file[BUFSIZ], path[BUFSIZ];
+  snprintf(pattern, sizeof(pattern), "%s/msr%%d", dir);
+  snprintf(file, sizeof(file), "%s/msr3", dir);
+
+  /* the path pattern: one %d, and nothing else is a conversion */
+  setenv("RAPL_MSR_DEV", pattern, 1);
+  rapl_msr_path(3, path, sizeof(path));
+  CHECK(!strcmp(path, file), "path %s instead of %s", path, file);
+  setenv("RAPL_MSR_DEV", "/tmp/%s%n/%d", 1);
+  rapl_msr_path(3, path, sizeof(path));
+  CHECK(!strcmp(path, "/dev/cpu/3/msr"), "pattern with %%s accepted: %s", path);
+  setenv("RAPL_MSR_DEV", "/tmp/%d/%d", 1);
+  rapl_msr_path(3, path, sizeof(path));
+  CHECK(!strcmp(path, "/dev/cpu/3/msr"), "pattern with two %%d accepted: %s", path);
+  setenv("RAPL_MSR_DEV", pattern, 1);
+
+  /* a sparse file with a distinct value at the offset of each register (the last, 
+     0xC001029B, does not fit in an int) */
+  int fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  CHECK(fd >= 0, "cannot create %s", file);
+  uint64_t expected[NUM_REGS];
+  int i;
+  for (i = 0; fd >= 0 && i < NUM_REGS; i++)
+    {
+      uint64_t v = 0x0123456789abcdefULL ^ ((uint64_t) regs[i] << 16) ^ (uint64_t) i;
+      CHECK(pwrite(fd, &v, sizeof(v), (off_t) regs[i]) == sizeof(v), "pwrite 0x%x", regs[i]);
+    }
+  if (fd >= 0)
+    {
+      close(fd);
+      fd = open_msr(3);
+      /* adjacent registers overlap in the file: the reference is what pread sees */
+      for (i = 0; i < NUM_REGS; i++)
+	{
+	  expected[i] = (uint64_t) read_msr(fd, regs[i]);
+	}
+      uint64_t v = 0x0123456789abcdefULL ^ ((uint64_t) regs[NUM_REGS - 1] << 16) ^ (uint64_t) (NUM_REGS - 1);
+      CHECK(expected[NUM_REGS - 1] == v, "pread 0x%x: %" PRIx64 " instead of %" PRIx64,
+	    regs[NUM_REGS - 1], expected[NUM_REGS - 1], v);
+
+      check_batch("pread", fd, expected);
+      if (rapl_read_uring_init() == 0)
+	{
+	  /* more reads than ring entries: submitted in chunks */
+	  check_batch("io_uring", fd, expected);
+	  rapl_read_uring_term();
+	}
+      else
+	{
+	  printf("io_uring is not available, only the pread batch was checked\n");
+	}
+      close(fd);
+    }
+
+  unlink(file);
+  rmdir(dir);
+  printf("%s: %s\n", __FILE__, failed ? "FAILED" : "ok");
+  return failed;
+}
@@ -0,0 +1,227 @@
+/*
+ *   File: test_replay.c
+ *   Description:
+ *   runs the library on the replay fixture (tests/replay.trace, through RAPL_BACKEND
+ *   and RAPL_REPLAY) and checks the energy and power of the windows against the
+ *   values that the fixture encodes; writes the binary trace argv[1] for
+ *   raplread-decode (see test_replay.sh)
+ */
+
+#include "../rapl_read.h"
+
+static int failed = 0;
+
+#define CHECK(cond, ...)			\
+  if (!(cond))					\
+    {						\
+      printf("FAIL: " __VA_ARGS__);		\
+      printf("\n");				\
+      failed = 1;				\
+    }
+
+/* the energy units of the fixture (2^-14 J) */
+#define UNITS 0.00006103515625
+/* the power of the synthetic socket 1 (W) */
+#define PKG_W  100.0
+#define PP0_W  40.0
+#define DRAM_W 10.0
+
+static uint64_t
+tune_ops(void* arg)
+{
+  return ++*(uint64_t*) arg;
+}
+
+static void
+tune_apply(int num_threads, double cap, void* arg)
+{
+}
+
+static int
+near(double v, double expected, double tolerance)
+{
+  return fabs(v - expected) <= tolerance * expected;
+}
+
+int
+main(int argc, char** argv)
+{
+  if (argc < 2)
+    {
+      printf("usage: %s <binary trace to write>\n", argv[0]);
+      return 1;
+    }
+
+  /* before the init, the sampler has no sockets to allocate its rings for */
+  CHECK(rapl_read_sampler_start(10000, 64) < 0, "sampler started before the init");
+
+  RR_INIT_ALL();
+  CHECK(rapl_read_num_sockets() == 2, "%d sockets instead of 2", rapl_read_num_sockets());
+  CHECK(!strcmp(rapl_read_backend_name(), "replay"), "backend %s", rapl_read_backend_name());
+  if (failed)
+    {
+      return 1;
+    }
+
+  /* a window across one wrap of both sockets: socket 0 replays the rows 0 and 1 of
+     the fixture (exact energies), socket 1 counts at its synthetic power */
+  RR_START_UNPROTECTED_ALL();
+  usleep(200000);
+  RR_STOP_UNPROTECTED_ALL();
+
+  rapl_session_stats_t s;
+  memset(&s, 0, sizeof(s));
+  rapl_read_session_stats(rapl_read_default_session(), &s);
+  const int total = RAPL_STATS_TOTAL(&s);
+  CHECK(fabs(s.energy_package[0] - 16384 * UNITS) < 1e-9, "socket 0 package: %f J", s.energy_package[0]);
+  CHECK(fabs(s.energy_pp0[0] - 1000 * UNITS) < 1e-9, "socket 0 pp0: %f J", s.energy_pp0[0]);
+  CHECK(fabs(s.energy_dram[0] - 16384 * UNITS) < 1e-9, "socket 0 dram: %f J", s.energy_dram[0]);
+  CHECK(near(s.duration[1], 0.2, 0.5), "duration: %f s", s.duration[1]);
+  CHECK(near(s.power_package[1], PKG_W, 0.05), "socket 1 package: %f W", s.power_package[1]);
+  CHECK(near(s.power_pp0[1], PP0_W, 0.05), "socket 1 pp0: %f W", s.power_pp0[1]);
+  CHECK(near(s.power_dram[1], DRAM_W, 0.05), "socket 1 dram: %f W", s.power_dram[1]);
+  CHECK(fabs(s.energy_total[total] - s.energy_total[0] - s.energy_total[1]) < 1e-9,
+	"total energy: %f J", s.energy_total[total]);
+
+  /* the fixed arrays of RR_STATS: the first NUMBER_OF_SOCKETS sockets and the total */
+  rapl_stats_t fs;
+  RR_STATS(&fs);
+  CHECK(fabs(fs.energy_package[0] - s.energy_package[0]) < 1e-9, "RR_STATS socket 0: %f J",
+	fs.energy_package[0]);
+  CHECK(fabs(fs.energy_total[NUMBER_OF_SOCKETS] - s.energy_total[total]) < 1e-9,
+	"RR_STATS total: %f J", fs.energy_total[NUMBER_OF_SOCKETS]);
+  rapl_read_session_stats_free(&s);
+
+  /* a window of several wraps of socket 1 (61 J at 100 W wrap every 0.6 s), only
+     correct with the 64-bit accumulation */
+  RR_ACCUMULATE_START(20);
+  RR_START_UNPROTECTED_ALL();
+  usleep(1500000);
+  RR_STOP_UNPROTECTED_ALL();
+  RR_ACCUMULATE_STOP();
+  memset(&s, 0, sizeof(s));
+  rapl_read_session_stats(rapl_read_default_session(), &s);
+  CHECK(near(s.energy_package[1], PKG_W * s.duration[1], 0.05), "accumulated socket 1 package: %f J in %f s",
+	s.energy_package[1], s.duration[1]);
+  CHECK(near(s.power_dram[1], DRAM_W, 0.05), "accumulated socket 1 dram: %f W", s.power_dram[1]);
+  rapl_read_session_stats_free(&s);
+
+  /* a window in which the accumulation starts (or stops) has a raw and an accumulated
+     edge: it reports no energy rather than their difference */
+  RR_START_UNPROTECTED_ALL();
+  RR_ACCUMULATE_START(20);
+  usleep(100000);
+  RR_STOP_UNPROTECTED_ALL();
+  memset(&s, 0, sizeof(s));
+  rapl_read_session_stats(rapl_read_default_session(), &s);
+  CHECK(s.energy_package[0] == 0 && s.energy_package[1] == 0, "window with RR_ACCUMULATE_START: %f J, %f J",
+	s.energy_package[0], s.energy_package[1]);
+  RR_START_UNPROTECTED_ALL();
+  RR_ACCUMULATE_STOP();
+  usleep(100000);
+  RR_STOP_UNPROTECTED_ALL();
+  rapl_read_session_stats(rapl_read_default_session(), &s);
+  CHECK(s.energy_package[1] == 0, "window with RR_ACCUMULATE_STOP: %f J", s.energy_package[1]);
+  RR_START_UNPROTECTED_ALL();
+  usleep(100000);
+  RR_STOP_UNPROTECTED_ALL();
+  rapl_read_session_stats(rapl_read_default_session(), &s);
+  CHECK(near(s.power_package[1], PKG_W, 0.05), "socket 1 package after the accumulation: %f W", 
+	s.power_package[1]);
+  rapl_read_session_stats_free(&s);
+
+  /* the activity registers are only read at the edges if enabled, and only those that
+     the fixture has (TSC, APERF, MPERF, and core C6; the CPU table gives the model 
+     more, which the probe at the init drops) */
+  rapl_read_counters_t c0, c1;
+  rapl_read_get_counters(&c0);
+  RR_START_UNPROTECTED_ALL();
+  usleep(100000);
+  RR_STOP_UNPROTECTED_ALL();
+  rapl_read_get_counters(&c1);
+  memset(&s, 0, sizeof(s));
+  rapl_read_session_stats(rapl_read_default_session(), &s);
+  CHECK(c1.reg_reads == c0.reg_reads, "%" PRIu64 " register reads without RR_EDGE_REGS", 
+	c1.reg_reads - c0.reg_reads);
+  CHECK(s.reader_busy[0] == 0, "reader busy without RR_EDGE_REGS: %f", s.reader_busy[0]);
+  RR_EDGE_REGS(RAPL_EDGE_ACTIVITY);
+  rapl_read_get_counters(&c0);
+  RR_START_UNPROTECTED_ALL();
+  usleep(100000);
+  RR_STOP_UNPROTECTED_ALL();
+  rapl_read_get_counters(&c1);
+  rapl_read_session_stats(rapl_read_default_session(), &s);
+  CHECK(c1.reg_reads - c0.reg_reads == 2 * 2 * 4, "%" PRIu64 " register reads with RAPL_EDGE_ACTIVITY", 
+	c1.reg_reads - c0.reg_reads);
+  CHECK(near(s.reader_busy[0], 0.6, 0.05), "reader busy: %f", s.reader_busy[0]);
+  CHECK(near(s.reader_frequency[0], 3.0, 0.05), "reader frequency: %f GHz", s.reader_frequency[0]);
+  CHECK(near(s.reader_residency[RAPL_CSTATE_CORE_C6][0], 40, 0.05), "reader core C6 residency: %f %%",
+	s.reader_residency[RAPL_CSTATE_CORE_C6][0]);
+  RR_EDGE_REGS(0);
+  rapl_read_session_stats_free(&s);
+
+  /* the autotuner caps PL1 while it runs, and restores the limit that the application
+     had set before it started (not the original one) */
+  rapl_power_limit_t l;
+  CHECK(rapl_read_get_power_limit(0, RAPL_LIMIT_PKG_PL1, &l) == 0, "cannot read PL1");
+  l.power = 50;
+  l.window = 1;
+  l.enabled = 1;
+  CHECK(rapl_read_set_power_limit(0, RAPL_LIMIT_PKG_PL1, &l) == 0, "cannot set PL1");
+  uint64_t ops = 0;
+  rapl_tune_config_t tc = { 1, 2, 1, 60, 80, 10, 20, tune_ops, tune_apply, &ops };
+  RR_TUNE_START(&tc);
+  usleep(100000);
+  CHECK(rapl_read_get_power_limit(0, RAPL_LIMIT_PKG_PL1, &l) == 0 && l.power >= 60, 
+	"PL1 not capped while tuning: %f W", l.power);
+  RR_TUNE_STOP();
+  CHECK(rapl_read_get_power_limit(0, RAPL_LIMIT_PKG_PL1, &l) == 0 && l.power == 50 && l.enabled, 
+	"PL1 after tuning: %f W instead of 50 W", l.power);
+
+  /* a restart of the sampler keeps the rings: the samples of the first run are still
+     drained after it, and a larger ring needs rapl_read_sampler_free() */
+  rapl_sample_t samples[64];
+  RR_SAMPLER_START(10000, 64);
+  usleep(50000);
+  RR_SAMPLER_STOP();
+  CHECK(rapl_read_sampler_start(10000, 64) > 0, "sampler restart failed");
+  usleep(50000);
+  RR_SAMPLER_STOP();
+  size_t kept = rapl_read_sampler_drain(0, samples, 64);
+  CHECK(kept >= 8, "%zu samples drained after the restart", kept);
+  CHECK(rapl_read_sampler_start(10000, 128) < 0, "sampler restarted with a larger ring");
+  rapl_read_sampler_free();
+  CHECK(rapl_read_sampler_drain(0, samples, 64) == 0, "samples drained after rapl_read_sampler_free()");
+  CHECK(rapl_read_sampler_start(10000, 128) > 0, "sampler restart after rapl_read_sampler_free() failed");
+  RR_SAMPLER_STOP();
+
+  /* the sampler that the exporter started is released when it stops, so that the
+     application can start one with larger rings */
+  rapl_read_sampler_free();
+  char prom[] = "/tmp/raplread-prom-XXXXXX";
+  int fd = mkstemp(prom);
+  CHECK(fd >= 0 && rapl_read_export_textfile(prom, 100) == 0, "cannot export to %s", prom);
+  usleep(50000);
+  RR_EXPORT_STOP();
+  CHECK(rapl_read_sampler_start(10000, 128) > 0, "sampler start after the exporter failed");
+  RR_SAMPLER_STOP();
+  if (fd >= 0)
+    {
+      close(fd);
+      unlink(prom);
+    }
+
+  /* a binary trace of samples of both sockets, decoded by test_replay.sh */
+  RR_TRACE_OPEN(argv[1], 64);
+  int i;
+  for (i = 0; i < 5; i++)
+    {
+      RR_TRACE_SAMPLE();
+      usleep(100000);
+    }
+  RR_TRACE_CLOSE();
+
+  RR_TERM();
+  printf("%s: %s\n", __FILE__, failed ? "FAILED" : "ok");
+  return failed;
+}
@@ -0,0 +1,23 @@
+#!/bin/sh
+# runs tests/test_replay on the replay fixture, then decodes the binary trace that it
+# writes with raplread-decode and checks the power of the synthetic socket 1
+
+dir=$(dirname "$0")
+trace=$(mktemp /tmp/raplread-trace-XXXXXX)
+trap 'rm -f "$trace"' EXIT
+
+RAPL_BACKEND=replay RAPL_REPLAY="$dir/replay.trace" "$dir/test_replay" "$trace" || exit 1
+
+# the samples of socket 1 after the first one: pkg_w is within 5% of 100 W
+"$dir/../raplread-decode" -f csv "$trace" | awk -F, '
+  NR == 1 { for (i = 1; i <= NF; i++) col[$i] = i; next }
+  $col["record"] == "sample" && $col["socket"] == 1 && $col["interval_s"] > 0 {
+    n++
+    w = $col["pkg_w"]
+    if (w < 95 || w > 105) { printf("FAIL: decoded socket 1 package: %s W\n", w); bad = 1 }
+  }
+  END {
+    if (n < 4) { printf("FAIL: %d decoded samples of socket 1\n", n); bad = 1 }
+    printf("%s: %s\n", "tests/test_replay.sh", bad ? "FAILED" : "ok")
+    exit bad
+  }'